@@ -0,0 +1,379 @@
+/* accesslog.c: Asynchronous Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define LOG_RINGS       16                  /* Worker rings (more workers share them) */
+#define LOG_ENTRIES     1024                /* Entries per ring (power of two) */
+#define LOG_LINESIZ     500                 /* Longest line (longer ones are truncated) */
+#define LOG_BATCHSIZ    (64 << 10)          /* Bytes written at once */
+#define LOG_INTERVAL    5000000             /* Nanoseconds writer sleeps when idle */
+#define LOG_WAIT        1000000             /* Nanoseconds a blocked worker sleeps */
+
+/* Internal Declarations */
+
+/**
+ * One line of the log.
+ *
+ * sequence says whose turn the entry is: at position pos of the ring it is
+ * pos while free for a worker, pos + 1 once the worker has written its line,
+ * and pos + LOG_ENTRIES once the writer has taken the line (free again for
+ * the next lap).
+ **/
+struct log_entry {
+    uint32_t sequence;
+    uint32_t length;
+    char     line[LOG_LINESIZ];
+};
+
+/**
+ * Bounded ring one worker (thread or process) writes to and the writer
+ * drains.  Workers claim positions with a compare-and-swap on tail, so the
+ * few workers that have to share a ring (more than LOG_RINGS of them, or
+ * forked children) never lock; the writer is the only one that moves head.
+ **/
+struct log_ring {
+    uint32_t tail __attribute__ ((aligned(64)));    /*< Next position to claim */
+    uint32_t head __attribute__ ((aligned(64)));    /*< Next position to drain */
+    struct log_entry entries[LOG_ENTRIES];
+};
+
+/**
+ * Rings in anonymous shared memory, mapped before any workers are forked.
+ **/
+struct access_log {
+    uint32_t        nrings;                 /*< Rings handed out (wraps around) */
+    int             rotate;                 /*< Reopen log (set on SIGUSR1) */
+    struct log_ring rings[LOG_RINGS];
+};
+
+static struct access_log *Log = NULL;
+static __thread struct log_ring *Ring = NULL;
+static int             LogFd   = -1;        /*< Log file (writer process) */
+static pid_t           LogPid  = 0;         /*< Writer process */
+static pthread_mutex_t LogLock = PTHREAD_MUTEX_INITIALIZER;   /*< Held while draining */
+
+/* Timestamp of last second logged by this thread */
+static __thread time_t LogSecond = 0;
+static __thread char   LogTime[32];
+
+static void *access_log_writer(void *arg);
+
+/**
+ * Open log file (-1 on failure).
+ **/
+static int
+access_log_open(void)
+{
+    int fd = open(AccessLogPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        log("Unable to open access log %s: %s", AccessLogPath, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Reopen log on SIGUSR1 (after it has been moved aside for rotation).
+ *
+ * Any worker may receive the signal, so the request is left in shared memory
+ * for the writer.
+ **/
+static void
+access_log_hangup(int signum)
+{
+    if (Log) {
+        __atomic_store_n(&Log->rotate, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Map rings and start writer thread (once, before any workers are started).
+ *
+ * The writer lives in this process, which outlives the workers in every
+ * mode, and so do its atexit flush and SIGUSR1 handler.
+ **/
+void
+access_log_init(void)
+{
+    struct access_log *l;
+    struct sigaction action = { .sa_handler = access_log_hangup, .sa_flags = SA_RESTART };
+    pthread_t thread;
+
+    if (AccessLogPath == NULL || (LogFd = access_log_open()) < 0) {
+        return;
+    }
+
+    l = mmap(NULL, sizeof(struct access_log), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (l == MAP_FAILED) {
+        log("Unable to mmap access log: %s", strerror(errno));
+        close(LogFd);
+        return;
+    }
+    for (int i = 0; i < LOG_RINGS; i++) {
+        for (uint32_t pos = 0; pos < LOG_ENTRIES; pos++) {
+            l->rings[i].entries[pos].sequence = pos;
+        }
+    }
+    Log    = l;
+    LogPid = getpid();
+
+    sigaction(SIGUSR1, &action, NULL);
+    atexit(access_log_flush);
+
+    if ((errno = pthread_create(&thread, NULL, access_log_writer, NULL)) != 0) {
+        fatal("Unable to create access log writer: %s", strerror(errno));
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Append s to line at p (but not past end), quoted the way Apache quotes
+ * request fields: '"' and '\' are escaped, and control characters written
+ * as \xhh, so a client cannot forge log lines.
+ **/
+static char *
+access_log_quote(char *p, char *end, const char *s)
+{
+    static const char *Hex = "0123456789abcdef";
+
+    if (s == NULL || *s == '\0') {
+        s = "-";
+    }
+    for (; *s && p + 4 < end; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = Hex[c >> 4];
+            *p++ = Hex[c & 0xf];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+/**
+ * Append s to line at p as is (but not past end).
+ **/
+static char *
+access_log_append(char *p, char *end, const char *s)
+{
+    while (*s && p < end) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+/**
+ * Format line for response to request (Combined Log Format) into buffer of
+ * LOG_LINESIZ bytes and return its length.
+ **/
+static size_t
+access_log_format(struct request *r, char *buffer)
+{
+    char *end = buffer + LOG_LINESIZ - 1;
+    char *p = buffer;
+    char name[NI_MAXHOST];
+    time_t now = time(NULL);
+    int n;
+
+    /* Formatting the time once a second is plenty */
+    if (now != LogSecond) {
+        struct tm tm;
+
+        strftime(LogTime, sizeof(LogTime), "%d/%b/%Y:%H:%M:%S %z", localtime_r(&now, &tm));
+        LogSecond = now;
+    }
+
+    n = snprintf(p, end - p, "%s - - [%s] \"", resolver_lookup(r->host, name, sizeof(name)) ? name : r->host, LogTime);
+    p += n < end - p ? n : end - p;
+
+    if (r->method) {
+        p = access_log_quote(p, end, r->method);
+        p = access_log_append(p, end, " ");
+        p = access_log_quote(p, end, r->uri);
+        if (r->query && *r->query) {
+            p = access_log_append(p, end, "?");
+            p = access_log_quote(p, end, r->query);
+        }
+        n = snprintf(p, end - p, " HTTP/1.%d", r->minor);
+        p += n < end - p ? n : end - p;
+    } else {
+        p = access_log_quote(p, end, NULL);
+    }
+
+    n = snprintf(p, end - p, "\" %d %zu \"", r->code ? r->code : 500, r->nsent);
+    p += n < end - p ? n : end - p;
+    p = access_log_quote(p, end, r->method ? find_header(r, "Referer") : NULL);
+    p = access_log_append(p, end, "\" \"");
+    p = access_log_quote(p, end, r->method ? find_header(r, "User-Agent") : NULL);
+    p = access_log_append(p, end, "\"");
+    *p++ = '\n';
+    return p - buffer;
+}
+
+/**
+ * Queue line for response to request on the calling worker's ring.
+ *
+ * When the ring is full the line is dropped (and counted in the metrics),
+ * unless AccessLogBlock is set, in which case the worker waits for the
+ * writer to make room.
+ **/
+void
+access_log(struct request *r)
+{
+    struct log_ring *ring;
+    struct log_entry *e;
+    uint32_t pos;
+
+    if (Log == NULL) {
+        return;
+    }
+    if (Ring == NULL) {
+        Ring = &Log->rings[__atomic_fetch_add(&Log->nrings, 1, __ATOMIC_RELAXED) % LOG_RINGS];
+    }
+    ring = Ring;
+
+    /* Claim next free entry */
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while (true) {
+        e = &ring->entries[pos % LOG_ENTRIES];
+
+        int32_t turn = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) - pos;
+        if (turn == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (turn < 0) {
+            /* Full: the entry still holds a line from the last lap */
+            if (!AccessLogBlock) {
+                stats_count(STATS_LOG_DROPS);
+                return;
+            }
+            nanosleep(&(struct timespec){ .tv_nsec = LOG_WAIT }, NULL);
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        } else {
+            /* Another worker claimed it first */
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    e->length = access_log_format(r, e->line);
+    __atomic_store_n(&e->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write all of buffer to log (dropping it if the log cannot be written).
+ **/
+static void
+access_log_write(const char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t nwritten = write(LogFd, buffer, length);
+
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            log("Unable to write access log: %s", strerror(errno));
+            return;
+        }
+        buffer += nwritten;
+        length -= nwritten;
+    }
+}
+
+/**
+ * Move every line workers have finished to the log, in batches, and reopen
+ * the log first if asked to.  Returns whether there were any lines.
+ *
+ * Only one thread drains at a time (the writer, or exit).
+ **/
+static bool
+access_log_drain(void)
+{
+    static char batch[LOG_BATCHSIZ];
+    size_t nbatch = 0;
+    bool drained = false;
+
+    pthread_mutex_lock(&LogLock);
+
+    if (__atomic_exchange_n(&Log->rotate, 0, __ATOMIC_RELAXED)) {
+        int fd = access_log_open();
+
+        if (fd >= 0) {
+            close(LogFd);
+            LogFd = fd;
+        }
+    }
+
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = &Log->rings[i];
+        uint32_t pos = ring->head;
+
+        while (true) {
+            struct log_entry *e = &ring->entries[pos % LOG_ENTRIES];
+
+            /* Stop at entries that are free or still being written */
+            if (__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+                break;
+            }
+
+            if (nbatch + e->length > sizeof(batch)) {
+                access_log_write(batch, nbatch);
+                nbatch = 0;
+            }
+            memcpy(batch + nbatch, e->line, e->length);
+            nbatch += e->length;
+
+            __atomic_store_n(&e->sequence, pos + LOG_ENTRIES, __ATOMIC_RELEASE);
+            pos++;
+            drained = true;
+        }
+        ring->head = pos;
+    }
+
+    access_log_write(batch, nbatch);
+    pthread_mutex_unlock(&LogLock);
+    return drained;
+}
+
+/**
+ * Drain rings until the process exits, napping while they are empty.
+ **/
+static void *
+access_log_writer(void *arg)
+{
+    while (true) {
+        if (!access_log_drain()) {
+            nanosleep(&(struct timespec){ .tv_nsec = LOG_INTERVAL }, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write out lines still queued (at exit of the writer process).
+ **/
+void
+access_log_flush(void)
+{
+    if (Log && getpid() == LogPid) {
+        access_log_drain();
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
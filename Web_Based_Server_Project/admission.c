@@ -0,0 +1,227 @@
+/* admission.c: Connection Admission Control */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+/* Constants */
+
+#define ADMISSION_CLIENTS   4096            /* Per-client counters (clients hash to one) */
+#define CODEL_INTERVAL      100000000ULL    /* Nanoseconds delay must stay above target before shedding */
+
+/* Internal Declarations */
+
+/**
+ * Connection counts in anonymous shared memory, mapped before any workers
+ * are forked so that the limits hold across all of them.
+ *
+ * Clients are counted by a hash of their address, without storing it, so
+ * clients that collide share a cap: rare with ADMISSION_CLIENTS counters, and
+ * erring on the side of turning a client away rather than letting one in.
+ **/
+struct admission {
+    uint32_t connections __attribute__ ((aligned(64)));
+    uint32_t clients[ADMISSION_CLIENTS] __attribute__ ((aligned(64)));
+};
+
+static struct admission *Admission = NULL;
+
+/**
+ * Map connection counts (once, before any workers are started, and only if
+ * there are limits to enforce).
+ **/
+void
+admission_init(void)
+{
+    struct admission *a;
+
+    if (MaxConnections == 0 && MaxClientConnections == 0) {
+        return;
+    }
+
+    a = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (a == MAP_FAILED) {
+        fatal("Unable to mmap connection counts: %s", strerror(errno));
+    }
+    Admission = a;
+}
+
+/**
+ * Return counter of client with address (FNV-1a of the IP address, without
+ * the port, and with IPv4-mapped IPv6 addresses taken as IPv4).
+ **/
+static int
+admission_client(const struct sockaddr *addr)
+{
+    const unsigned char *bytes;
+    size_t length;
+    uint32_t hash = 2166136261u;
+
+    if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+
+        bytes  = a->s6_addr;
+        length = sizeof(a->s6_addr);
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            bytes  += 12;
+            length -= 12;
+        }
+    } else if (addr->sa_family == AF_INET) {
+        bytes  = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+        length = sizeof(struct in_addr);
+    } else {
+        return -1;
+    }
+
+    while (length--) {
+        hash = (hash ^ *bytes++) * 16777619u;
+    }
+    return hash % ADMISSION_CLIENTS;
+}
+
+/**
+ * Count connection from client at addr against MaxConnections and
+ * MaxClientConnections, or return false (counting nothing) if it would
+ * exceed either.  Admitted connections are uncounted by release_connection.
+ **/
+bool
+admit_connection(struct request *r, const struct sockaddr *addr)
+{
+    r->client = -1;
+    if (Admission == NULL) {
+        return true;
+    }
+
+    if (MaxConnections && __atomic_add_fetch(&Admission->connections, 1, __ATOMIC_RELAXED) > (uint32_t) MaxConnections) {
+        __atomic_sub_fetch(&Admission->connections, 1, __ATOMIC_RELAXED);
+        stats_count(STATS_REJECT_CONNECTIONS);
+        return false;
+    }
+
+    if (MaxClientConnections && (r->client = admission_client(addr)) >= 0 &&
+        __atomic_add_fetch(&Admission->clients[r->client], 1, __ATOMIC_RELAXED) > (uint32_t) MaxClientConnections) {
+        __atomic_sub_fetch(&Admission->clients[r->client], 1, __ATOMIC_RELAXED);
+        r->client = -1;
+        if (MaxConnections) {
+            __atomic_sub_fetch(&Admission->connections, 1, __ATOMIC_RELAXED);
+        }
+        stats_count(STATS_REJECT_CLIENT);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Uncount connection admitted by admit_connection.
+ **/
+void
+release_connection(struct request *r)
+{
+    if (Admission == NULL) {
+        return;
+    }
+    if (MaxConnections) {
+        __atomic_sub_fetch(&Admission->connections, 1, __ATOMIC_RELAXED);
+    }
+    if (r->client >= 0) {
+        __atomic_sub_fetch(&Admission->clients[r->client], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Turn client away with a 503 and close its socket, without ever blocking.
+ *
+ * Whatever request the client has sent already is read first: closing a
+ * socket with unread data resets the connection, which could discard the
+ * response.
+ **/
+void
+reject_connection(int fd)
+{
+    char buffer[BUFSIZ];
+    int length;
+
+    recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    length = snprintf(buffer, sizeof(buffer), "HTTP/1.1 503 Service Unavailable\r\n"
+                                              "Retry-After: %d\r\n"
+                                              "Content-Length: 0\r\n"
+                                              "Connection: close\r\n\r\n", RETRY_AFTER);
+    send(fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+/**
+ * Return integer square root of n (Newton's method).
+ **/
+static uint64_t
+isqrt(uint64_t n)
+{
+    uint64_t x = n, y = (n + 1) / 2;
+
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+/**
+ * Decide whether to shed work that has been waiting since the given time
+ * (monotonic_ns), by CoDel: once the queueing delay of a queue has stayed above
+ * ShedDelay milliseconds for a whole CODEL_INTERVAL, shed work from it at an
+ * increasing rate (the interval over the square root of the number shed so
+ * far) until the delay drops below ShedDelay again.  A standing queue is
+ * drained while bursts that clear within the interval are served in full.
+ **/
+bool
+codel_shed(struct codel *c, uint64_t since)
+{
+    uint64_t now;
+    bool above;
+
+    if (ShedDelay == 0) {
+        return false;
+    }
+
+    now = monotonic_ns();
+    if (now - since < ShedDelay * 1000000ULL) {
+        c->first_above = 0;
+        above = false;
+    } else if (c->first_above == 0) {
+        c->first_above = now + CODEL_INTERVAL;
+        above = false;
+    } else {
+        above = now >= c->first_above;
+    }
+
+    if (c->shedding) {
+        if (!above) {
+            c->shedding = false;
+            return false;
+        }
+        if (now < c->next) {
+            return false;
+        }
+        c->count++;
+    } else {
+        if (!above) {
+            return false;
+        }
+        /* Pick up near the last shedding rate if it ended only recently */
+        c->shedding = true;
+        c->count = c->count > 2 && now - c->next < 8 * CODEL_INTERVAL ? c->count - 2 : 1;
+    }
+
+    /* Square root to 1/1024 precision: sqrt(count * 2^20) / 2^10 */
+    c->next = now + (CODEL_INTERVAL << 10) / isqrt((uint64_t) c->count << 20);
+    stats_count(STATS_REJECT_DELAY);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
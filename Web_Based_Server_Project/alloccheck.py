@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+''' Check that spidey makes no allocations after the first request on a
+connection: each mode is started with the alloccount.so shim preloaded, a
+file is requested once on a keep-alive connection, and then REQUESTS more
+times, with the shim's allocation count taken in between. '''
+
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Globals
+
+MODES    = ['threaded', 'event', 'uring']
+REQUESTS = 1000
+PORT     = 9899
+SPIDEY   = './spidey'
+SHIM     = './alloccount.so'
+
+# Functions
+
+def usage(status=0):
+    sys.stderr.write('''Usage: {} [-p PORT -r REQUESTS] [MODES...]
+    -p  PORT        Port to run spidey on ({})
+    -r  REQUESTS    Requests after the first one ({})
+
+    MODES default to {}
+'''.format(os.path.basename(sys.argv[0]), PORT, REQUESTS, ' '.join(MODES)))
+    sys.exit(status)
+
+def request(stream, path):
+    ''' Send GET for path on keep-alive connection and read whole response '''
+    stream.write('GET {} HTTP/1.1\r\nHost: localhost\r\n\r\n'.format(path).encode())
+    stream.flush()
+
+    length = 0
+    while True:
+        line = stream.readline()
+        if not line:
+            raise IOError("Connection closed after {!r}".format(path))
+        if line in (b'\r\n', b'\n'):
+            break
+        name, _, value = line.decode().partition(':')
+        if name.lower() == 'content-length':
+            length = int(value)
+    stream.read(length)
+
+def allocations(pid, path):
+    ''' Have shim append allocation count to path, and return it '''
+    size = os.path.getsize(path) if os.path.exists(path) else 0
+    os.kill(pid, signal.SIGUSR2)
+    for _ in range(100):
+        time.sleep(0.01)
+        if os.path.exists(path) and os.path.getsize(path) > size:
+            with open(path) as stream:
+                return int(stream.read().split()[-1])
+    raise IOError('No allocation count from shim')
+
+def check(mode, root):
+    ''' Return allocations made by mode after the first request '''
+    count  = os.path.join(root, 'count')
+    env    = dict(os.environ, LD_PRELOAD=SHIM, ALLOC_COUNT=count)
+    server = subprocess.Popen([SPIDEY, '-c', mode, '-n', '1', '-k', str(REQUESTS + 2),
+                               '-p', str(PORT), '-r', root, '-a', os.path.join(root, 'access.log')],
+                              env=env, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                connection = socket.create_connection(('localhost', PORT))
+                break
+            except socket.error:
+                time.sleep(0.05)
+        else:
+            raise IOError('Unable to connect to spidey')
+
+        stream = connection.makefile('rwb')
+        request(stream, '/index.html')
+        before = allocations(server.pid, count)
+        for _ in range(REQUESTS):
+            request(stream, '/index.html')
+        after = allocations(server.pid, count)
+        connection.close()
+        return after - before
+    finally:
+        server.terminate()
+        server.wait()
+
+# Main execution
+
+if __name__ == '__main__':
+    arguments = sys.argv[1:]
+    modes     = []
+    while arguments:
+        argument = arguments.pop(0)
+        if argument == '-p' and arguments:
+            PORT = int(arguments.pop(0))
+        elif argument == '-r' and arguments:
+            REQUESTS = int(arguments.pop(0))
+        elif argument.startswith('-'):
+            usage(argument != '-h')
+        else:
+            modes.append(argument)
+
+    root   = tempfile.mkdtemp()
+    failed = False
+    try:
+        with open(os.path.join(root, 'index.html'), 'w') as stream:
+            stream.write('<h1>spidey</h1>\n' * 64)
+
+        for mode in modes or MODES:
+            n = check(mode, root)
+            print('{:10} {} allocations in {} requests'.format(mode, n, REQUESTS))
+            failed = failed or n != 0
+    finally:
+        shutil.rmtree(root)
+
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,105 @@
+/* alloccount: Allocation Counting Shim (LD_PRELOAD) */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* glibc's allocator, which the wrappers below forward to */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* Internal Declarations */
+
+static unsigned long Allocations = 0;  /*< Calls that may have allocated */
+static int           CountFd     = -1; /*< Where counts are reported (ALLOC_COUNT) */
+
+/**
+ * Report number of allocations so far as a line on CountFd (SIGUSR2
+ * handler, so only async-signal-safe calls).
+ **/
+static void
+alloccount_report(int signum)
+{
+    char buffer[32];
+    char *p = buffer + sizeof(buffer);
+    unsigned long n = __atomic_load_n(&Allocations, __ATOMIC_RELAXED);
+
+    *--p = '\n';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    write(CountFd, p, buffer + sizeof(buffer) - p);
+}
+
+/**
+ * Open ALLOC_COUNT (if set) and report counts there on SIGUSR2.
+ **/
+__attribute__((constructor))
+static void
+alloccount_init(void)
+{
+    const char *path = getenv("ALLOC_COUNT");
+
+    if (path && (CountFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) >= 0) {
+        signal(SIGUSR2, alloccount_report);
+    }
+}
+
+static void
+alloccount_count(void)
+{
+    __atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+}
+
+/* Allocator Wrappers */
+
+void *
+malloc(size_t size)
+{
+    alloccount_count();
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+    alloccount_count();
+    return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    alloccount_count();
+    return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    alloccount_count();
+    return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if ((*ptr = memalign(alignment, size)) == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
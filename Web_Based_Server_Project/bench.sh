@@ -0,0 +1,79 @@
+#!/bin/sh
+
+# Benchmark every concurrency mode on loopback (make bench).
+#
+# Serves the fixture tree (see fixtures.sh) with spidey in each of MODES,
+# loads it with thor (see thor.c) at each client concurrency in CONCURRENCY
+# for DURATION seconds per fixture, and prints one CSV row per run (also
+# saved to OUTPUT), so the results of two builds can be compared directly.
+#
+#   requests, errors          Responses, and failures or non-2xx responses
+#   requests_per_sec, mb_per_sec
+#   p50_us, p99_us            Latency percentiles in microseconds
+#   cpu_s                     CPU (user + system) the server and its workers
+#                             used during the run
+#   rss_kb                    Sum of peak resident set sizes of the server and
+#                             its workers so far
+
+SPIDEY=${SPIDEY:-./spidey}
+THOR=${THOR:-./thor}
+ROOT=${ROOT:-www}
+PORT=${PORT:-9898}
+MODES=${MODES:-single forking prefork threaded event uring}
+CONCURRENCY=${CONCURRENCY:-1 4 16 64}
+DURATION=${DURATION:-2}
+OUTPUT=${OUTPUT:-bench.csv}
+
+FIXTURES="1kb:/test.txt 1mb:/officer.txt 1gb:/sample.txt directory:/many/ cgi:/scripts/cowsay.sh"
+HZ=$(getconf CLK_TCK)
+CPUS=$(nproc)
+
+# Server and its workers (forked children, prefork workers, ...)
+server_pids() {
+	echo "$SERVER"
+	pgrep -P "$SERVER"
+}
+
+# Clock ticks of CPU used by server and its workers (and their reaped children)
+server_cpu() {
+	for pid in $(server_pids); do
+		cut -d ')' -f 2 "/proc/$pid/stat" 2> /dev/null
+	done | awk '{ ticks += $12 + $13 + $14 + $15 } END { print ticks + 0 }'
+}
+
+server_rss() {
+	for pid in $(server_pids); do
+		grep VmHWM "/proc/$pid/status" 2> /dev/null
+	done | awk '{ kb += $2 } END { print kb + 0 }'
+}
+
+./fixtures.sh "$ROOT" || exit 1
+
+echo "mode,concurrency,fixture,requests,errors,requests_per_sec,mb_per_sec,p50_us,p99_us,cpu_s,rss_kb" | tee "$OUTPUT"
+
+for mode in $MODES
+do
+	$SPIDEY -c "$mode" -p "$PORT" -r "$ROOT" 2> /dev/null &
+	SERVER=$!
+	sleep 1
+
+	for clients in $CONCURRENCY
+	do
+		threads=$(( clients < CPUS ? clients : CPUS ))
+
+		for fixture in $FIXTURES
+		do
+			cpu=$(server_cpu)
+			result=$($THOR -o csv -c "$clients" -t "$threads" -d "$DURATION" "http://127.0.0.1:$PORT${fixture#*:}" | tail -1)
+			cpu=$(( $(server_cpu) - cpu ))
+
+			echo "$result" | awk -F , -v mode="$mode" -v clients="$clients" -v fixture="${fixture%%:*}" \
+				-v cpu="$cpu" -v hz="$HZ" -v rss="$(server_rss)" \
+				'{ printf "%s,%d,%s,%d,%d,%.1f,%.2f,%.1f,%.1f,%.2f,%d\n",
+				   mode, clients, fixture, $4, $5 + $6, $8, $9 / 1048576, $11, $13, cpu / hz, rss }' | tee -a "$OUTPUT"
+		done
+	done
+
+	kill "$SERVER"
+	wait "$SERVER" 2> /dev/null || true
+done
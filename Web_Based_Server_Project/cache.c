@@ -0,0 +1,826 @@
+/* cache.c: Shared File Content Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_ENTRIES   4096                /* Maximum number of cached files */
+#define CACHE_BUCKETS   8192                /* Hash buckets */
+#define CACHE_MAX_FILE  (1 << 20)           /* Largest body cached */
+#define CACHE_ALIGN     16                  /* Arena block alignment */
+#define CACHE_MIN_BLOCK (4 * sizeof(int64_t))
+#define CACHE_FLIGHTS   64                  /* Responses generated at once for waiting requests */
+#define CACHE_CHECK     1                   /* Seconds between checks that a generator is alive */
+
+/* Internal Declarations */
+
+typedef enum {
+    CACHE_FREE,         /* Slot unused */
+    CACHE_FILLING,      /* Being read from disk (not served yet) */
+    CACHE_READY,        /* Served on hits */
+    CACHE_STALE,        /* Replaced while pinned: freed on last release */
+} cache_state;
+
+/**
+ * Cached response: an arena block holding the key (the path, prefixed with
+ * the content coding for compressed variants), the prebuilt status line and
+ * headers (all but Connection), and the body, back to back.
+ **/
+struct cache_entry {
+    cache_state     state;
+    int32_t         next;       /*< Next entry in bucket (-1 terminates) */
+    uint32_t        hash;
+    int32_t         refs;       /*< Requests sending from this entry */
+    bool            referenced; /*< Hit since the clock hand last passed */
+    int64_t         block;      /*< Offset of block payload in arena */
+    uint32_t        nkey;       /*< Length of key (NUL terminated) */
+    uint32_t        nheader;    /*< Length of prebuilt headers */
+    int64_t         nbody;      /*< Length of body */
+    int64_t         size;       /*< Size of file body was made from */
+    struct timespec mtime;      /*< Modification time of file */
+    int64_t         osize;      /*< Size of file the response is for (differs for siblings) */
+    struct timespec omtime;     /*< Modification time of that file */
+    int64_t         expires;    /*< Time a generated response goes stale (0 for files) */
+    int64_t         stale;      /*< Time it stops being served while being refreshed */
+};
+
+/**
+ * Response being generated for requests waiting on it (see cache_claim).
+ * Flights are matched by key hash, so a collision at worst has a request
+ * wait and then generate its own response.
+ **/
+struct cache_flight {
+    uint32_t        hash;
+    pid_t           pid;        /*< Process generating it (0 if slot unused) */
+};
+
+/**
+ * Content cache in anonymous shared memory, mapped before any workers are
+ * forked so that every process serves from the same copy.
+ *
+ * File data lives in an arena managed by a first-fit allocator with boundary
+ * tags (a size word at each end of every block, low bit set while in use), so
+ * freed neighbours coalesce.  When the arena or the entry table is full, a
+ * CLOCK hand sweeps the entries, giving recently hit ones a second chance and
+ * evicting the first unreferenced, unpinned one it finds.
+ *
+ * Besides files, it holds generated responses (CGI output) for a few seconds,
+ * and coalesces concurrent misses on them (see cache_claim).
+ **/
+struct cache {
+    pthread_mutex_t    lock;        /*< Robust, process-shared */
+    pthread_cond_t     landed;      /*< Signalled when a flight ends (process-shared) */
+    int64_t            size;        /*< Arena bytes */
+    int64_t            free_head;   /*< First free block (-1 if none) */
+    int32_t            free_entry;  /*< First unused entry (-1 if none) */
+    int32_t            hand;        /*< CLOCK hand */
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+    int32_t            buckets[CACHE_BUCKETS];
+    struct cache_flight flights[CACHE_FLIGHTS];
+    struct cache_entry entries[CACHE_ENTRIES];
+    char               arena[] __attribute__ ((aligned(CACHE_ALIGN)));
+};
+
+static struct cache *ContentCache = NULL;
+
+/* Connection header appended to prebuilt headers (indexed by keepalive) */
+static const char *CacheConnection[] = {
+    "Connection: close\r\n\r\n",
+    "Connection: keep-alive\r\n\r\n",
+};
+
+/* Arena Allocator */
+
+#define TAG(c, b)       (*(int64_t *) ((c)->arena + (b)))
+#define FOOTER(c, b, n) (*(int64_t *) ((c)->arena + (b) + (n) - sizeof(int64_t)))
+#define NEXT(c, b)      (*(int64_t *) ((c)->arena + (b) + sizeof(int64_t)))
+#define PREV(c, b)      (*(int64_t *) ((c)->arena + (b) + 2 * sizeof(int64_t)))
+
+static void
+arena_tag(struct cache *c, int64_t block, int64_t size, bool used)
+{
+    TAG(c, block) = FOOTER(c, block, size) = size | used;
+}
+
+static void
+arena_link(struct cache *c, int64_t block)
+{
+    NEXT(c, block) = c->free_head;
+    PREV(c, block) = -1;
+    if (c->free_head >= 0) PREV(c, c->free_head) = block;
+    c->free_head = block;
+}
+
+static void
+arena_unlink(struct cache *c, int64_t block)
+{
+    if (PREV(c, block) >= 0) NEXT(c, PREV(c, block)) = NEXT(c, block); else c->free_head = NEXT(c, block);
+    if (NEXT(c, block) >= 0) PREV(c, NEXT(c, block)) = PREV(c, block);
+}
+
+/**
+ * Allocate length bytes from arena.
+ *
+ * Returns offset of payload, or -1 if no free block is large enough.
+ **/
+static int64_t
+arena_alloc(struct cache *c, int64_t length)
+{
+    int64_t need = (length + 2 * sizeof(int64_t) + CACHE_ALIGN - 1) & ~(int64_t) (CACHE_ALIGN - 1);
+    int64_t size;
+
+    if (need < CACHE_MIN_BLOCK) need = CACHE_MIN_BLOCK;
+
+    for (int64_t block = c->free_head; block >= 0; block = NEXT(c, block)) {
+        if ((size = TAG(c, block)) < need) {
+            continue;
+        }
+
+        arena_unlink(c, block);
+        if (size - need >= (int64_t) CACHE_MIN_BLOCK) {
+            arena_tag(c, block + need, size - need, false);
+            arena_link(c, block + need);
+            size = need;
+        }
+        arena_tag(c, block, size, true);
+        return block + sizeof(int64_t);
+    }
+    return -1;
+}
+
+/**
+ * Return payload to arena, merging it with free neighbours.
+ **/
+static void
+arena_free(struct cache *c, int64_t payload)
+{
+    int64_t block = payload - sizeof(int64_t);
+    int64_t size  = TAG(c, block) & ~1;
+    int64_t neighbour;
+
+    if (block > 0 && !(FOOTER(c, block, 0) & 1)) {
+        neighbour = FOOTER(c, block, 0);
+        block    -= neighbour;
+        size     += neighbour;
+        arena_unlink(c, block);
+    }
+    if (block + size < c->size && !(TAG(c, block + size) & 1)) {
+        neighbour = TAG(c, block + size);
+        arena_unlink(c, block + size);
+        size     += neighbour;
+    }
+
+    arena_tag(c, block, size, false);
+    arena_link(c, block);
+}
+
+/* Entries */
+
+/**
+ * Hash path (FNV-1a).
+ **/
+static uint32_t
+cache_hash(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *s; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const char *
+cache_key_of(struct cache *c, struct cache_entry *e)
+{
+    return c->arena + e->block;
+}
+
+/**
+ * Acquire cache lock, recovering it if the previous owner died.
+ **/
+static void
+cache_lock(struct cache *c)
+{
+    if (pthread_mutex_lock(&c->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&c->lock);
+    }
+}
+
+/**
+ * Remove entry from its bucket.
+ **/
+static void
+cache_unhash(struct cache *c, int32_t index)
+{
+    int32_t *link = &c->buckets[c->entries[index].hash % CACHE_BUCKETS];
+
+    while (*link != index) link = &c->entries[*link].next;
+    *link = c->entries[index].next;
+}
+
+/**
+ * Release entry's block and return it to the unused entries.
+ **/
+static void
+cache_release_entry(struct cache *c, int32_t index)
+{
+    struct cache_entry *e = &c->entries[index];
+
+    arena_free(c, e->block);
+    e->state = CACHE_FREE;
+    e->next  = c->free_entry;
+    c->free_entry = index;
+}
+
+/**
+ * Remove entry from the cache, or mark it stale if requests still pin it.
+ **/
+static void
+cache_evict(struct cache *c, int32_t index)
+{
+    cache_unhash(c, index);
+    if (c->entries[index].refs > 0) {
+        c->entries[index].state = CACHE_STALE;
+    } else {
+        cache_release_entry(c, index);
+    }
+}
+
+/**
+ * Find an unused entry and a block of length bytes, evicting with the CLOCK
+ * hand until both are available.
+ *
+ * Returns entry index (with its block allocated), or -1 if nothing more can be
+ * evicted.
+ **/
+static int32_t
+cache_make_room(struct cache *c, int64_t length)
+{
+    int64_t block = -1;
+    int32_t index = -1;
+    struct cache_entry *e;
+
+    for (int steps = 0; steps <= 2 * CACHE_ENTRIES; steps++) {
+        if (index < 0 && (index = c->free_entry) >= 0) {
+            c->free_entry = c->entries[index].next;
+        }
+        if (block < 0) {
+            block = arena_alloc(c, length);
+        }
+        if (index >= 0 && block >= 0) {
+            c->entries[index].block = block;
+            return index;
+        }
+
+        e = &c->entries[c->hand];
+        if (e->state == CACHE_READY && e->refs == 0) {
+            if (e->referenced) {
+                e->referenced = false;
+            } else {
+                debug("Evicting %s from content cache", cache_key_of(c, e));
+                c->evictions++;
+                cache_evict(c, c->hand);
+            }
+        }
+        c->hand = (c->hand + 1) % CACHE_ENTRIES;
+    }
+
+    if (index >= 0) {
+        c->entries[index].next = c->free_entry;
+        c->free_entry = index;
+    }
+    if (block >= 0) {
+        arena_free(c, block);
+    }
+    return -1;
+}
+
+/**
+ * Find entry for key in any state other than stale (-1 if none).
+ **/
+static int32_t
+cache_find(struct cache *c, const char *key, uint32_t hash)
+{
+    for (int32_t index = c->buckets[hash % CACHE_BUCKETS]; index >= 0; index = c->entries[index].next) {
+        struct cache_entry *e = &c->entries[index];
+        if (e->hash == hash && streq(cache_key_of(c, e), key)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Pin entry for request and set it up to send the cached response.
+ **/
+static void
+cache_pin(struct cache *c, struct request *r, int32_t index)
+{
+    struct cache_entry *e = &c->entries[index];
+
+    e->refs++;
+    e->referenced  = true;
+    r->cached      = index;
+    r->body_offset = 0;
+    r->body_length = e->nheader + strlen(CacheConnection[r->keepalive]) + e->nbody;
+    r->responded   = true;
+}
+
+/* Interface */
+
+/**
+ * Map shared content cache with an arena of budget bytes (before forking any
+ * workers).  A budget of 0 disables the cache.
+ **/
+void
+cache_init(size_t budget)
+{
+    struct cache *c;
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cattr;
+    size_t size = sizeof(struct cache) + budget;
+
+    budget &= ~(size_t) (CACHE_ALIGN - 1);
+    if (budget < CACHE_MIN_BLOCK) {
+        return;
+    }
+
+    c = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (c == MAP_FAILED) {
+        log("Unable to mmap content cache: %s", strerror(errno));
+        return;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&c->landed, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        c->buckets[i] = -1;
+    }
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        c->entries[i].next = i + 1 < CACHE_ENTRIES ? i + 1 : -1;
+    }
+    c->free_entry = 0;
+    c->size       = budget;
+    c->free_head  = -1;
+    arena_tag(c, 0, budget, false);
+    arena_link(c, 0);
+
+    ContentCache = c;
+}
+
+/**
+ * Format cache key for path and encoding (absolute paths cannot collide with
+ * the "encoding:path" keys of compressed variants, which are keyed by the
+ * file they encode even when the body comes from a precompressed sibling, so
+ * a sibling requested directly has an entry of its own).
+ **/
+static void
+cache_key(char *key, size_t size, const char *path, const char *encoding)
+{
+    if (encoding) {
+        snprintf(key, size, "%s:%s", encoding, path);
+    } else {
+        snprintf(key, size, "%s", path);
+    }
+}
+
+/**
+ * Does entry still match the file its body was made from (info) and the file
+ * the response is for (original)?
+ **/
+static bool
+cache_current(struct cache_entry *e, const struct path_info *info, const struct path_info *original)
+{
+    return e->size == info->size && e->mtime.tv_sec == info->mtime.tv_sec && e->mtime.tv_nsec == info->mtime.tv_nsec &&
+           e->osize == original->size && e->omtime.tv_sec == original->mtime.tv_sec && e->omtime.tv_nsec == original->mtime.tv_nsec;
+}
+
+/**
+ * Look up file original (or its compressed variant if encoding is not NULL)
+ * in content cache, with a body made from info: the file itself, or its
+ * precompressed sibling.
+ *
+ * An entry only matches if the sizes and modification times of both files
+ * agree with the ones it was made from (which come from path_resolve, so they
+ * follow inotify); an entry for an older version is evicted.
+ *
+ * On a hit the entry is pinned until cache_release, and the response is sent
+ * with cache_write.  Returns whether the request was a hit.
+ **/
+bool
+cache_lookup(struct request *r, const struct path_info *info, const struct path_info *original, const char *encoding)
+{
+    struct cache *c = ContentCache;
+    struct cache_entry *e;
+    char key[PATH_MAX + 32];
+    uint32_t hash;
+    int32_t index;
+
+    if (c == NULL) {
+        return false;
+    }
+
+    cache_key(key, sizeof(key), original->path, encoding);
+    hash = cache_hash(key);
+    cache_lock(c);
+    if ((index = cache_find(c, key, hash)) >= 0) {
+        e = &c->entries[index];
+        if (e->state == CACHE_READY && cache_current(e, info, original)) {
+            c->hits++;
+            cache_pin(c, r, index);
+            pthread_mutex_unlock(&c->lock);
+            return true;
+        }
+        if (e->state == CACHE_READY) {
+            debug("Content cache entry for %s is stale", key);
+            cache_evict(c, index);
+        }
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return false;
+}
+
+/**
+ * Add response to content cache under key: the prebuilt headers (all but
+ * Connection and the blank line) and a body of length bytes, either copied
+ * from data or, if data is NULL, read from the file fd.  Files are recorded
+ * with the sizes and modification times of info (the file the body was made
+ * from) and original (the file the response is for), and generated responses
+ * with the times they expire and stop being served stale.
+ *
+ * The entry is reserved (so concurrent requests for the same key do not fill
+ * it twice) and then filled outside the lock.  If the file no longer matches
+ * info once it has been read, the entry is discarded.
+ *
+ * On success the entry is pinned as with cache_lookup.  Returns whether the
+ * response was cached.
+ **/
+static bool
+cache_store(struct request *r, const char *key, const struct path_info *info, const struct path_info *original,
+            time_t expires, time_t stale, const char *header, size_t nheader, int fd, const char *data, size_t length)
+{
+    struct cache *c = ContentCache;
+    struct cache_entry *e;
+    struct stat s;
+    size_t nkey;
+    uint32_t hash;
+    int32_t index;
+    char *block;
+    size_t nread;
+    ssize_t n;
+    bool complete;
+
+    if (c == NULL || length > CACHE_MAX_FILE || (int64_t) length > c->size / 8) {
+        return false;
+    }
+
+    nkey = strlen(key) + 1;
+    hash = cache_hash(key);
+
+    /* Reserve entry */
+    cache_lock(c);
+    if ((index = cache_find(c, key, hash)) >= 0) {
+        if (c->entries[index].state == CACHE_FILLING) {
+            pthread_mutex_unlock(&c->lock);
+            return false;
+        }
+        cache_evict(c, index);
+    }
+    if ((index = cache_make_room(c, nkey + nheader + length)) < 0) {
+        pthread_mutex_unlock(&c->lock);
+        return false;
+    }
+    e = &c->entries[index];
+    e->state      = CACHE_FILLING;
+    e->hash       = hash;
+    e->refs       = 1;
+    e->referenced = true;
+    e->nkey       = nkey;
+    e->nheader    = nheader;
+    e->nbody      = length;
+    e->size       = info ? info->size : 0;
+    e->mtime      = info ? info->mtime : (struct timespec) { 0, 0 };
+    e->osize      = original ? original->size : 0;
+    e->omtime     = original ? original->mtime : (struct timespec) { 0, 0 };
+    e->expires    = expires;
+    e->stale      = stale;
+    e->next       = c->buckets[hash % CACHE_BUCKETS];
+    c->buckets[hash % CACHE_BUCKETS] = index;
+
+    block = c->arena + e->block;
+    memcpy(block, key, nkey);
+    pthread_mutex_unlock(&c->lock);
+
+    /* Fill entry */
+    memcpy(block + nkey, header, nheader);
+    if (data) {
+        memcpy(block + nkey + nheader, data, length);
+        complete = true;
+    } else {
+        for (nread = 0; nread < length; nread += n) {
+            n = pread(fd, block + nkey + nheader + nread, length - nread, nread);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
+        complete = nread == length && fstat(fd, &s) == 0 && s.st_size == info->size &&
+                   s.st_mtim.tv_sec == info->mtime.tv_sec && s.st_mtim.tv_nsec == info->mtime.tv_nsec;
+    }
+
+    /* Publish entry, or give it back */
+    cache_lock(c);
+    if (complete) {
+        e->state = CACHE_READY;
+        e->refs--;
+        cache_pin(c, r, index);
+    } else {
+        debug("Unable to cache %s: changed while reading", key);
+        e->refs = 0;
+        cache_unhash(c, index);
+        cache_release_entry(c, index);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return complete;
+}
+
+/**
+ * Add file original (or its compressed variant if encoding is not NULL) to
+ * content cache, with a body made from info: the file itself, or its
+ * precompressed sibling (see cache_store).
+ **/
+bool
+cache_insert(struct request *r, const struct path_info *info, const struct path_info *original, const char *encoding,
+             const char *header, size_t nheader, int fd, const char *data, size_t length)
+{
+    char key[PATH_MAX + 32];
+
+    cache_key(key, sizeof(key), original->path, encoding);
+    return cache_store(r, key, info, original, 0, 0, header, nheader, fd, data, length);
+}
+
+/* Generated Responses */
+
+/**
+ * Find flight for key hash (NULL if none), forgetting it if the process
+ * generating it has died.
+ **/
+static struct cache_flight *
+cache_flight(struct cache *c, uint32_t hash)
+{
+    for (int i = 0; i < CACHE_FLIGHTS; i++) {
+        struct cache_flight *f = &c->flights[i];
+
+        if (f->pid == 0 || f->hash != hash) {
+            continue;
+        }
+        if (kill(f->pid, 0) < 0 && errno == ESRCH) {
+            debug("Generator %d of cached response died", f->pid);
+            f->pid = 0;
+            pthread_cond_broadcast(&c->landed);
+            return NULL;
+        }
+        return f;
+    }
+    return NULL;
+}
+
+/**
+ * Look up generated response for key, coalescing concurrent misses: the
+ * first request to miss is told to generate the response (and must then
+ * call cache_publish or cache_abandon), and later ones wait for it and are
+ * served what it published.  While an expired entry is being refreshed, it
+ * is served to everyone else until its stale time.
+ *
+ * On a hit the entry is pinned as with cache_lookup.  Returns CACHE_HIT,
+ * CACHE_MISS (generate and publish), or CACHE_BYPASS (generate without
+ * caching: no cache, too many misses at once, or nothing was published by
+ * the request this one waited on).
+ **/
+cache_result
+cache_claim(struct request *r, const char *key)
+{
+    struct cache *c = ContentCache;
+    struct cache_flight *f;
+    struct cache_entry *e;
+    struct timespec deadline;
+    uint32_t hash;
+    int32_t index;
+    bool waited = false;
+    time_t now;
+
+    if (c == NULL) {
+        return CACHE_BYPASS;
+    }
+
+    hash = cache_hash(key);
+    cache_lock(c);
+    while (true) {
+        now   = time(NULL);
+        index = cache_find(c, key, hash);
+        e     = index >= 0 ? &c->entries[index] : NULL;
+        f     = cache_flight(c, hash);
+
+        if (e && e->state == CACHE_READY && e->expires > 0 && (now < e->expires || (f && now < e->stale))) {
+            c->hits++;
+            cache_pin(c, r, index);
+            pthread_mutex_unlock(&c->lock);
+            return CACHE_HIT;
+        }
+
+        if (f == NULL) {
+            if (waited) {
+                pthread_mutex_unlock(&c->lock);
+                return CACHE_BYPASS;
+            }
+            c->misses++;
+            for (int i = 0; i < CACHE_FLIGHTS; i++) {
+                if (c->flights[i].pid == 0) {
+                    c->flights[i].hash = hash;
+                    c->flights[i].pid  = getpid();
+                    pthread_mutex_unlock(&c->lock);
+                    return CACHE_MISS;
+                }
+            }
+            pthread_mutex_unlock(&c->lock);
+            return CACHE_BYPASS;
+        }
+
+        /* Wait for the flight to land (checking now and then that its
+         * generator is still alive) */
+        deadline.tv_sec  = now + CACHE_CHECK;
+        deadline.tv_nsec = 0;
+        if (pthread_cond_timedwait(&c->landed, &c->lock, &deadline) == EOWNERDEAD) {
+            pthread_mutex_consistent(&c->lock);
+        }
+        waited = true;
+    }
+}
+
+/**
+ * End flight for key hash, waking the requests waiting on it.
+ **/
+static void
+cache_land(struct cache *c, uint32_t hash)
+{
+    cache_lock(c);
+    for (int i = 0; i < CACHE_FLIGHTS; i++) {
+        if (c->flights[i].pid == getpid() && c->flights[i].hash == hash) {
+            c->flights[i].pid = 0;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&c->landed);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Add response generated after cache_claim missed (see cache_store), fresh for
+ * ttl seconds and then served stale for up to stale more while being
+ * refreshed, and wake the requests waiting for it.
+ *
+ * Returns whether the response was cached (and pinned for the request).
+ **/
+bool
+cache_publish(struct request *r, const char *key, int ttl, int stale,
+              const char *header, size_t nheader, const char *data, size_t length)
+{
+    time_t now = time(NULL);
+    bool stored;
+
+    stored = cache_store(r, key, NULL, NULL, now + ttl, now + ttl + stale, header, nheader, -1, data, length);
+    cache_land(ContentCache, cache_hash(key));
+    return stored;
+}
+
+/**
+ * Give up generating response after cache_claim missed, so the requests
+ * waiting for it generate their own.
+ **/
+void
+cache_abandon(const char *key)
+{
+    cache_land(ContentCache, cache_hash(key));
+}
+
+/**
+ * Unpin request's cache entry (if any).
+ **/
+void
+cache_release(struct request *r)
+{
+    struct cache *c = ContentCache;
+    struct cache_entry *e;
+
+    if (r->cached < 0) {
+        return;
+    }
+
+    e = &c->entries[r->cached];
+    cache_lock(c);
+    if (--e->refs == 0 && e->state == CACHE_STALE) {
+        cache_release_entry(c, r->cached);
+    }
+    pthread_mutex_unlock(&c->lock);
+    r->cached = -1;
+}
+
+/**
+ * Fill iov with the part of the cached response not yet sent (the prebuilt
+ * headers, the Connection header, and the file), skipping the first
+ * r->body_offset bytes.
+ *
+ * Returns number of iovec entries used (at most 3).
+ **/
+int
+cache_iovec(struct request *r, struct iovec *iov)
+{
+    struct cache *c = ContentCache;
+    struct cache_entry *e = &c->entries[r->cached];
+    const char *connection = CacheConnection[r->keepalive];
+    char *data = c->arena + e->block + e->nkey;
+    size_t skip = r->body_offset;
+    int n = 0;
+
+    struct iovec parts[] = {
+        { data, e->nheader },
+        { (char *) connection, strlen(connection) },
+        { data + e->nheader, e->nbody },
+    };
+
+    for (int i = 0; i < 3; i++) {
+        if (skip >= parts[i].iov_len) {
+            skip -= parts[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *) parts[i].iov_base + skip;
+        iov[n].iov_len  = parts[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Write as much of the cached response as the socket accepts with a single
+ * writev.
+ *
+ * Returns bytes written (the caller advances body_offset and body_length), or
+ * -1 on error.
+ **/
+ssize_t
+cache_write(struct request *r)
+{
+    struct iovec iov[3];
+
+    return writev(r->fd, iov, cache_iovec(r, iov));
+}
+
+/**
+ * Report content cache hits, misses, and evictions (all processes).
+ **/
+void
+cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions)
+{
+    struct cache *c = ContentCache;
+
+    *hits = *misses = *evictions = 0;
+    if (c) {
+        cache_lock(c);
+        *hits      = c->hits;
+        *misses    = c->misses;
+        *evictions = c->evictions;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,213 @@
+/* encoding.c: HTTP Content Encodings */
+
+#include "spidey.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+/* Internal Declarations */
+
+static int gzip_compress(const char *data, size_t length, char **output, size_t *noutput);
+#ifdef HAVE_BROTLI
+static int brotli_compress(const char *data, size_t length, char **output, size_t *noutput);
+#endif
+
+/* Supported codings in order of preference (when equally acceptable).
+ * Precompressed siblings are served even if the library is not built in. */
+static const struct encoding Encodings[] = {
+#ifdef HAVE_BROTLI
+    { "br",   ".br", brotli_compress },
+#else
+    { "br",   ".br", NULL },
+#endif
+    { "gzip", ".gz", gzip_compress },
+};
+
+#define NENCODINGS  (sizeof(Encodings) / sizeof(Encodings[0]))
+
+_Static_assert(NENCODINGS == MAX_ENCODINGS, "MAX_ENCODINGS must match Encodings");
+
+/* Mimetypes (besides text/...) that are worth compressing */
+static const char *Compressible[] = {
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "application/x-javascript",
+    "image/svg+xml",
+};
+
+/**
+ * Compress with zlib in gzip format.
+ **/
+static int
+gzip_compress(const char *data, size_t length, char **output, size_t *noutput)
+{
+    z_stream z;
+    char *buffer;
+    int status;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    /* deflateBound does not count the gzip wrapper */
+    *noutput = deflateBound(&z, length) + 18;
+    if ((buffer = malloc(*noutput)) == NULL) {
+        deflateEnd(&z);
+        return -1;
+    }
+
+    z.next_in   = (Bytef *) data;
+    z.avail_in  = length;
+    z.next_out  = (Bytef *) buffer;
+    z.avail_out = *noutput;
+    status = deflate(&z, Z_FINISH);
+    *noutput = z.total_out;
+    deflateEnd(&z);
+
+    if (status != Z_STREAM_END) {
+        free(buffer);
+        return -1;
+    }
+    *output = buffer;
+    return 0;
+}
+
+#ifdef HAVE_BROTLI
+/**
+ * Compress with brotli (a middling quality, since this runs on a cache miss).
+ **/
+static int
+brotli_compress(const char *data, size_t length, char **output, size_t *noutput)
+{
+    char *buffer;
+
+    *noutput = BrotliEncoderMaxCompressedSize(length);
+    if (*noutput == 0 || (buffer = malloc(*noutput)) == NULL) {
+        return -1;
+    }
+    if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, length, (const uint8_t *) data, noutput, (uint8_t *) buffer)) {
+        free(buffer);
+        return -1;
+    }
+    *output = buffer;
+    return 0;
+}
+#endif
+
+/**
+ * Determine quality value the Accept-Encoding header gives coding (falling
+ * back to "*", and 0 if it is not mentioned).
+ **/
+static double
+encoding_quality(const char *accept, const char *name)
+{
+    double wildcard = 0;
+    const char *p = accept;
+    const char *q;
+    size_t length;
+    double value;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        length = strcspn(p, " \t,;");
+        if (length == 0) {
+            break;
+        }
+
+        /* Parameters: only q matters */
+        value = 1;
+        q = p + length;
+        q += strspn(q, " \t");
+        if (*q == ';') {
+            q += strspn(q + 1, " \t") + 1;
+            if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                value = strtod(q + 2, NULL);
+            }
+        }
+
+        if (length == strlen(name) && strncasecmp(p, name, length) == 0) {
+            return value;
+        }
+        if (length == 1 && *p == '*') {
+            wildcard = value;
+        }
+
+        p += strcspn(p, ",");
+    }
+    return wildcard;
+}
+
+/**
+ * Determine content codings the client accepts, best first (by quality
+ * value, then by server preference), excluding any it gives q=0.
+ *
+ * Returns the number of codings stored in choices (at most MAX_ENCODINGS).
+ **/
+size_t
+negotiate_encodings(struct request *r, const struct encoding **choices)
+{
+    const char *accept = find_header(r, "Accept-Encoding");
+    double quality[NENCODINGS];
+    size_t n = 0;
+
+    if (accept == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < NENCODINGS; i++) {
+        double q = encoding_quality(accept, Encodings[i].name);
+        size_t j;
+
+        if (q <= 0) {
+            continue;
+        }
+
+        /* Insertion sort (stable, so preference order breaks ties) */
+        for (j = n; j > 0 && quality[j - 1] < q; j--) {
+            quality[j] = quality[j - 1];
+            choices[j] = choices[j - 1];
+        }
+        quality[j] = q;
+        choices[j] = &Encodings[i];
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Determine whether responses with mimetype are worth compressing (text, and
+ * structured text formats, but not images, archives, and the like that are
+ * compressed already).
+ **/
+bool
+encoding_compressible(const char *mimetype)
+{
+    size_t length = strcspn(mimetype, "; \t");
+
+    if (strncasecmp(mimetype, "text/", 5) == 0) {
+        return true;
+    }
+    if (length > 5 && (strncasecmp(mimetype + length - 5, "+json", 5) == 0 ||
+                       strncasecmp(mimetype + length - 4, "+xml", 4) == 0)) {
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(Compressible) / sizeof(Compressible[0]); i++) {
+        if (strlen(Compressible[i]) == length && strncasecmp(mimetype, Compressible[i], length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,315 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX   256     /* Maximum events handled per epoll_wait */
+
+/* Internal Declarations */
+
+static struct request *IdleHead = NULL;     /*< Least recently active client */
+static struct request *IdleTail = NULL;     /*< Most recently active client */
+static struct codel    Codel;               /*< Shedding by queueing delay */
+static uint64_t        Woken    = 0;        /*< When epoll_wait returned (only if shedding by delay) */
+
+/**
+ * Record activity on client, moving it to the tail of the idle list.
+ **/
+void
+idle_touch(struct request *r)
+{
+    idle_remove(r);
+
+    r->active = time(NULL);
+    r->prev   = IdleTail;
+    r->next   = NULL;
+    if (IdleTail) {
+        IdleTail->next = r;
+    } else {
+        IdleHead = r;
+    }
+    IdleTail = r;
+}
+
+/**
+ * Remove client from the idle list (if it is on it).
+ **/
+void
+idle_remove(struct request *r)
+{
+    if (r->prev) {
+        r->prev->next = r->next;
+    } else if (IdleHead == r) {
+        IdleHead = r->next;
+    }
+    if (r->next) {
+        r->next->prev = r->prev;
+    } else if (IdleTail == r) {
+        IdleTail = r->prev;
+    }
+    r->prev = r->next = NULL;
+}
+
+/**
+ * Return least recently active client if it has been idle for longer than
+ * KeepAliveTimeout, or NULL if there is none.
+ **/
+struct request *
+idle_expired(time_t now)
+{
+    if (IdleHead && now - IdleHead->active >= KeepAliveTimeout) {
+        return IdleHead;
+    }
+    return NULL;
+}
+
+/**
+ * Close client connection.
+ **/
+static void
+event_close(struct request *r)
+{
+    idle_remove(r);
+    free_request(r);
+}
+
+/**
+ * Accept all pending clients and register them for read events.
+ **/
+static void
+event_accept(int efd, int sfd)
+{
+    struct request *request;
+    struct sockaddr_storage raddr;
+    struct epoll_event event;
+    socklen_t rlen;
+    int fd;
+
+    while (true) {
+        rlen = sizeof(raddr);
+        fd   = accept4(sfd, (struct sockaddr *) &raddr, &rlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        request = new_request(fd, (struct sockaddr *) &raddr, rlen);
+        if (request == NULL) {
+            continue;
+        }
+        request->nonblocking = true;
+
+        event.events   = EPOLLIN;
+        event.data.ptr = request;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Unable to epoll_ctl: %s\n", strerror(errno));
+            free_request(request);
+            continue;
+        }
+        idle_touch(request);
+    }
+}
+
+/**
+ * Write staged response and then send file body (if any) to client.
+ *
+ * The headers are sent with MSG_MORE when a body follows so that they share
+ * segments with it, and the body goes from the file to the socket with
+ * sendfile.  Responses from the content cache go out with writev.  Multipart
+ * range responses repeat this for each part (see next_part).
+ *
+ * Returns 1 when the response is complete, 0 if the socket would block, and -1
+ * on error.
+ **/
+static int
+event_write(struct request *r)
+{
+    ssize_t nwritten;
+
+    do {
+        int flags = r->body_length > 0 ? MSG_MORE : 0;
+
+        /* Write staged status line, headers, and body */
+        while (r->nwritten < r->noutput) {
+            nwritten = send(r->fd, r->output + r->nwritten, r->noutput - r->nwritten, flags);
+            if (nwritten < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            r->nwritten += nwritten;
+            r->nsent    += nwritten;
+        }
+        r->state = REQUEST_STREAMING_BODY;
+
+        /* Send cached response or file body from current offset */
+        while (r->body_length > 0) {
+            if (r->cached >= 0) {
+                nwritten = cache_write(r);
+                if (nwritten > 0) r->body_offset += nwritten;
+            } else {
+                nwritten = sendfile(r->fd, r->body_fd, &r->body_offset, r->body_length);
+            }
+            if (nwritten < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                debug("Unable to sendfile: %s", strerror(errno));
+                return -1;
+            }
+            if (nwritten == 0) {
+                debug("Unable to sendfile: truncated");
+                return -1;
+            }
+            r->body_length -= nwritten;
+            r->nsent       += nwritten;
+        }
+    } while (next_part(r));
+
+    return 1;
+}
+
+/**
+ * Switch the events a client is waiting for.
+ **/
+static void
+event_wait_for(int efd, struct request *r, uint32_t events)
+{
+    struct epoll_event event = { .events = events, .data.ptr = r };
+
+    epoll_ctl(efd, EPOLL_CTL_MOD, r->fd, &event);
+}
+
+/**
+ * Advance client connection state machine.
+ *
+ * While reading, buffer whatever the client has sent.  Once the headers are
+ * complete, handle the request (which stages the response in memory) and then
+ * write as much of the response as the socket accepts, switching the client
+ * to write events if it would block.  On a kept-alive connection this repeats
+ * for any pipelined requests already buffered, then goes back to waiting for
+ * read events.
+ **/
+static void
+event_process(int efd, struct request *r)
+{
+    bool writable = r->state >= REQUEST_WRITING_RESPONSE;   /* Waiting for EPOLLOUT */
+    int status;
+
+    idle_touch(r);
+
+    while (true) {
+        if (r->state < REQUEST_WRITING_RESPONSE) {
+            status = read_request(r);
+            if (status == 0) {
+                if (writable) event_wait_for(efd, r, EPOLLIN);
+                return;
+            }
+            if (status < 0 && r->nbuffer == 0) {
+                event_close(r);
+                return;
+            }
+
+            /* Handle request (or shed it, if the loop is falling behind)
+             * and finalize staged response */
+            r->shed = codel_shed(&Codel, Woken);
+            handle_request(r);
+            fflush(r->file);
+            r->state = REQUEST_WRITING_RESPONSE;
+            TRACE_BEGIN(r, TRACE_SEND);
+        }
+
+        status = event_write(r);
+        if (status == 0) {
+            if (!writable) event_wait_for(efd, r, EPOLLOUT);
+            return;
+        }
+
+        /* Response complete or failed: closing the socket removes it from epoll */
+        if (status < 0 || !r->keepalive) {
+            event_close(r);
+            return;
+        }
+        reset_request(r);
+    }
+}
+
+/**
+ * Handle HTTP requests from a single thread with a non-blocking epoll loop.
+ *
+ * Each client is a request struct that records how far it has gotten through
+ * reading the request and writing the response, so a slow or idle client
+ * costs only its buffers rather than a whole process or thread.  Clients that
+ * make no progress for KeepAliveTimeout seconds are closed.
+ *
+ * Clients ready at once queue up behind each other, so with ShedDelay a
+ * request that waited too long since epoll_wait returned is answered 503
+ * instead of handled (see codel_shed).
+ *
+ * Note that CGI scripts (spawned with posix_spawn) still run synchronously and
+ * block the loop while they execute.  Their output is staged in memory like
+ * any other response; only the blocking modes splice it to the client.
+ **/
+void
+event_server(int sfd)
+{
+    struct epoll_event events[EVENT_MAX];
+    struct epoll_event event;
+    int efd;
+    int n;
+
+    /* Create epoll instance and register non-blocking server socket */
+    if ((efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fatal("Unable to epoll_create: %s", strerror(errno));
+    }
+
+    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+    event.events   = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        fatal("Unable to epoll_ctl: %s", strerror(errno));
+    }
+
+    /* Dispatch events (waking at least once a second to expire idle clients) */
+    while (true) {
+        n = epoll_wait(efd, events, EVENT_MAX, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fatal("Unable to epoll_wait: %s", strerror(errno));
+        }
+        if (ShedDelay) {
+            Woken = monotonic_ns();
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                event_accept(efd, sfd);
+            } else {
+                event_process(efd, events[i].data.ptr);
+            }
+        }
+
+        for (struct request *r; (r = idle_expired(time(NULL))); ) {
+            debug("Closing idle connection from %s", r->host);
+            event_close(r);
+        }
+    }
+
+    /* Close server socket and exit */
+    close(efd);
+    close(sfd);
+    exit(EXIT_SUCCESS);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
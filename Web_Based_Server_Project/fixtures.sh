@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# Generate the www tree that bench.sh, latency.sh, and throughput.sh serve:
+#
+#   test.txt, officer.txt, sample.txt   1 KB, 1 MB, and 1 GB files
+#   text/hackers.txt                    A small text file
+#   many/                               A directory of 1000 small files
+#   scripts/cowsay.sh                   A CGI script
+#
+# The 1 GB file is sparse, so it takes no disk space (and is read from the
+# page cache of zero pages, like any cached file).  Files that already exist
+# with the right size are left alone.
+
+ROOT=${1:-www}
+
+# make_file PATH BYTES: PATH with BYTES of printable (compressible) text
+make_file() {
+	if [ "$(stat -c %s "$1" 2> /dev/null)" != "$2" ]; then
+		yes "The quick brown fox jumps over the lazy dog." | head -c "$2" > "$1"
+	fi
+}
+
+mkdir -p "$ROOT/text" "$ROOT/many" "$ROOT/scripts" || exit 1
+
+make_file "$ROOT/test.txt" 1024
+make_file "$ROOT/officer.txt" 1048576
+if [ "$(stat -c %s "$ROOT/sample.txt" 2> /dev/null)" != 1073741824 ]; then
+	rm -f "$ROOT/sample.txt"
+	truncate -s 1G "$ROOT/sample.txt" || exit 1
+fi
+make_file "$ROOT/text/hackers.txt" 4096
+
+if [ ! -e "$ROOT/many/f1000.txt" ]; then
+	for i in $(seq 1 1000); do
+		echo "$i" > "$ROOT/many/f$i.txt"
+	done
+fi
+
+cat > "$ROOT/scripts/cowsay.sh" <<'SCRIPT'
+#!/bin/sh
+echo "Content-Type: text/plain"
+echo
+echo " _____"
+echo "< moo >"
+echo " -----"
+echo "        \\   ^__^"
+echo "         \\  (oo)\\_______"
+echo "            (__)\\       )\\/\\"
+echo "                ||----w |"
+echo "                ||     ||"
+SCRIPT
+chmod +x "$ROOT/scripts/cowsay.sh"
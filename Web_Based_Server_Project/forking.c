@@ -12,44 +12,49 @@
  * Fork incoming HTTP requests to handle the concurrently.
  *
  * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * handle the request.  The number of children is bounded by MaxConnections
+ * (see admit_connection), and a client that cannot get one is answered 503.
  **/
 void
 forking_server(int sfd)
 {
     struct request *request;
-    http_status status;
     pid_t pid;
 
+    /* Ignore children (so they are reaped automatically) */
+    signal(SIGCHLD, SIG_IGN);
+
     /* Accept and handle HTTP request */
     while (true) {
     	/* Accept request */
         request = accept_request(sfd);
-        pid = fork();
+        if (request == NULL) {
+            continue;
+        }
 
-	
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
-	if (pid == 0) {
+        /* Reload mime types before forking so children inherit them */
+        mime_reload();
+
+        /* Fork off child process to handle request */
+        pid = fork();
+        if (pid == 0) {
             close(sfd);
-            status = handle_request(request);
-            if (status != HTTP_STATUS_OK) {
-                fprintf(stderr, "%s", strerror(errno));
-                exit(1);
-            }                  
-            exit(0);
-        }
-        else if (pid > 0) {
+            handle_connection(request);
             free_request(request);
-        }
-        else if (pid < 0) {
-            fprintf(stderr, "%s", strerror(errno));
-            exit(1);
+            exit(0);
         }
 
-	
-	/* Fork off child process to handle request */
-        
+        if (pid < 0) {
+            /* Out of processes: turn the client away, but keep serving */
+            fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+            stats_count(STATS_REJECT_FORK);
+            reject_connection(request->fd);
+            request->fd = -1;
+        } else {
+            /* The connection is the child's now, which counts it closed */
+            request->counted = false;
+        }
+        free_request(request);
     }
 
     /* Close server socket and exit*/
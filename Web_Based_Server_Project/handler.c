@@ -2,18 +2,109 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <string.h>
+#include <strings.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define COMPRESS_MAX_FILE   (1 << 20)   /* Largest file compressed on the fly */
+#define RANGE_MAX           16          /* Most byte ranges served in one response */
+#define HTTP_DATE           "%a, %d %b %Y %H:%M:%S GMT"
+#define BLOCKING_IDLE_TIMEOUT 1         /* Seconds a blocking worker waits for a next request */
+#define CGI_SPLICE          (64 << 10)  /* Most CGI output moved per splice */
+#define CGI_PATH            "/usr/local/bin:/usr/bin:/bin"  /* PATH for CGI scripts if the server has none */
+#define CGI_CACHE_MAX       (256 << 10) /* Most CGI output collected for the CGI cache */
+
 /* Internal Declarations */
 http_status handle_browse_request(struct request *request);
 http_status handle_file_request(struct request *request);
 http_status handle_cgi_request(struct request *request);
 http_status handle_error(struct request *request, http_status status);
+static http_status handle_stats_request(struct request *r);
+static void write_encoding_headers(struct request *r, const char *encoding, bool vary);
+
+struct byte_range {
+    off_t   first;          /*< Offset of first byte */
+    off_t   last;           /*< Offset of last byte (inclusive) */
+};
+
+struct byteranges {
+    char    boundary[24];   /*< Multipart delimiter */
+    char   *mimetype;       /*< Content-Type of each part (in arena) */
+    off_t   size;           /*< Size of whole file */
+    size_t  nranges;
+    size_t  next;           /*< Next part to stage (nranges for the closing delimiter) */
+    struct byte_range ranges[RANGE_MAX];
+};
+
+static unsigned int Boundaries = 0;    /*< Multipart responses started (for boundaries) */
+
+struct cgi_response {
+    const char *status;     /*< Status (in output) */
+    const char *mimetype;   /*< Content-Type (in output, or DefaultMimeType) */
+    char       *headers;    /*< Other headers to forward (malloc'd) */
+    size_t      nheaders;
+    off_t       length;     /*< Content-Length given by script (-1 if none) */
+    bool        shared;     /*< Script allows shared caches to keep response */
+    size_t      nblock;     /*< Bytes of output taken by header block */
+};
+
+/**
+ * Write to client socket for the response stream of blocking modes, counting
+ * bytes sent (see stats_response).  The stream treats a short write as an
+ * error, so this writes everything unless the socket fails.
+ **/
+static ssize_t
+response_write(void *cookie, const char *buffer, size_t size)
+{
+    struct request *r = cookie;
+    size_t nwritten = 0;
+    ssize_t n;
+
+    while (nwritten < size) {
+        n = write(r->fd, buffer + nwritten, size - nwritten);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        nwritten += n;
+    }
+    r->nsent += nwritten;
+    return nwritten > 0 ? (ssize_t) nwritten : -1;
+}
+
+/**
+ * Close client socket along with its response stream (as fdopen streams do).
+ **/
+static int
+response_close(void *cookie)
+{
+    struct request *r = cookie;
+
+    return close(r->fd);
+}
+
+static cookie_io_functions_t ResponseStream = {
+    .write = response_write,
+    .close = response_close,
+};
 
 /**
  * Handle HTTP Request
@@ -28,60 +119,215 @@ handle_request(struct request *r)
 {
     http_status result;
 
+    clock_gettime(CLOCK_MONOTONIC, &r->started);
+    r->type = REQUEST_BAD;
+    r->code = 0;
+
+    /* Open response stream: non-blocking modes stage each response in memory
+     * and write it out from their event loop, blocking modes write to the
+     * socket (counting what is sent); either stream is kept for the whole
+     * connection */
+    if (r->file == NULL) {
+        if (r->nonblocking) {
+            r->file = open_memstream(&r->output, &r->noutput);
+        } else {
+            r->file = fopencookie(r, "w", ResponseStream);
+        }
+    }
+    if (r->file == NULL) {
+        fprintf(stderr, "Unable to open response stream: %s\n", strerror(errno));
+        r->keepalive = false;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    TRACE_END(r, TRACE_READ);
+
     /* Parse request */
-    if (parse_request(r) < 0){
+    TRACE_BEGIN(r, TRACE_PARSE);
+    int parsed = parse_request(r);
+    TRACE_END(r, TRACE_PARSE);
+
+    if (parsed < 0) {
         result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
         return result;
     }
 
-    /* Determine request path */
-    char* path = determine_request_path(r->uri);
+    /* Report metrics */
+    if (streq(r->uri, STATS_URI)) {
+        return handle_stats_request(r);
+    }
+
+    /* Shed load (but keep reporting metrics): answer at once, and close */
+    if (r->shed) {
+        r->keepalive = false;
+        return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+    }
+
+    /* Determine request path and type */
+    char path[PATH_MAX];
+    struct path_info info = { path };
 
-    if (path == NULL) {
+    TRACE_BEGIN(r, TRACE_RESOLVE);
+    int resolved = path_resolve(r->uri, &info);
+    TRACE_END(r, TRACE_RESOLVE);
+
+    if (resolved < 0) {
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
         return result;
     }
-    r->path = strdup(path);
+    if ((r->path = request_strdup(r, path)) == NULL) {
+        result = handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return result;
+    }
+    r->size  = info.size;
+    r->mtime = info.mtime;
+    r->ino   = info.ino;
+    r->type  = info.type;
     debug("HTTP REQUEST PATH: %s", r->path);
 
     /* Dispatch to appropriate request handler type */
-    request_type rt = determine_request_type((const char *)path);
-    switch(rt){    
+    TRACE_BEGIN(r, TRACE_HANDLE);
+    switch(info.type){    
     case REQUEST_BROWSE:
       debug("HTTP REQUEST TYPE: BROWSE");
       result = handle_browse_request(r);
-      if (result != HTTP_STATUS_OK){
-	result = handle_error(r, result);
-      }
       break;
 
     case REQUEST_CGI:
       debug("HTTP REQUEST TYPE: CGI");
       result = handle_cgi_request(r);
-      if (result != HTTP_STATUS_OK){
-        result = handle_error(r, result);
-      }
       break;
 
     case REQUEST_FILE:
       debug("HTTP REQUEST TYPE: FILE");
       result = handle_file_request(r);
-        if (result != HTTP_STATUS_OK){
-           result = handle_error(r, result);
-        }
       break;
 
     default:
-      result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+      result = HTTP_STATUS_NOT_FOUND;
       break;
 
     }
+    TRACE_END(r, TRACE_HANDLE);
+
+    /* Report errors, unless the response was already under way (in which
+     * case the client can only detect it by the connection closing) */
+    if (result != HTTP_STATUS_OK) {
+        if (r->responded) {
+            r->keepalive = false;
+        } else {
+            result = handle_error(r, result);
+        }
+    }
 
-    free (path);
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    debug("HTTP REQUEST STATUS: %s", http_status_string(result));
     return result;
 }
 
+/**
+ * Handle every request on a client connection.
+ *
+ * Requests are handled in the order they arrive (including pipelined requests
+ * already sitting in the request buffer) for as long as both sides keep the
+ * connection alive.  Waiting for the first request is bounded by
+ * KeepAliveTimeout, but since an idle connection holds a whole worker here,
+ * waiting for the next one is bounded by at most BLOCKING_IDLE_TIMEOUT, and a
+ * connection that closes or goes idle between requests is closed quietly.
+ *
+ * Responses written through the stream go out as several writes (a chunked
+ * body one flush per chunk), so Nagle's algorithm is disabled: otherwise each
+ * write after the first waits for the client's delayed ACK (about 40ms) on a
+ * kept-alive connection.  Files are sent corked instead (see send_file).
+ **/
+void
+handle_connection(struct request *r)
+{
+    struct timeval timeout = { .tv_sec = KeepAliveTimeout };
+    int nodelay = 1;
+
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    while (true) {
+        /* Wait for next request */
+        if (read_request(r) <= 0 && r->nbuffer == 0) {
+            break;
+        }
+
+        handle_request(r);
+        if (!r->keepalive) {
+            break;
+        }
+        reset_request(r);
+
+        if (r->nrequests == 1 && KeepAliveTimeout > BLOCKING_IDLE_TIMEOUT) {
+            timeout.tv_sec = BLOCKING_IDLE_TIMEOUT;
+            setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+    }
+}
+
+/**
+ * Write status line and standard headers of response.
+ *
+ * If length is non-negative, it is sent as the Content-Length.  Otherwise the
+ * body is sent with chunked transfer encoding if the client supports it (see
+ * write_chunk), or delimited by closing the connection if not.
+ *
+ * Handlers may write additional headers before calling end_headers.
+ **/
+void
+write_headers(struct request *r, const char *status, const char *mimetype, off_t length)
+{
+    r->code = atoi(status);
+    fprintf(r->file, "HTTP/1.1 %s\r\n", status);
+    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
+
+    if (length >= 0) {
+        fprintf(r->file, "Content-Length: %lld\r\n", (long long) length);
+    } else if (r->minor > 0) {
+        fputs("Transfer-Encoding: chunked\r\n", r->file);
+        r->chunked = true;
+    } else {
+        r->keepalive = false;
+    }
+
+    fprintf(r->file, "Connection: %s\r\n", r->keepalive ? "keep-alive" : "close");
+    r->responded = true;
+}
+
+/**
+ * End headers of response.
+ **/
+void
+end_headers(struct request *r)
+{
+    fputs("\r\n", r->file);
+}
+
+/**
+ * Write part of a response body with unknown length.
+ *
+ * Writing zero bytes ends the body.
+ **/
+void
+write_chunk(struct request *r, const char *data, size_t length)
+{
+    if (!r->chunked) {
+        fwrite(data, 1, length, r->file);
+        return;
+    }
+
+    if (length == 0) {
+        fputs("0\r\n\r\n", r->file);
+        return;
+    }
+
+    fprintf(r->file, "%zx\r\n", length);
+    fwrite(data, 1, length, r->file);
+    fputs("\r\n", r->file);
+}
+
 /**
  * Handle browse request
  *
@@ -94,23 +340,29 @@ http_status
 handle_browse_request(struct request *r)
 {
     struct dirent **entries;
+    char *body = NULL;
+    size_t length = 0;
+    FILE *fs;
     int n;
 
     /* Open a directory for reading or scanning */
-    r->file = fdopen(r->fd, "w+");
-    if(r->file == NULL){
-      http_status result = HTTP_STATUS_BAD_REQUEST;        
-      return handle_error(r, result);
-    }
     n = scandir(r->path, &entries, NULL, alphasort); 
+    if (n < 0) {
+        debug("Unable to scandir: %s", strerror(errno));
+        return HTTP_STATUS_NOT_FOUND;
+    }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
+    /* Render listing in memory so that its length is known up front */
+    fs = open_memstream(&body, &length);
+    if (fs == NULL) {
+        for (int i = 0; i < n; i++) free(entries[i]);
+        free(entries);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
 
-    fputs("HTTP/1.0 200 OK \r\nContent-Type: text/html\r\n",r->file);
-    fputs("\r\n", r->file);
-    fputs("<html>\r\n",r->file);
-    fputs("<body>\r\n",r->file);
-    fputs("<ul>\r\n", r->file);
+    fputs("<html>\r\n",fs);
+    fputs("<body>\r\n",fs);
+    fputs("<ul>\r\n", fs);
     
 
     /* For each entry in directory, emit HTML list item */
@@ -123,158 +375,1449 @@ handle_browse_request(struct request *r)
 	continue;
       }
       if (strstr(name,".jpg") || strstr(name,".png") || strstr(name,".jpeg")){
-	fprintf(r->file, "\t<img src=%s width=50 height =50/><li><a href = \"%s/%s\">%s</li>\r\n", name, streq(r->uri, "/") ? "" : r->uri, name, name);
+	fprintf(fs, "\t<img src=%s width=50 height =50/><li><a href = \"%s/%s\">%s</li>\r\n", name, streq(r->uri, "/") ? "" : r->uri, name, name);
       }
 
-      else fprintf(r->file, "\t<li><a href = \"%s/%s\">%s</li>\r\n", streq(r->uri, "/") ? "" : r->uri, name, name);     
+      else fprintf(fs, "\t<li><a href = \"%s/%s\">%s</li>\r\n", streq(r->uri, "/") ? "" : r->uri, name, name);     
       
       free(entries[i]);
     }
-    fputs("</ul>\r\n",r->file);
-    fputs("</body>\r\n", r->file);
-    fputs("</html>\r\n",r->file);
+    fputs("</ul>\r\n",fs);
+    fputs("</body>\r\n", fs);
+    fputs("</html>\r\n",fs);
     free(entries);
+    fclose(fs);
+
+    /* Compress listing with the best coding the client accepts */
+    const struct encoding *encodings[MAX_ENCODINGS];
+    const char *encoding = NULL;
+    size_t nencodings = negotiate_encodings(r, encodings);
+    char *compressed;
+    size_t ncompressed;
+
+    for (size_t i = 0; encoding == NULL && i < nencodings; i++) {
+        if (encodings[i]->compress && encodings[i]->compress(body, length, &compressed, &ncompressed) == 0) {
+            if (ncompressed < length) {
+                free(body);
+                body     = compressed;
+                length   = ncompressed;
+                encoding = encodings[i]->name;
+            } else {
+                free(compressed);
+            }
+        }
+    }
+
+    /* Write HTTP Header with OK Status and text/html Content-Type, then listing */
+    write_headers(r, http_status_string(HTTP_STATUS_OK), "text/html", length);
+    write_encoding_headers(r, encoding, true);
+    end_headers(r);
+    fwrite(body, 1, length, r->file);
+    free(body);
+
     /* Flush socket, return OK */
     fflush(r->file);
-    fclose(r->file);
     return HTTP_STATUS_OK;
     
 }
 
 /**
- * Handle file request
+ * Send headers buffered in the response stream followed by length bytes of
+ * file fd starting at offset, without copying the file through userspace.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * The socket is corked while the headers are flushed so that they go out in
+ * the same segments as the start of the body.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * Returns 0 on success, or -1 if the file or socket fails (or the file was
+ * truncated) partway through.
  **/
-http_status
-handle_file_request(struct request *r)
+static int
+send_file(struct request *r, int fd, off_t offset, off_t length)
 {
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    int cork = 1;
+    off_t end = offset + length;
+    ssize_t nsent;
 
-    /* Open file for reading */
-    fs = fopen(r->path, "r");    
+    setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    fflush(r->file);
 
-    if (fs == NULL){
-      return handle_error(r,HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    TRACE_BEGIN(r, TRACE_BODY);
+    while (offset < end) {
+        nsent = sendfile(r->fd, fd, &offset, end - offset);
+        if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent <= 0) {
+            debug("Unable to sendfile: %s", nsent < 0 ? strerror(errno) : "truncated");
+            break;
+        }
+        r->nsent += nsent;
+    }
+    TRACE_END(r, TRACE_BODY);
+
+    cork = 0;
+    setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    return offset < end ? -1 : 0;
+}
+
+/**
+ * Send response pinned in the content cache (non-blocking modes send it from
+ * their event loop).  Only 200 OK responses are cached.
+ **/
+static http_status
+send_cached(struct request *r)
+{
+    ssize_t nwritten;
+
+    r->code = 200;
+    if (r->nonblocking) {
+        return HTTP_STATUS_OK;
     }
 
-    /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);    
-    debug("mimetype: %s", mimetype);
-    
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file,"HTTP/1.0 200 OK \r\nContent-Type: %s\r\n",mimetype);
-    fputs("\r\n",r->file);
-
-    /* Read from file and write to socket in chunks */
-    while ((nread = fread(buffer, sizeof(char), BUFSIZ, fs))) {
-      if (fwrite(buffer, sizeof(char), nread, r->file) != nread) {
-        debug("Error Writing to Socket: %s", strerror(errno));       
-        goto fail;
-      }
-    }    
-    /* Close file, flush socket, deallocate mimetype, return OK */
     fflush(r->file);
-    fclose(fs);
-    free(mimetype);
+    TRACE_BEGIN(r, TRACE_BODY);
+    while (r->body_length > 0) {
+        nwritten = cache_write(r);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            debug("Unable to writev: %s", strerror(errno));
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        r->nsent       += nwritten;
+        r->body_offset += nwritten;
+        r->body_length -= nwritten;
+    }
+    TRACE_END(r, TRACE_BODY);
+
+    cache_release(r);
     return HTTP_STATUS_OK;
+}
 
-fail:
-    if (fs) fclose(fs);
-    free(mimetype);
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+/**
+ * Format entity tag of file described by info, from its inode, size, and
+ * modification time.  Compressed variants share the file's tag, but weak,
+ * since they are equivalent rather than byte for byte identical.
+ **/
+static void
+format_etag(char *buffer, size_t size, const struct path_info *info, bool weak)
+{
+    snprintf(buffer, size, "%s\"%llx-%llx-%llx\"", weak ? "W/" : "",
+             (unsigned long long) info->ino, (unsigned long long) info->size,
+             (unsigned long long) info->mtime.tv_sec * 1000000000ULL + info->mtime.tv_nsec);
 }
 
 /**
- * Handle file request
- *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * Format validator headers of file described by info (ETag and
+ * Last-Modified), plus Cache-Control if a policy covers its path.
  *
+ * Returns length of headers (as snprintf).
+ **/
+static int
+format_validators(char *buffer, size_t size, const struct path_info *info, bool weak)
+{
+    const char *policy = determine_cache_control(info->path);
+    char etag[64];
+    char date[64];
+    struct tm tm;
+
+    format_etag(etag, sizeof(etag), info, weak);
+    strftime(date, sizeof(date), HTTP_DATE, gmtime_r(&info->mtime.tv_sec, &tm));
+    return snprintf(buffer, size, "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s", etag, date,
+                    policy ? "Cache-Control: " : "", policy ? policy : "", policy ? "\r\n" : "");
+}
+
+/**
+ * Write validator headers of file described by info (see format_validators).
+ **/
+static void
+write_validators(struct request *r, const struct path_info *info, bool weak)
+{
+    char validators[BUFSIZ];
+
+    if (format_validators(validators, sizeof(validators), info, weak) < (int) sizeof(validators)) {
+        fputs(validators, r->file);
+    }
+}
+
+/**
+ * Format status line and headers of a cacheable response (all but the
+ * Connection header, which depends on the request), with the validators of
+ * file described by info.  Only the file itself (not a compressed variant) is
+ * offered for range requests.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * Returns length of headers, or -1 if they do not fit in buffer.
  **/
-http_status
-handle_cgi_request(struct request *r)
+static int
+format_headers(char *buffer, size_t size, const struct path_info *info, const char *mimetype, const char *encoding, bool vary, off_t length)
 {
-    FILE *pfs;
-    char buffer[BUFSIZ];
-    struct header *header;
+    char validators[BUFSIZ];
+    int n;
 
-    /* Export CGI environment variables from request:
-    * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
+    if (format_validators(validators, sizeof(validators), info, encoding != NULL) >= (int) sizeof(validators)) {
+        return -1;
+    }
 
-    setenv("QUERY_STRING", r->query, 1);
-    setenv("DOCUMENT_ROOT",RootPath,1);
-    setenv("REQUEST_URI",r->uri,1);
-    setenv("REMOTE_PORT",r->port,1);
-    setenv("REQUEST_METHOD",r->method,1);
-    setenv("REMOTE_ADDRESS", r->host, 1);
-    setenv("SCRIPT_FILENAME", r->path, 1);
-    setenv("SERVER_PORT", Port, 1);
+    n = snprintf(buffer, size, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%s%s%s%s%s%s",
+                 http_status_string(HTTP_STATUS_OK), mimetype, (long long) length,
+                 encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "",
+                 encoding ? "" : "Accept-Ranges: bytes\r\n",
+                 vary ? "Vary: Accept-Encoding\r\n" : "", validators);
+    return n < 0 || (size_t) n >= size ? -1 : n;
+}
 
-    /* Export CGI environment variables from request headers */
-    for (header = r->headers; header != NULL; header = header->next) {
-        if (streq("Host", header->name)) setenv("HTTP_HOST", header->value, 1);
-        else if (streq("Accept", header->name)) setenv("HTTP_ACCEPT", header->value, 1);
-        else if (streq("Accept-Language", header->name)) setenv("HTTP_ACCEPT_LANGUAGE", header->value, 1);
-        else if (streq("Accept-Encoding", header->name)) setenv("HTTP_ACCEPT_ENCODING", header->value, 1);
-        else if (streq("Connection", header->name)) setenv("HTTP_CONNECTION", header->value, 1);
-        else if (streq("User-Agent", header->name)) setenv("HTTP_USER_AGENT", header->value, 1);
+/**
+ * Write Content-Encoding (if any) and Vary headers of response.
+ **/
+static void
+write_encoding_headers(struct request *r, const char *encoding, bool vary)
+{
+    if (encoding) {
+        fprintf(r->file, "Content-Encoding: %s\r\n", encoding);
+    }
+    if (vary) {
+        fputs("Vary: Accept-Encoding\r\n", r->file);
     }
+}
+
+/**
+ * Send file described by info as the response body, from the content cache
+ * if it is there (or can be added), and otherwise with sendfile.
+ *
+ * The file may be a precompressed variant of the requested one (original,
+ * whose validators are sent), in which case encoding names its coding.
+ **/
+static http_status
+send_file_response(struct request *r, const struct path_info *info, const struct path_info *original,
+                   const char *mimetype, const char *encoding, bool vary)
+{
+    char header[BUFSIZ];
+    struct stat s;
+    int nheader;
+    int status;
+    int fd;
 
-    /* POpen CGI Script */
+    /* Serve from content cache */
+    if (cache_lookup(r, info, original, encoding)) {
+        return send_cached(r);
+    }
 
-    pfs = popen(r->path,"r");
-    if (pfs == NULL) {
-        debug("Could not open path: %s", strerror(errno));
-        http_status result = HTTP_STATUS_BAD_REQUEST;
-        return handle_error(r, result);
+    /* Open file for reading */
+    fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        debug("Unable to open file: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return HTTP_STATUS_NOT_FOUND;
     }
 
-    /* Copy data from popen to socket */
+    /* Add to content cache (and serve from there) if it fits */
+    nheader = format_headers(header, sizeof(header), original, mimetype, encoding, vary, s.st_size);
+    if (nheader >= 0 && cache_insert(r, info, original, encoding, header, nheader, fd, NULL, s.st_size)) {
+        close(fd);
+        return send_cached(r);
+    }
     
-    while(fgets(buffer, BUFSIZ, pfs)) {
-        fputs(buffer, r->file);
+    /* Write HTTP Headers with OK status, determined Content-Type, and size */
+    write_headers(r, http_status_string(HTTP_STATUS_OK), mimetype, s.st_size);
+    write_encoding_headers(r, encoding, vary);
+    if (encoding == NULL) {
+        fputs("Accept-Ranges: bytes\r\n", r->file);
+    }
+    write_validators(r, original, encoding != NULL);
+    end_headers(r);
+
+    /* Non-blocking modes stream the body themselves after the headers */
+    if (r->nonblocking) {
+        r->body_fd     = fd;
+        r->body_offset = 0;
+        r->body_length = s.st_size;
+        return HTTP_STATUS_OK;
+    }
+
+    /* Send headers and file, close file, return OK */
+    status = send_file(r, fd, 0, s.st_size);
+    close(fd);
+    return status < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+}
+
+/**
+ * Parse HTTP-date (IMF-fixdate) value.
+ *
+ * Returns the time, or -1 if value is not a date.
+ **/
+static time_t
+parse_http_date(const char *value)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(value, HTTP_DATE, &tm);
+    return end != NULL && *end == '\0' ? timegm(&tm) : -1;
+}
+
+/**
+ * Determine whether the client's copy of the file described by info is
+ * current, going by If-None-Match (weak comparison, so that the tags of
+ * compressed variants match too) or, failing that, If-Modified-Since.
+ *
+ * Sets *weak if the tag that matched was weak (so the 304 response repeats
+ * the tag the client holds).
+ **/
+static bool
+not_modified(struct request *r, const struct path_info *info, bool *weak)
+{
+    const char *value = find_header(r, "If-None-Match");
+    char etag[64];
+    size_t length;
+    time_t since;
+
+    *weak = false;
+    if (value == NULL) {
+        value = find_header(r, "If-Modified-Since");
+        return value && (since = parse_http_date(value)) >= 0 && info->mtime.tv_sec <= since;
+    }
+
+    format_etag(etag, sizeof(etag), info, false);
+    length = strlen(etag);
+    for (const char *p = value; *(p += strspn(p, " \t,")); p += strcspn(p, ",")) {
+        if (*p == '*') {
+            return true;
+        }
+        *weak = strncmp(p, "W/", 2) == 0;
+        if (strncmp(p + (*weak ? 2 : 0), etag, length) == 0) {
+            return true;
+        }
     }
+    *weak = false;
+    return false;
+}
+
+/**
+ * Send bodiless 304 response with the validators of the file described by
+ * info.
+ **/
+static http_status
+send_not_modified(struct request *r, const struct path_info *info, bool weak, bool vary)
+{
+    r->code = 304;
+    fprintf(r->file, "HTTP/1.1 %s\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED));
+    write_validators(r, info, weak);
+    write_encoding_headers(r, NULL, vary);
+    fprintf(r->file, "Connection: %s\r\n", r->keepalive ? "keep-alive" : "close");
+    end_headers(r);
+    r->responded = true;
 
-    /* Close popen, flush socket, return OK */
     fflush(r->file);
-    pclose(pfs);
     return HTTP_STATUS_OK;
 }
 
 /**
- * Handle displaying error page
+ * Parse Range header value into the ranges of a file of given size it asks
+ * for (at most RANGE_MAX), dropping any that start past the end of the file
+ * and clamping any that run past it.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * Returns the number of satisfiable ranges, or -1 if the value is not a valid
+ * byte range set (or has too many ranges), in which case the header should be
+ * ignored.
  **/
-http_status
-handle_error(struct request *r, http_status status)
+static int
+parse_ranges(const char *value, off_t size, struct byte_range *ranges)
 {
-    const char *status_string = http_status_string(status);
+    const char *p;
+    char *end;
+    long long first;
+    long long last;
+    int nspecs = 0;
+    int n = 0;
 
-    /* Write HTTP Header */
-    puts(r->headers->name);
+    if (strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
 
-    /* Write HTML Description of Error*/
-    //fprintf(r->file,"HTTP/1.0 %s \r\nConnection: close\r\nContent-Type: text/html\r\n\r\n", status_string);
-    fprintf(r->file,"HTTP/1.0 %s \r\n Content-Type: text/html\r\n\r\n", status_string);
+    for (p = value + 6; *(p += strspn(p, " \t,")); p += strspn(p, " \t")) {
+        if (++nspecs > RANGE_MAX) {
+            return -1;
+        }
+
+        if (*p == '-') {
+            /* Suffix: last n bytes */
+            if (!isdigit((unsigned char) p[1])) return -1;
+            last  = strtoll(p + 1, &end, 10);
+            first = last < size ? size - last : 0;
+            last  = last > 0 ? size - 1 : -1;
+        } else {
+            /* First to last (or end of file) */
+            if (!isdigit((unsigned char) *p)) return -1;
+            first = strtoll(p, &end, 10);
+            if (*end++ != '-') return -1;
+            if (isdigit((unsigned char) *end)) {
+                last = strtoll(end, &end, 10);
+                if (last < first) return -1;
+            } else {
+                last = size - 1;
+            }
+        }
+
+        p = end + strspn(end, " \t");
+        if (*p != '\0' && *p != ',') {
+            return -1;
+        }
+        if (first < size && first <= last) {
+            ranges[n].first = first;
+            ranges[n].last  = last < size ? last : size - 1;
+            n++;
+        }
+    }
+    return nspecs > 0 ? n : -1;
+}
+
+/**
+ * Determine whether the representation an If-Range header names (if there is
+ * one) is still the file described by info: its strong entity tag, or a date
+ * equal to its modification time.
+ **/
+static bool
+range_current(struct request *r, const struct path_info *info)
+{
+    const char *value = find_header(r, "If-Range");
+    char etag[64];
+
+    if (value == NULL) {
+        return true;
+    }
+    if (value[0] == '"') {
+        format_etag(etag, sizeof(etag), info, false);
+        return streq(value, etag);
+    }
+    return parse_http_date(value) == info->mtime.tv_sec;
+}
+
+/**
+ * Format delimiter and headers of part i of a multipart/byteranges body (or
+ * the closing delimiter if i is the number of ranges) into buffer.
+ *
+ * Returns length of the part header (as snprintf).
+ **/
+static int
+format_part(char *buffer, size_t size, const struct byteranges *b, size_t i)
+{
+    if (i == b->nranges) {
+        return snprintf(buffer, size, "\r\n--%s--\r\n", b->boundary);
+    }
+    return snprintf(buffer, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    b->boundary, b->mimetype, (long long) b->ranges[i].first, (long long) b->ranges[i].last,
+                    (long long) b->size);
+}
+
+/**
+ * Write header of the next part of a multipart/byteranges body to the
+ * response stream, and make its range the file body to send.
+ **/
+static void
+stage_part(struct request *r)
+{
+    struct byteranges *b = r->ranges;
+    char part[BUFSIZ];
+    int n = format_part(part, sizeof(part), b, b->next);
+
+    fwrite(part, 1, n, r->file);
+    if (b->next < b->nranges) {
+        r->body_offset = b->ranges[b->next].first;
+        r->body_length = b->ranges[b->next].last - b->ranges[b->next].first + 1;
+    }
+    b->next++;
+}
+
+/**
+ * Stage the next part of a multipart/byteranges response once the previous
+ * part has been sent (non-blocking modes call this from their event loop
+ * whenever the staged response and file body run out).
+ *
+ * Returns whether there was another part (or the closing delimiter) to send.
+ **/
+bool
+next_part(struct request *r)
+{
+    if (r->ranges == NULL || r->ranges->next > r->ranges->nranges || r->body_length > 0) {
+        return false;
+    }
+
+    fseeko(r->file, 0, SEEK_SET);
+    stage_part(r);
+    fflush(r->file);
+    r->nwritten = 0;
+    return true;
+}
+
+/**
+ * Send the byte ranges of file described by info that the Range header asks
+ * for: one range as a 206 response with a Content-Range header, several as a
+ * multipart/byteranges body with a part for each.  Ranges are sent straight
+ * from the file with sendfile (bypassing the content cache), and a request
+ * none of whose ranges are satisfiable gets a 416 response.
+ *
+ * Returns whether the ranges were sent (with status in *status): false if
+ * there is no valid Range header or If-Range does not match, in which case the
+ * whole file should be sent.
+ **/
+static bool
+send_ranges(struct request *r, const struct path_info *info, const char *mimetype, bool vary, http_status *status)
+{
+    const char *value = find_header(r, "Range");
+    struct byteranges *b;
+    struct stat s;
+    off_t length;
+    int n;
+    int fd;
+
+    if (value == NULL || !range_current(r, info) || (b = request_alloc(r, sizeof(*b))) == NULL) {
+        return false;
+    }
+
+    /* Open file for reading */
+    fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        debug("Unable to open file: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        *status = HTTP_STATUS_NOT_FOUND;
+        return true;
+    }
+
+    n = parse_ranges(value, s.st_size, b->ranges);
+    if (n < 0) {
+        close(fd);
+        return false;
+    }
+
+    /* Nothing to send but the size */
+    if (n == 0) {
+        close(fd);
+        write_headers(r, http_status_string(HTTP_STATUS_RANGE_NOT_SATISFIABLE), mimetype, 0);
+        fprintf(r->file, "Content-Range: bytes */%lld\r\n", (long long) s.st_size);
+        end_headers(r);
+        fflush(r->file);
+        *status = HTTP_STATUS_OK;
+        return true;
+    }
+
+    if (n == 1) {
+        /* Single range in place of the whole body */
+        r->body_offset = b->ranges[0].first;
+        r->body_length = b->ranges[0].last - b->ranges[0].first + 1;
+
+        write_headers(r, http_status_string(HTTP_STATUS_PARTIAL_CONTENT), mimetype, r->body_length);
+        fprintf(r->file, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long) b->ranges[0].first, (long long) b->ranges[0].last, (long long) s.st_size);
+    } else {
+        /* Multipart body, whose length is that of every part header and
+         * range plus the closing delimiter */
+        char type[BUFSIZ];
+
+        snprintf(b->boundary, sizeof(b->boundary), "%08x%08x",
+                 (unsigned int) time(NULL), __atomic_fetch_add(&Boundaries, 1, __ATOMIC_RELAXED));
+        b->mimetype = request_strdup(r, mimetype);
+        b->size     = s.st_size;
+        b->nranges  = n;
+        b->next     = 0;
 
-    fprintf(r->file, "<h1> %s Error </h1>\r\n", status_string);                                              
-    fprintf(r->file, "Better luck next time!");
+        length = 0;
+        for (size_t i = 0; i <= b->nranges; i++) {
+            int npart = format_part(NULL, 0, b, i);
 
+            if (b->mimetype == NULL || npart < 0 || npart >= BUFSIZ) {
+                close(fd);
+                return false;
+            }
+            length += npart + (i < b->nranges ? b->ranges[i].last - b->ranges[i].first + 1 : 0);
+        }
+
+        snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", b->boundary);
+        write_headers(r, http_status_string(HTTP_STATUS_PARTIAL_CONTENT), type, length);
+    }
+    write_encoding_headers(r, NULL, vary);
+    write_validators(r, info, false);
+    end_headers(r);
+
+    if (n > 1) {
+        r->ranges = b;
+        stage_part(r);
+    }
+
+    /* Non-blocking modes stream the ranges themselves after the headers */
+    if (r->nonblocking) {
+        r->body_fd = fd;
+        *status = HTTP_STATUS_OK;
+        return true;
+    }
+
+    /* Send each range after its part header (and the closing delimiter) */
+    while (true) {
+        if (send_file(r, fd, r->body_offset, r->body_length) < 0) {
+            close(fd);
+            *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            return true;
+        }
+        r->body_length = 0;
+        if (r->ranges == NULL || r->ranges->next > r->ranges->nranges) {
+            break;
+        }
+        stage_part(r);
+    }
+
+    close(fd);
+    *status = HTTP_STATUS_OK;
+    return true;
+}
+
+/**
+ * Send precompressed sibling of file (path plus the coding's extension) if it
+ * exists and is at least as new as the file.
+ *
+ * Returns whether the sibling was sent (with its status in *status).
+ **/
+static bool
+send_sibling(struct request *r, const struct path_info *info, const char *mimetype, const struct encoding *e, http_status *status)
+{
+    char path[PATH_MAX];
+    struct path_info sibling = { path };
+    char uri[BUFSIZ];
+    bool found;
+
+    if (snprintf(uri, sizeof(uri), "%s%s", r->uri, e->extension) >= (int) sizeof(uri) ||
+        path_resolve(uri, &sibling) < 0) {
+        return false;
+    }
+
+    found = sibling.type == REQUEST_FILE &&
+            (sibling.mtime.tv_sec > info->mtime.tv_sec ||
+             (sibling.mtime.tv_sec == info->mtime.tv_sec && sibling.mtime.tv_nsec >= info->mtime.tv_nsec));
+    if (found) {
+        debug("Sending precompressed %s", sibling.path);
+        *status = send_file_response(r, &sibling, info, mimetype, e->name, true);
+    }
+    return found;
+}
+
+/**
+ * Send file compressed with coding e, from the content cache if the
+ * compressed variant is there, and otherwise compressing it now (and adding
+ * the result to the cache).  Files larger than COMPRESS_MAX_FILE, and files
+ * that do not get any smaller, are not compressed.
+ *
+ * Returns whether the file was sent compressed (with its status in *status).
+ **/
+static bool
+send_compressed(struct request *r, const struct path_info *info, const char *mimetype, const struct encoding *e, http_status *status)
+{
+    char header[BUFSIZ];
+    char *data = NULL;
+    char *output = NULL;
+    size_t noutput;
+    off_t nread = 0;
+    ssize_t n;
+    int nheader;
+    int fd;
+
+    if (e->compress == NULL || info->size > COMPRESS_MAX_FILE) {
+        return false;
+    }
+
+    /* Serve from content cache */
+    if (cache_lookup(r, info, info, e->name)) {
+        *status = send_cached(r);
+        return true;
+    }
+
+    /* Read and compress file */
+    if ((fd = open(info->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+    if ((data = malloc(info->size + 1)) != NULL) {
+        while (nread < info->size && ((n = read(fd, data + nread, info->size - nread)) > 0 || (n < 0 && errno == EINTR))) {
+            if (n > 0) nread += n;
+        }
+    }
+    close(fd);
+
+    if (data == NULL || nread != info->size || e->compress(data, nread, &output, &noutput) < 0 || noutput >= (size_t) nread) {
+        free(data);
+        free(output);
+        return false;
+    }
+    free(data);
+    debug("Compressed %s with %s: %lld -> %zu bytes", info->path, e->name, (long long) nread, noutput);
+
+    /* Add to content cache (and serve from there), or send directly */
+    nheader = format_headers(header, sizeof(header), info, mimetype, e->name, true, noutput);
+    if (nheader >= 0 && cache_insert(r, info, info, e->name, header, nheader, -1, output, noutput)) {
+        *status = send_cached(r);
+    } else {
+        write_headers(r, http_status_string(HTTP_STATUS_OK), mimetype, noutput);
+        write_encoding_headers(r, e->name, true);
+        write_validators(r, info, true);
+        end_headers(r);
+        fwrite(output, 1, noutput, r->file);
+        fflush(r->file);
+        *status = HTTP_STATUS_OK;
+    }
+    free(output);
+    return true;
+}
+
+/**
+ * Handle file request
+ *
+ * This sends the specified file, compressed if its mimetype is worth
+ * compressing and the client accepts a content coding we support: a
+ * precompressed sibling (e.g. "file.gz") is preferred, and otherwise the file
+ * is compressed on the fly.  Range requests are served from the file itself,
+ * and conditional requests for a copy the client already holds get 304.
+ *
+ * If the path cannot be opened for reading, then handle error with
+ * HTTP_STATUS_NOT_FOUND.
+ **/
+http_status
+handle_file_request(struct request *r)
+{
+    const struct encoding *encodings[MAX_ENCODINGS];
+    struct path_info info = { r->path, REQUEST_FILE, r->size, r->mtime, r->ino };
+    const char *mimetype;
+    http_status status;
+    size_t nencodings = 0;
+    bool vary;
+    bool weak;
+
+    /* Determine mimetype */
+    TRACE_BEGIN(r, TRACE_MIMETYPE);
+    mimetype = determine_mimetype(r->path);    
+    TRACE_END(r, TRACE_MIMETYPE);
+    debug("mimetype: %s", mimetype);
+
+    /* Answer conditional request if the client's copy is current */
+    vary = encoding_compressible(mimetype);
+    if (not_modified(r, &info, &weak)) {
+        return send_not_modified(r, &info, weak, vary);
+    }
+
+    /* Send requested ranges of the file itself */
+    if (send_ranges(r, &info, mimetype, vary, &status)) {
+        return status;
+    }
+
+    /* Negotiate content coding */
+    if (vary) {
+        nencodings = negotiate_encodings(r, encodings);
+    }
+    for (size_t i = 0; i < nencodings; i++) {
+        if (send_sibling(r, &info, mimetype, encodings[i], &status)) {
+            return status;
+        }
+    }
+    for (size_t i = 0; i < nencodings; i++) {
+        if (send_compressed(r, &info, mimetype, encodings[i], &status)) {
+            return status;
+        }
+    }
+
+    return send_file_response(r, &info, &info, mimetype, NULL, vary);
+}
+
+/**
+ * Read header block of CGI script output from fd into buffer (of given size),
+ * stopping once it holds the blank line that ends the block, at end of file,
+ * or when full.  The buffer may also hold the start of the body.
+ *
+ * Returns number of bytes read, or -1 on failure.
+ **/
+static ssize_t
+read_cgi_headers(int fd, char *buffer, size_t size)
+{
+    size_t length = 0;
+    ssize_t nread;
+
+    while (length < size) {
+        nread = read(fd, buffer + length, size - length);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (nread == 0) {
+            break;
+        }
+        length += nread;
+
+        if (buffer[0] == '\n' || (length > 1 && buffer[0] == '\r' && buffer[1] == '\n') ||
+            memmem(buffer, length, "\n\n", 2) || memmem(buffer, length, "\n\r\n", 3)) {
+            break;
+        }
+    }
+    return length;
+}
+
+/**
+ * Parse header block at the start of CGI script output (as read by
+ * read_cgi_headers) in place, following CGI/1.1:
+ *
+ *  - Status sets the status, as does a complete "HTTP/1.x" status line from
+ *    a non-parsed header script.
+ *
+ *  - Location without Status redirects the client with 302 Found.
+ *
+ *  - Content-Length, if valid, is kept as the length of the body.  Other
+ *    framing and hop-by-hop headers are dropped since the server decides how
+ *    the body is delimited.
+ *
+ * Output that does not start with a header is all body, sent as
+ * DefaultMimeType.  Lines end with LF or CRLF.
+ **/
+static void
+parse_cgi_headers(char *buffer, size_t nbuffer, struct cgi_response *h)
+{
+    bool location = false;
+    char *p = buffer;
+    char *end = buffer + nbuffer;
+    FILE *hs;
+
+    h->status   = NULL;
+    h->mimetype = DefaultMimeType;
+    h->headers  = NULL;
+    h->nheaders = 0;
+    h->length   = -1;
+    h->shared   = true;
+    hs = open_memstream(&h->headers, &h->nheaders);
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        char *next = eol ? eol + 1 : end;
+        char *line_end = eol ? eol : end;
+        char *value;
+
+        if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+        if (line_end == p) {
+            p = next;
+            break;
+        }
+
+        /* Not a header: the body starts here */
+        if (strncmp(p, "HTTP/", 5) != 0 && memchr(p, ':', line_end - p) == NULL) {
+            break;
+        }
+        *line_end = '\0';
+
+        /* Non-parsed header script: keep its status line */
+        if (strncmp(p, "HTTP/", 5) == 0) {
+            h->status = skip_whitespace(skip_nonwhitespace(p));
+            p = next;
+            continue;
+        }
+
+        value  = strchr(p, ':');
+        *value++ = '\0';
+        value = skip_whitespace(value);
+        if (strcasecmp(p, "Status") == 0) {
+            h->status = value;
+        } else if (strcasecmp(p, "Content-Type") == 0) {
+            h->mimetype = value;
+        } else if (strcasecmp(p, "Content-Length") == 0) {
+            char *digits_end;
+            long long n = strtoll(value, &digits_end, 10);
+
+            if (digits_end != value && *skip_whitespace(digits_end) == '\0' && n >= 0) {
+                h->length = n;
+            }
+        } else if (strcasecmp(p, "Transfer-Encoding") != 0 &&
+                   strcasecmp(p, "Connection") != 0) {
+            location = location || strcasecmp(p, "Location") == 0;
+            if (strcasecmp(p, "Set-Cookie") == 0 ||
+                (strcasecmp(p, "Cache-Control") == 0 && (strcasestr(value, "private") || strcasestr(value, "no-"))))  {
+                h->shared = false;
+            }
+            if (hs) {
+                fprintf(hs, "%s: %s\r\n", p, value);
+            }
+        }
+        p = next;
+    }
+
+    if (h->status == NULL) {
+        h->status = location ? "302 Found" : "200 OK";
+    }
+    if (hs) {
+        fclose(hs);
+    }
+    h->nblock = p - buffer;
+}
+
+/**
+ * Write all of buffer to client socket (which has been flushed of staged
+ * output).
+ **/
+static int
+send_all(struct request *r, const char *buffer, size_t length, int flags)
+{
+    ssize_t nsent;
+
+    while (length > 0) {
+        nsent = send(r->fd, buffer, length, flags | MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        r->nsent += nsent;
+        buffer += nsent;
+        length -= nsent;
+    }
+    return 0;
+}
+
+/**
+ * Move exactly length bytes from pipe to client socket.
+ **/
+static int
+splice_all(struct request *r, int pfd, size_t length)
+{
+    ssize_t nspliced;
+
+    while (length > 0) {
+        nspliced = splice(pfd, NULL, r->fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (nspliced < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (nspliced == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        r->nsent += nspliced;
+        length -= nspliced;
+    }
+    return 0;
+}
+
+/**
+ * Splice rest of CGI body (remaining bytes, or up to end of file if negative)
+ * from pipe straight to the socket, without copying it through user space.
+ *
+ * A chunked body is sent one chunk per wakeup, sized by what the pipe holds.
+ **/
+static int
+splice_cgi_body(struct request *r, int pfd, off_t remaining)
+{
+    char header[32];
+    ssize_t nspliced;
+    int avail;
+
+    if (fflush(r->file) != 0) {
+        return -1;
+    }
+
+    if (!r->chunked) {
+        while (remaining != 0) {
+            size_t n = remaining < 0 || remaining > CGI_SPLICE ? CGI_SPLICE : remaining;
+
+            nspliced = splice(pfd, NULL, r->fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (nspliced < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (nspliced == 0) {
+                break;
+            }
+            r->nsent += nspliced;
+            if (remaining > 0) {
+                remaining -= nspliced;
+            }
+        }
+        return remaining > 0 ? -1 : 0;
+    }
+
+    while (true) {
+        struct pollfd pollfd = { .fd = pfd, .events = POLLIN };
+
+        if (poll(&pollfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ioctl(pfd, FIONREAD, &avail) < 0) {
+            return -1;
+        }
+        if (avail == 0) {
+            break;
+        }
+        if (avail > CGI_SPLICE) {
+            avail = CGI_SPLICE;
+        }
+
+        snprintf(header, sizeof(header), "%x\r\n", avail);
+        if (send_all(r, header, strlen(header), MSG_MORE) < 0 ||
+            splice_all(r, pfd, avail) < 0 ||
+            send_all(r, "\r\n", 2, MSG_MORE) < 0) {
+            return -1;
+        }
+    }
+    return send_all(r, "0\r\n\r\n", 5, 0);
+}
+
+/**
+ * Forward CGI response parsed into h, with the first nbody bytes of its body
+ * in body and the rest read from fd, which is a pipe if spliceable.  Bodies
+ * are spliced from pipes to the socket when responses go straight to it, and
+ * copied otherwise.
+ *
+ * Returns 0 on success, or -1 if reading the response failed partway.
+ **/
+static int
+forward_cgi_output(struct request *r, int fd, bool spliceable, const struct cgi_response *h, const char *body, size_t nbody)
+{
+    char buffer[BUFSIZ];
+    ssize_t nread = 0;
+    off_t remaining = h->length;
+
+    /* Forward status and headers, then any body read with them */
+    write_headers(r, h->status, h->mimetype, h->length);
+    fwrite(h->headers, 1, h->nheaders, r->file);
+    end_headers(r);
+
+    if (remaining >= 0 && (off_t) nbody > remaining) {
+        nbody = remaining;
+    }
+    if (nbody > 0) {
+        write_chunk(r, body, nbody);
+    }
+    if (remaining > 0) {
+        remaining -= nbody;
+    }
+
+    if (spliceable && !r->nonblocking) {
+        return splice_cgi_body(r, fd, remaining);
+    }
+
+    /* Copy rest of body to response */
+    while (remaining != 0) {
+        nread = read(fd, buffer, remaining < 0 || remaining > BUFSIZ ? BUFSIZ : remaining);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+        write_chunk(r, buffer, nread);
+        if (remaining > 0) {
+            remaining -= nread;
+        }
+    }
+    if (nread < 0 || remaining > 0) {
+        fflush(r->file);
+        return -1;
+    }
+    write_chunk(r, NULL, 0);
+    fflush(r->file);
+    return 0;
+}
+
+/**
+ * Forward CGI response (header block, then body) read from fd (see
+ * forward_cgi_output).
+ *
+ * Returns HTTP_STATUS_OK on success, HTTP_STATUS_BAD_GATEWAY if the script
+ * wrote nothing at all (it died or is broken), or
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR if reading the response failed.
+ **/
+static http_status
+forward_cgi_response(struct request *r, int fd, bool spliceable)
+{
+    char buffer[BUFSIZ];
+    struct cgi_response h;
+    ssize_t nread;
+    int status;
+
+    /* Leave room to terminate an unfinished last line */
+    if ((nread = read_cgi_headers(fd, buffer, sizeof(buffer) - 1)) < 0) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    if (nread == 0) {
+        return HTTP_STATUS_BAD_GATEWAY;
+    }
+    parse_cgi_headers(buffer, nread, &h);
+    status = forward_cgi_output(r, fd, spliceable, &h, buffer + h.nblock, nread - h.nblock);
+    free(h.headers);
+    return status < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+}
+
+/**
+ * Collect CGI/1.1 environment of request: the meta-variables (starting with
+ * CONTENT_LENGTH, as SCGI requires, and followed by REMOTE_ADDRESS, which
+ * older scripts expect, and the server's PATH) and then every header as
+ * HTTP_NAME (except Proxy, which scripts would mistake for a proxy setting).
+ * This is the whole environment of CGI scripts.
+ *
+ * Returns NULL-terminated array of "NAME=value" strings (allocated as one
+ * block), or NULL on failure.
+ **/
+static char **
+cgi_environment(struct request *r)
+{
+    char name[NI_MAXHOST];
+    char protocol[16];
+    const char *meta[][2] = {
+        { "CONTENT_LENGTH",    "0" },
+        { "GATEWAY_INTERFACE", "CGI/1.1" },
+        { "SERVER_SOFTWARE",   "spidey" },
+        { "SERVER_PROTOCOL",   protocol },
+        { "SERVER_PORT",       Port },
+        { "REQUEST_METHOD",    r->method },
+        { "REQUEST_URI",       r->uri },
+        { "QUERY_STRING",      r->query ? r->query : "" },
+        { "SCRIPT_NAME",       r->uri },
+        { "SCRIPT_FILENAME",   r->path },
+        { "DOCUMENT_ROOT",     RootPath },
+        { "REMOTE_ADDR",       r->host },
+        { "REMOTE_PORT",       r->port },
+        { "REMOTE_HOST",       resolver_lookup(r->host, name, sizeof(name)) ? name : r->host },
+        { "REMOTE_ADDRESS",    r->host },
+        { "PATH",              getenv("PATH") ? getenv("PATH") : CGI_PATH },
+    };
+    size_t nmeta = sizeof(meta) / sizeof(meta[0]);
+    size_t size  = (nmeta + r->nheaders + 1) * sizeof(char *);
+    char **env;
+    char *p;
+    size_t n = 0;
+
+    snprintf(protocol, sizeof(protocol), "HTTP/1.%d", r->minor);
+
+    /* Size every string, then fill them in after the pointers */
+    for (size_t i = 0; i < nmeta; i++) {
+        size += strlen(meta[i][0]) + strlen(meta[i][1]) + 2;
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+        size += strlen("HTTP_") + r->headers[i].nname + r->headers[i].nvalue + 2;
+    }
+    if ((env = malloc(size)) == NULL) {
+        return NULL;
+    }
+    p = (char *) (env + nmeta + r->nheaders + 1);
+
+    for (size_t i = 0; i < nmeta; i++) {
+        env[n++] = p;
+        p += sprintf(p, "%s=%s", meta[i][0], meta[i][1]) + 1;
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+        const char *header = r->buffer + r->headers[i].name;
+        const char *value  = r->buffer + r->headers[i].value;
+
+        if (strcasecmp(header, "Content-Length") == 0 || strcasecmp(header, "Proxy") == 0) {
+            continue;
+        }
+
+        env[n++] = p;
+        if (strcasecmp(header, "Content-Type") == 0) {
+            p += sprintf(p, "CONTENT_TYPE=%s", value) + 1;
+            continue;
+        }
+        p = stpcpy(p, "HTTP_");
+        for (; *header; header++) {
+            *p++ = *header == '-' ? '_' : toupper((unsigned char) *header);
+        }
+        p += sprintf(p, "=%s", value) + 1;
+    }
+    env[n] = NULL;
+    return env;
+}
+
+/**
+ * Handle SCGI request
+ *
+ * This passes the request to a persistent worker of the script (see scgi.c)
+ * and streams its response like a CGI script's.
+ *
+ * If every worker is busy and too many requests are already waiting, then
+ * handle error with HTTP_STATUS_SERVICE_UNAVAILABLE.
+ **/
+static http_status
+handle_scgi_request(struct request *r)
+{
+    char **env = cgi_environment(r);
+    http_status status;
+    int fd;
+
+    if (env == NULL) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    fd = scgi_request(r->path, env);
+    free(env);
+    if (fd < 0) {
+        return errno == EAGAIN ? HTTP_STATUS_SERVICE_UNAVAILABLE : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    if ((status = forward_cgi_response(r, fd, false)) != HTTP_STATUS_OK) {
+        debug("Unable to read SCGI response: %s", status == HTTP_STATUS_BAD_GATEWAY ? "no output" : strerror(errno));
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * Spawn CGI script directly (no shell) with an environment of its own (see
+ * cgi_environment), standard input from /dev/null, and standard output to a
+ * pipe.
+ *
+ * Returns read end of the pipe (storing the script's pid in pid), or -1 on
+ * failure.
+ **/
+static int
+spawn_cgi(struct request *r, pid_t *pid)
+{
+    char *argv[] = { r->path, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    char **env;
+    int pipefd[2];
+    int status;
+
+    if ((env = cgi_environment(r)) == NULL) {
+        return -1;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        debug("Unable to pipe: %s", strerror(errno));
+        free(env);
+        return -1;
+    }
+
+    /* Client sockets may lack close-on-exec, so close everything past the
+     * standard streams, and undo the server's ignoring of SIGPIPE */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    status = posix_spawn(pid, r->path, &actions, &attr, argv, env);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipefd[1]);
+    free(env);
+    if (status != 0) {
+        debug("Unable to spawn %s: %s", r->path, strerror(status));
+        close(pipefd[0]);
+        return -1;
+    }
+    return pipefd[0];
+}
+
+/**
+ * Format CGI cache key of request: the script, query, and values of the
+ * headers its output varies by (-V).
+ *
+ * Returns key (malloc'd), or NULL if the response must not be cached (the
+ * cache is disabled, or the request is not a GET or carries credentials).
+ **/
+static char *
+cgi_cache_key(struct request *r)
+{
+    char *key = NULL;
+    size_t nkey;
+    FILE *ks;
+
+    if (CgiCacheTTL <= 0 || !streq(r->method, "GET") || find_header(r, "Authorization")) {
+        return NULL;
+    }
+    if ((ks = open_memstream(&key, &nkey)) == NULL) {
+        return NULL;
+    }
+
+    fprintf(ks, "cgi:%s?%s", r->path, r->query ? r->query : "");
+    for (int i = 0; i < NCgiCacheVary; i++) {
+        const char *value = find_header(r, CgiCacheVary[i]);
+
+        fprintf(ks, "\n%s%s", value ? "=" : "", value ? value : "");
+    }
+    if (fclose(ks) != 0) {
+        free(key);
+        return NULL;
+    }
+    return key;
+}
+
+/**
+ * Generate response for CGI cache key after cache_claim missed: the script's
+ * whole output is collected, published, and sent from the cache (waking the
+ * requests waiting for it).  Output that may not be shared (anything but
+ * 200 OK, marked private, or too large) is forwarded as usual instead.
+ *
+ * Returns status as forward_cgi_response does.
+ **/
+static http_status
+fill_cgi_cache(struct request *r, const char *key, int fd)
+{
+    char header[BUFSIZ];
+    struct cgi_response h;
+    char *output;
+    size_t noutput = 0;
+    size_t nbody;
+    ssize_t nread = 0;
+    int nheader;
+    int status;
+
+    if ((output = malloc(CGI_CACHE_MAX + 1)) == NULL) {
+        cache_abandon(key);
+        return forward_cgi_response(r, fd, true);
+    }
+
+    /* Read all of output, unless there is too much (leaving room to
+     * terminate an unfinished last header line) */
+    while (noutput < CGI_CACHE_MAX) {
+        nread = read(fd, output + noutput, CGI_CACHE_MAX - noutput);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+        noutput += nread;
+    }
+    if (nread < 0 || noutput == 0) {
+        cache_abandon(key);
+        free(output);
+        return nread < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_BAD_GATEWAY;
+    }
+
+    parse_cgi_headers(output, noutput, &h);
+    nbody = noutput - h.nblock;
+    if (nread == 0 && h.shared && strncmp(h.status, "200", 3) == 0 && (h.length < 0 || h.length == (off_t) nbody)) {
+        nheader = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%.*s",
+                           h.status, h.mimetype, nbody, (int) h.nheaders, h.headers ? h.headers : "");
+        if (nheader < (int) sizeof(header) &&
+            cache_publish(r, key, CgiCacheTTL, CgiCacheStale, header, nheader, output + h.nblock, nbody)) {
+            free(h.headers);
+            free(output);
+            return send_cached(r);
+        }
+    }
+    cache_abandon(key);
+
+    status = forward_cgi_output(r, fd, true, &h, output + h.nblock, nbody);
+    free(h.headers);
+    free(output);
+    return status < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+}
+
+/**
+ * Handle CGI request
+ *
+ * This spawns the script (see spawn_cgi) and streams what it writes to the
+ * socket.
+ *
+ * The script's output starts with a header block (see parse_cgi_headers).
+ * The status and headers are forwarded and the rest is streamed as the body,
+ * chunked unless the script gave its length.  Scripts named *.scgi are run as
+ * persistent SCGI workers instead (see handle_scgi_request).
+ *
+ * If the CGI cache is enabled (-x), output of GET requests is kept for a few
+ * seconds, and concurrent requests for output not yet cached share a single
+ * run of the script (see cache_claim).
+ *
+ * If the script cannot be spawned, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+http_status
+handle_cgi_request(struct request *r)
+{
+    cache_result cached = CACHE_BYPASS;
+    char *key;
+    pid_t pid;
+    http_status status;
+    int fd;
+
+    if (scgi_script(r->path)) {
+        return handle_scgi_request(r);
+    }
+
+    /* Serve from CGI cache, or wait for a request generating the output */
+    if ((key = cgi_cache_key(r)) != NULL && (cached = cache_claim(r, key)) == CACHE_HIT) {
+        free(key);
+        return send_cached(r);
+    }
+
+    if ((fd = spawn_cgi(r, &pid)) < 0) {
+        if (cached == CACHE_MISS) {
+            cache_abandon(key);
+        }
+        free(key);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Forward response from script, then reap it (closing the pipe first, so
+     * a script with output left over is not stuck writing it) */
+    if (cached == CACHE_MISS) {
+        status = fill_cgi_cache(r, key, fd);
+    } else {
+        status = forward_cgi_response(r, fd, true);
+    }
+    close(fd);
+    waitpid(pid, NULL, 0);
+    free(key);
+    return status;
+}
+
+/**
+ * Handle metrics request (see STATS_URI) with the metrics of every worker in
+ * Prometheus text format.
+ **/
+static http_status
+handle_stats_request(struct request *r)
+{
+    char *body = NULL;
+    size_t length = 0;
+    FILE *bs;
+
+    if ((bs = open_memstream(&body, &length)) == NULL) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    stats_write(bs);
+    fclose(bs);
+
+    write_headers(r, http_status_string(HTTP_STATUS_OK), "text/plain; version=0.0.4", length);
+    fputs("Cache-Control: no-store\r\n", r->file);
+    end_headers(r);
+    fwrite(body, 1, length, r->file);
+    fflush(r->file);
+    free(body);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle displaying error page
+ *
+ * This writes an HTTP status error code and then generates an HTML message to
+ * notify the user of the error.
+ **/
+http_status
+handle_error(struct request *r, http_status status)
+{
+    const char *status_string = http_status_string(status);
+    char body[BUFSIZ];
+    int length;
+
+    /* Write HTML Description of Error*/
+    length = snprintf(body, sizeof(body), "<h1> %s Error </h1>\r\nBetter luck next time!", status_string);
+
+    /* Write HTTP Header */
+    write_headers(r, status_string, "text/html", length);
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+        fprintf(r->file, "Retry-After: %d\r\n", RETRY_AFTER);
+    }
+    end_headers(r);
+    fwrite(body, 1, length, r->file);
 
-    //fputs("\r\n</body>\r\n",r->file);
-    //fputs("</html>\r\n",r->file);
     /* Return specified status */ 
     fflush(r->file);
 
@@ -1,14 +1,49 @@
 #!/bin/sh
 
+# Compare latency across concurrency modes.
+#
+# Set SPIDEY to a spidey binary to start a local server in each of MODES (for
+# example: SPIDEY=./spidey MODES="single prefork event uring");
+# otherwise MODES just labels the rows for a server started by hand.  ROOT is
+# generated by fixtures.sh if missing.
+#
+# Latencies are median microseconds, as measured by thor (see thor.c).
+
+HOST=${HOST:-localhost}
+PORT=${PORT:-9898}
+ROOT=${ROOT:-www}
+MODES=${MODES:-single}
+
+# Median latency (p50_us column of thor's CSV) of 10 requests per connection
+p50() {
+	./thor -o csv -c "$1" -n $((10 * $1)) "$2" | tail -1 | cut -d , -f 11
+}
+
+[ -d "$ROOT" ] || ./fixtures.sh "$ROOT" || exit 1
+
 echo "| METHOD | PROCESSES | DIRECTORY | STATIC | CGI SCRIPTS |"
 echo "|--------|-----------|-----------|--------|-------------|"
 
-for num in 1 2 4
+for mode in $MODES
 do
-	DIRS=$(./thor.py -r 10 -p "$num"  http://student00.cse.nd.edu:9898 | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
-	STATS=$(./thor.py -r 10 -p "$num" http://student00.cse.nd.edu:9898/text/hackers.txt | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
-	CGIS=$(./thor.py -r 10 -p "$num" http://student00.cse.nd.edu:9898/scripts/cowsay.sh | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
+	if [ -n "$SPIDEY" ]; then
+		$SPIDEY -c "$mode" -p "$PORT" -r "$ROOT" 2> /dev/null &
+		SERVER=$!
+		sleep 1
+	fi
+
+	for num in 1 2 4
+	do
+		DIRS=$(p50 "$num" http://$HOST:$PORT/)
+		STATS=$(p50 "$num" http://$HOST:$PORT/text/hackers.txt)
+		CGIS=$(p50 "$num" http://$HOST:$PORT/scripts/cowsay.sh)
 	
-	printf "| SINGLE | %9d | %9s | %6s | %11s |\n" "$num" "$DIRS" "$STATS" "$CGIS"
+		printf "| %6s | %9d | %9s | %6s | %11s |\n" "$(echo $mode | tr a-z A-Z)" "$num" "$DIRS" "$STATS" "$CGIS"
+	done
+
+	if [ -n "$SPIDEY" ]; then
+		kill "$SERVER"
+		wait "$SERVER" 2> /dev/null
+	fi
 done
 
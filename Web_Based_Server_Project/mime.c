@@ -0,0 +1,276 @@
+/* mime.c: Mime Type Table */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+
+/* Internal Declarations */
+
+struct mime_entry {
+    const char        *extension;   /*< Lowercase extension (without '.') */
+    const char        *mimetype;
+    struct mime_entry *next;        /*< Next entry in bucket */
+};
+
+/**
+ * Extension to mimetype index built from MimeTypesPath.
+ *
+ * Extensions and mimetypes are tokenized in place in a single copy of the
+ * file, so a table is released with three frees.
+ **/
+struct mime_table {
+    char               *text;       /*< Contents of MimeTypesPath */
+    struct mime_entry  *entries;
+    size_t              nentries;
+    struct mime_entry **buckets;
+    size_t              mask;       /*< Number of buckets - 1 */
+    struct mime_table  *retired;    /*< Table this one replaced */
+};
+
+/* Looked up most often: moved to the front of their buckets */
+static const char *CommonExtensions[] = {
+    "html", "css", "js", "png", "jpg", "jpeg", "gif", "svg", "ico", "txt", "json",
+};
+
+static struct mime_table *MimeTable   = NULL;   /*< Current table */
+static pthread_mutex_t    MimeLock    = PTHREAD_MUTEX_INITIALIZER;  /*< Serializes reloads */
+static volatile sig_atomic_t MimeHangup = 0;    /*< SIGHUP received */
+
+/**
+ * Hash extension (case-insensitive FNV-1a).
+ **/
+static size_t
+mime_hash(const char *s, size_t length)
+{
+    size_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) s[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Release table.
+ **/
+static void
+mime_free(struct mime_table *t)
+{
+    if (t) {
+        free(t->buckets);
+        free(t->entries);
+        free(t->text);
+        free(t);
+    }
+}
+
+/**
+ * Read MimeTypesPath and build table from its rules.
+ *
+ * When an extension is listed more than once, the first rule wins (as it did
+ * when the file was scanned on every lookup).
+ *
+ * Returns NULL if the file cannot be read.
+ **/
+static struct mime_table *
+mime_build(void)
+{
+    struct mime_table *t;
+    struct mime_entry *e;
+    struct mime_entry **link;
+    size_t capacity = 0;
+    size_t nbuckets = 16;
+    size_t length   = 0;
+    char *line;
+    char *lstate;
+    char *mimetype;
+    char *token;
+    char *tstate;
+    FILE *fs;
+
+    if ((t = calloc(1, sizeof(struct mime_table))) == NULL) {
+        return NULL;
+    }
+
+    /* Slurp file */
+    if ((fs = fopen(MimeTypesPath, "r")) == NULL) {
+        debug("Unable to open %s: %s", MimeTypesPath, strerror(errno));
+        goto fail;
+    }
+    for (size_t n = BUFSIZ, nread; ; n *= 2) {
+        if ((line = realloc(t->text, n + 1)) == NULL) {
+            fclose(fs);
+            goto fail;
+        }
+        t->text = line;
+        nread   = fread(t->text + length, 1, n - length, fs);
+        length += nread;
+        if (length < n) break;
+    }
+    fclose(fs);
+    t->text[length] = '\0';
+
+    /* Tokenize rules: <MIMETYPE> <EXT1> <EXT2> ... */
+    for (line = strtok_r(t->text, "\n", &lstate); line; line = strtok_r(NULL, "\n", &lstate)) {
+        if (line[0] == '#' || (mimetype = strtok_r(line, WHITESPACE, &tstate)) == NULL) {
+            continue;
+        }
+        while ((token = strtok_r(NULL, WHITESPACE, &tstate))) {
+            if (t->nentries == capacity) {
+                capacity = capacity ? 2 * capacity : 1024;
+                if ((e = realloc(t->entries, capacity * sizeof(struct mime_entry))) == NULL) {
+                    goto fail;
+                }
+                t->entries = e;
+            }
+            for (char *c = token; *c; c++) *c = tolower((unsigned char) *c);
+            t->entries[t->nentries].extension = token;
+            t->entries[t->nentries].mimetype  = mimetype;
+            t->nentries++;
+        }
+    }
+
+    /* Index entries (at most two per bucket on average), inserting in reverse
+     * so that earlier rules end up in front */
+    while (nbuckets < 2 * t->nentries) nbuckets *= 2;
+    if ((t->buckets = calloc(nbuckets, sizeof(struct mime_entry *))) == NULL) {
+        goto fail;
+    }
+    t->mask = nbuckets - 1;
+
+    for (size_t i = t->nentries; i-- > 0; ) {
+        e = &t->entries[i];
+        link = &t->buckets[mime_hash(e->extension, strlen(e->extension)) & t->mask];
+        e->next = *link;
+        *link   = e;
+    }
+
+    /* Fast path: common extensions resolve on the first comparison */
+    for (size_t i = 0; i < sizeof(CommonExtensions) / sizeof(CommonExtensions[0]); i++) {
+        const char *ext = CommonExtensions[i];
+        struct mime_entry **head = &t->buckets[mime_hash(ext, strlen(ext)) & t->mask];
+
+        for (link = head; (e = *link); link = &e->next) {
+            if (streq(e->extension, ext)) {
+                *link   = e->next;
+                e->next = *head;
+                *head   = e;
+                break;
+            }
+        }
+    }
+
+    return t;
+
+fail:
+    mime_free(t);
+    return NULL;
+}
+
+/**
+ * Load mime types table at startup.
+ *
+ * If MimeTypesPath cannot be read, every lookup returns DefaultMimeType.
+ **/
+void
+mime_load(void)
+{
+    MimeTable = mime_build();
+    if (MimeTable == NULL) {
+        log("Unable to load %s, using %s for everything", MimeTypesPath, DefaultMimeType);
+    } else {
+        debug("Loaded %zu extensions from %s", MimeTable->nentries, MimeTypesPath);
+    }
+}
+
+/**
+ * Request reload of mime types table (SIGHUP handler).
+ **/
+void
+mime_hangup(int signum)
+{
+    MimeHangup = 1;
+}
+
+/**
+ * Reload mime types table if SIGHUP was received since the last check.
+ *
+ * The new table replaces the current one atomically, so concurrent lookups
+ * see one or the other.  A lookup may still be walking an old table, and the
+ * mimetype strings it handed out may be held by requests in progress for any
+ * length of time, so old tables are never freed (they are small and reloads
+ * are rare): each is kept reachable from the table that replaced it.  If
+ * MimeTypesPath cannot be read, the current table stays in place.
+ *
+ * Returns whether a reload was attempted.
+ **/
+bool
+mime_reload(void)
+{
+    struct mime_table *t;
+
+    if (!MimeHangup || !__atomic_exchange_n(&MimeHangup, 0, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&MimeLock);
+    if ((t = mime_build()) == NULL) {
+        log("Unable to reload %s, keeping current mime types", MimeTypesPath);
+    } else {
+        t->retired = MimeTable;
+        __atomic_store_n(&MimeTable, t, __ATOMIC_RELEASE);
+        log("Reloaded %zu extensions from %s", t->nentries, MimeTypesPath);
+    }
+    pthread_mutex_unlock(&MimeLock);
+    return true;
+}
+
+/**
+ * Determine mime-type from file extension
+ *
+ * This function finds the file's extension (case-insensitively) in the mime
+ * types table loaded from MimeTypesPath, which consists of rules in the
+ * following format:
+ *
+ *  <MIMETYPE>      <EXT1> <EXT2> ...
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ *
+ * The returned string is shared and must not be free'd.
+ **/
+const char *
+determine_mimetype(const char *path)
+{
+    struct mime_table *t;
+    struct mime_entry *e;
+    const char *base;
+    const char *ext;
+    size_t length;
+
+    mime_reload();
+
+    /* Find file extension (in the last path component) */
+    base = strrchr(path, '/');
+    ext  = strrchr(base ? base : path, '.');
+    if (ext == NULL || (t = __atomic_load_n(&MimeTable, __ATOMIC_ACQUIRE)) == NULL) {
+        return DefaultMimeType;
+    }
+    ext++;
+    length = strlen(ext);
+
+    for (e = t->buckets[mime_hash(ext, length) & t->mask]; e; e = e->next) {
+        if (strcasecmp(e->extension, ext) == 0) {
+            return e->mimetype;
+        }
+    }
+    return DefaultMimeType;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,440 @@
+/* pathcache.c: Request Path Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PATH_CACHE_ENTRIES  1024    /* Maximum number of cached URIs */
+#define PATH_CACHE_BUCKETS  2048    /* Hash buckets (power of two) */
+#define PATH_CACHE_EVENTS   (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Internal Declarations */
+
+struct path_entry {
+    char              *uri;
+    struct path_info   info;        /*< Path is the missing file's if status < 0 */
+    int                status;      /*< Result of path_resolve */
+    size_t             hash;
+    struct path_entry *next;        /*< Next entry in bucket */
+    struct path_entry *newer;       /*< LRU list links */
+    struct path_entry *older;
+};
+
+/**
+ * URI to resolved path and metadata cache.
+ *
+ * Every directory from RootPath down to a cached path is watched with
+ * inotify, and any event naming a path invalidates the entries at or below
+ * it, so pending events are drained before each lookup.  The cache belongs to
+ * a process (workers that fork get their own) and is shared by its threads.
+ **/
+static struct {
+    pthread_mutex_t    lock;
+    bool               initialized;
+    int                fd;          /*< inotify instance (-1 if disabled) */
+    char             **watches;     /*< Directory for each watch descriptor */
+    int                nwatches;
+    struct path_entry *buckets[PATH_CACHE_BUCKETS];
+    struct path_entry *newest;
+    struct path_entry *oldest;
+    size_t             nentries;
+    size_t             generation;  /*< Number of events drained */
+} Cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+/**
+ * Hash URI (FNV-1a).
+ **/
+static size_t
+path_hash(const char *s)
+{
+    size_t hash = 2166136261u;
+
+    for (; *s; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Set up inotify instance on first use.  Forking mode handles each connection
+ * in a new process, so a cache would never see a second hit there.
+ **/
+static void
+path_cache_init(void)
+{
+    Cache.initialized = true;
+    if (ConcurrencyMode == FORKING) {
+        return;
+    }
+    if ((Cache.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        log("Unable to inotify_init: %s, path cache disabled", strerror(errno));
+    }
+}
+
+/**
+ * Unlink entry from the LRU list.
+ **/
+static void
+path_cache_unlink(struct path_entry *e)
+{
+    if (e->newer) e->newer->older = e->older; else Cache.newest = e->older;
+    if (e->older) e->older->newer = e->newer; else Cache.oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+/**
+ * Link entry at the front of the LRU list.
+ **/
+static void
+path_cache_push(struct path_entry *e)
+{
+    e->older = Cache.newest;
+    if (Cache.newest) Cache.newest->newer = e; else Cache.oldest = e;
+    Cache.newest = e;
+}
+
+/**
+ * Unlink entry from its bucket and the LRU list, and release it.
+ **/
+static void
+path_cache_remove(struct path_entry *e)
+{
+    struct path_entry **link = &Cache.buckets[e->hash % PATH_CACHE_BUCKETS];
+
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    path_cache_unlink(e);
+
+    Cache.nentries--;
+    free(e->uri);
+    free(e->info.path);
+    free(e);
+}
+
+/**
+ * Invalidate entries whose path is prefix or lies below it (NULL for all).
+ **/
+static void
+path_cache_invalidate(const char *prefix)
+{
+    size_t length = prefix ? strlen(prefix) : 0;
+    struct path_entry *e;
+    struct path_entry *older;
+
+    for (e = Cache.newest; e; e = older) {
+        older = e->older;
+        if (prefix == NULL || (strncmp(e->info.path, prefix, length) == 0 &&
+            (e->info.path[length] == '\0' || e->info.path[length] == '/'))) {
+            debug("Invalidating %s", e->uri);
+            path_cache_remove(e);
+        }
+    }
+}
+
+/**
+ * Read pending inotify events and invalidate the entries they affect.
+ **/
+static void
+path_cache_drain(void)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    struct inotify_event *event;
+    ssize_t nread;
+
+    while ((nread = read(Cache.fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + nread; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *) p;
+            Cache.generation++;
+
+            if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) ||
+                event->wd < 0 || event->wd >= Cache.nwatches || Cache.watches[event->wd] == NULL) {
+                path_cache_invalidate(NULL);
+                if ((event->mask & IN_IGNORED) && event->wd >= 0 && event->wd < Cache.nwatches) {
+                    free(Cache.watches[event->wd]);
+                    Cache.watches[event->wd] = NULL;
+                }
+            } else if (event->len == 0) {
+                path_cache_invalidate(Cache.watches[event->wd]);
+            } else {
+                snprintf(path, sizeof(path), "%s/%s", Cache.watches[event->wd], event->name);
+                path_cache_invalidate(path);
+            }
+        }
+    }
+}
+
+/**
+ * Watch directory, remembering its path for the watch descriptor.
+ **/
+static int
+path_cache_watch(const char *directory)
+{
+    char **watches;
+    int wd;
+
+    if ((wd = inotify_add_watch(Cache.fd, directory, PATH_CACHE_EVENTS | IN_ONLYDIR)) < 0) {
+        debug("Unable to watch %s: %s", directory, strerror(errno));
+        return -1;
+    }
+
+    if (wd >= Cache.nwatches) {
+        if ((watches = realloc(Cache.watches, (wd + 1) * sizeof(char *))) == NULL) {
+            return -1;
+        }
+        memset(watches + Cache.nwatches, 0, (wd + 1 - Cache.nwatches) * sizeof(char *));
+        Cache.watches  = watches;
+        Cache.nwatches = wd + 1;
+    }
+    if (Cache.watches[wd] == NULL && (Cache.watches[wd] = strdup(directory)) == NULL) {
+        return -1;
+    }
+    return wd;
+}
+
+/**
+ * Watch every directory from RootPath down to the one containing path.
+ **/
+static int
+path_cache_watch_parents(const char *path)
+{
+    char directory[PATH_MAX];
+    size_t root = strlen(RootPath);
+
+    if (path_cache_watch(RootPath) < 0) {
+        return -1;
+    }
+
+    snprintf(directory, sizeof(directory), "%s", path);
+    for (char *slash = strchr(directory + root + (path[root] != '\0'), '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (path_cache_watch(directory) < 0) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+/**
+ * Check whether uri maps onto path directly (no symlinks, dot components, or
+ * repeated slashes), so that watching the directories along path sees every
+ * change that could affect how uri resolves.
+ **/
+static bool
+path_is_direct(const char *uri, const char *path)
+{
+    size_t root   = strlen(RootPath);
+    size_t length = strlen(uri);
+
+    while (length > 1 && uri[length - 1] == '/') length--;
+    if (streq(uri, "/") || length == 0) {
+        return path[root] == '\0';
+    }
+    return strncmp(path + root, uri, length) == 0 && path[root + length] == '\0';
+}
+
+/**
+ * Check whether uri names a file that does not exist in a directory that does
+ * (and that uri maps onto directly), so that creating the file will show up
+ * as an event in that directory.
+ *
+ * Returns the path the file would have (allocated), or NULL.
+ **/
+static char *
+path_missing(const char *uri)
+{
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+    struct stat s;
+    char *name;
+
+    if (snprintf(path, sizeof(path), "%s%s", RootPath, uri) >= (int) sizeof(path) || (name = strrchr(path, '/')) == NULL) {
+        return NULL;
+    }
+    if (streq(name, "/") || streq(name, "/.") || streq(name, "/..") || !path_is_direct(uri, path)) {
+        return NULL;
+    }
+
+    *name = '\0';
+    if (realpath(path, real) == NULL || !streq(real, path)) {
+        return NULL;
+    }
+    *name = '/';
+    if (lstat(path, &s) == 0 || errno != ENOENT) {
+        return NULL;
+    }
+    return strdup(path);
+}
+
+/**
+ * Resolve URI without the cache: realpath plus a stat of the result.
+ *
+ * If the result can be cached, *key is set to the path whose directories must
+ * be watched (allocated): the real path if uri maps onto it directly, or the
+ * path a missing file would have (see path_missing).  Otherwise *key is NULL.
+ *
+ * Returns 0 on success, or -1 if the path does not exist or is not under
+ * RootPath.
+ **/
+static int
+path_resolve_uncached(const char *uri, struct path_info *info, char **key)
+{
+    struct stat s;
+
+    *key = NULL;
+    if (determine_request_path(uri, info->path) != NULL && stat(info->path, &s) == 0) {
+        info->type  = determine_request_type(info->path);
+        info->size  = s.st_size;
+        info->mtime = s.st_mtim;
+        info->ino   = s.st_ino;
+        if (path_is_direct(uri, info->path)) {
+            *key = strdup(info->path);
+        }
+        return 0;
+    }
+
+    *key = path_missing(uri);
+    return -1;
+}
+
+/**
+ * Resolve request URI to a path under RootPath along with its type, size,
+ * modification time, and inode.
+ *
+ * Results for URIs that map directly onto the filesystem are cached (up to
+ * PATH_CACHE_ENTRIES, least recently used first out), including URIs of files
+ * that do not exist (so probing for optional files such as precompressed
+ * variants stays cheap).  Entries are invalidated by inotify when anything
+ * along the path changes.  A miss resolves the path, watches its directories,
+ * and then resolves it again, caching the second result only if no event
+ * arrived in the meantime.
+ *
+ * The path is stored in info->path, which must point to PATH_MAX bytes.
+ *
+ * Returns 0 on success, or -1 if the path does not exist or is not under
+ * RootPath.
+ **/
+int
+path_resolve(const char *uri, struct path_info *info)
+{
+    struct path_entry *e;
+    size_t hash = path_hash(uri);
+    size_t generation;
+    char *key;
+    int status;
+
+    pthread_mutex_lock(&Cache.lock);
+    if (!Cache.initialized) {
+        path_cache_init();
+    }
+    if (Cache.fd < 0) {
+        pthread_mutex_unlock(&Cache.lock);
+        status = path_resolve_uncached(uri, info, &key);
+        free(key);
+        return status;
+    }
+
+    /* Look up URI after applying pending invalidations */
+    path_cache_drain();
+    for (e = Cache.buckets[hash % PATH_CACHE_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash && streq(e->uri, uri)) {
+            break;
+        }
+    }
+    if (e) {
+        stats_count(STATS_PATH_HITS);
+        path_cache_unlink(e);
+        path_cache_push(e);
+        status = e->status;
+        if (status == 0) {
+            strcpy(info->path, e->info.path);
+            info->type  = e->info.type;
+            info->size  = e->info.size;
+            info->mtime = e->info.mtime;
+            info->ino   = e->info.ino;
+        }
+        pthread_mutex_unlock(&Cache.lock);
+        return status;
+    }
+    stats_count(STATS_PATH_MISSES);
+    pthread_mutex_unlock(&Cache.lock);
+
+    /* Resolve and watch the directories along the path */
+    status = path_resolve_uncached(uri, info, &key);
+    if (key == NULL) {
+        return status;
+    }
+
+    pthread_mutex_lock(&Cache.lock);
+    if (path_cache_watch_parents(key) < 0) {
+        pthread_mutex_unlock(&Cache.lock);
+        free(key);
+        return status;
+    }
+    path_cache_drain();
+    generation = Cache.generation;
+    pthread_mutex_unlock(&Cache.lock);
+
+    /* Resolve again now that changes are being watched */
+    free(key);
+    status = path_resolve_uncached(uri, info, &key);
+    if (key == NULL) {
+        return status;
+    }
+
+    pthread_mutex_lock(&Cache.lock);
+    path_cache_drain();
+    if (generation != Cache.generation || (e = calloc(1, sizeof(struct path_entry))) == NULL) {
+        pthread_mutex_unlock(&Cache.lock);
+        free(key);
+        return status;
+    }
+    if ((e->uri = strdup(uri)) == NULL) {
+        pthread_mutex_unlock(&Cache.lock);
+        free(key);
+        free(e);
+        return status;
+    }
+    if (status == 0) {
+        e->info.type  = info->type;
+        e->info.size  = info->size;
+        e->info.mtime = info->mtime;
+        e->info.ino   = info->ino;
+    }
+    e->info.path = key;
+    e->status    = status;
+    e->hash      = hash;
+
+    /* Replace entry inserted by another thread in the meantime, and evict
+     * least recently used entry if full */
+    for (struct path_entry *old = Cache.buckets[hash % PATH_CACHE_BUCKETS]; old; old = old->next) {
+        if (old->hash == hash && streq(old->uri, uri)) {
+            path_cache_remove(old);
+            break;
+        }
+    }
+    if (Cache.nentries >= PATH_CACHE_ENTRIES) {
+        path_cache_remove(Cache.oldest);
+    }
+
+    e->next = Cache.buckets[hash % PATH_CACHE_BUCKETS];
+    Cache.buckets[hash % PATH_CACHE_BUCKETS] = e;
+    path_cache_push(e);
+    Cache.nentries++;
+    pthread_mutex_unlock(&Cache.lock);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
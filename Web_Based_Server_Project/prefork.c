@@ -0,0 +1,278 @@
+/* prefork.c: Pre-forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Internal Declarations */
+
+struct worker {
+    int    index;       /*< Worker number */
+    pid_t  pid;         /*< Worker process id (0 if not running) */
+    time_t started;     /*< Time worker was (re)spawned */
+};
+
+static pthread_mutex_t *AcceptLock = NULL;  /*< Shared accept mutex */
+static volatile sig_atomic_t Running = true;
+
+/**
+ * Stop supervising workers on SIGINT or SIGTERM.
+ **/
+static void
+prefork_stop(int signum)
+{
+    Running = false;
+}
+
+/**
+ * Allocate process-shared accept mutex.
+ *
+ * The mutex lives in anonymous shared memory so that it is inherited by every
+ * worker.  It is robust so that a worker that dies while holding it does not
+ * deadlock the rest of the pool.
+ **/
+static pthread_mutex_t *
+accept_lock_create()
+{
+    pthread_mutex_t *lock;
+    pthread_mutexattr_t attr;
+
+    lock = mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lock == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return lock;
+}
+
+/**
+ * Acquire accept mutex, recovering it if the previous owner died.
+ **/
+static void
+accept_lock()
+{
+    if (pthread_mutex_lock(AcceptLock) == EOWNERDEAD) {
+        pthread_mutex_consistent(AcceptLock);
+    }
+}
+
+/**
+ * Worker loop: accept and handle HTTP requests one at a time.
+ *
+ * Only the worker holding the accept mutex sleeps in accept(2), so a new
+ * connection wakes exactly one worker instead of the whole pool.  Workers with
+ * their own listener (ReusePort) do not need the mutex.
+ **/
+static void
+prefork_accept(int sfd)
+{
+    struct request *request;
+    struct sockaddr_storage raddr;
+    socklen_t rlen;
+    int fd;
+
+    while (true) {
+        /* Accept client */
+        if (!ReusePort) accept_lock();
+        rlen = sizeof(raddr);
+        fd = accept(sfd, (struct sockaddr *) &raddr, &rlen);
+        if (!ReusePort) pthread_mutex_unlock(AcceptLock);
+
+        if (fd < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        /* Handle request */
+        request = new_request(fd, (struct sockaddr *) &raddr, rlen);
+        if (request == NULL) {
+            continue;
+        }
+        handle_connection(request);
+
+        /* Free request */
+        free_request(request);
+    }
+}
+
+/**
+ * Run worker number index.
+ *
+ * With ReusePort, the worker is pinned to a CPU and replaces the inherited
+ * listener with its own.  It then runs the accept loop, or a whole event loop
+ * in EVENT and URING modes.
+ **/
+static void
+prefork_worker(int sfd, int index)
+{
+    if (ReusePort) {
+        int cpu = pin_worker(index);
+
+        /* The first worker keeps the original listener; the rest (and any
+         * respawned worker) open their own */
+        if (index > 0 || sfd < 0) {
+            if (sfd >= 0) close(sfd);
+            if ((sfd = socket_listen(Port)) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        debug("Worker %d listening on CPU %d", index, cpu);
+    }
+
+    switch (ConcurrencyMode) {
+        case EVENT:
+            event_server(sfd);
+            break;
+        case URING:
+            uring_server(sfd);
+            break;
+        default:
+            prefork_accept(sfd);
+            break;
+    }
+}
+
+/**
+ * Fork worker for slot w.
+ **/
+static pid_t
+prefork_spawn(struct worker *w, int sfd)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, mime_hangup);
+        prefork_worker(sfd, w->index);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        return pid;
+    }
+
+    w->pid     = pid;
+    w->started = time(NULL);
+    debug("Spawned worker %d", pid);
+    return pid;
+}
+
+/**
+ * Start NWorkers long-lived worker processes that all accept on sfd.
+ *
+ * The parent supervises the pool: it respawns workers that exit or crash and
+ * terminates all of them when it receives SIGINT or SIGTERM.  SIGHUP reloads
+ * the parent's mime types (for future workers) and is forwarded to the
+ * workers.
+ *
+ * With ReusePort each worker has its own listener, so once the pool is up the
+ * parent closes its copy of sfd (it must not keep a socket in the SO_REUSEPORT
+ * group that nobody accepts on).
+ **/
+void
+prefork_server(int sfd)
+{
+    struct worker *workers;
+    struct sigaction action = { .sa_handler = prefork_stop };
+    int status;
+    pid_t pid;
+
+    /* Allocate accept mutex and worker table */
+    AcceptLock = accept_lock_create();
+    workers    = calloc(NWorkers, sizeof(struct worker));
+    if (AcceptLock == NULL || workers == NULL) {
+        fatal("Unable to allocate worker pool");
+    }
+
+    /* Stop on SIGINT or SIGTERM, reload on SIGHUP (without SA_RESTART to
+     * interrupt wait) */
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = mime_hangup;
+    sigaction(SIGHUP, &action, NULL);
+
+    /* Spawn initial workers */
+    for (int i = 0; i < NWorkers; i++) {
+        workers[i].index = i;
+        if (prefork_spawn(&workers[i], sfd) < 0) {
+            fatal("Unable to start worker pool");
+        }
+    }
+    log("Started %d workers", NWorkers);
+
+    if (ReusePort) {
+        close(sfd);
+        sfd = -1;
+    }
+
+    /* Supervise workers */
+    while (Running) {
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Unable to wait: %s\n", strerror(errno));
+                sleep(1);
+            }
+            if (mime_reload()) {
+                for (int i = 0; i < NWorkers; i++) {
+                    if (workers[i].pid > 0) kill(workers[i].pid, SIGHUP);
+                }
+            }
+            continue;
+        }
+
+        for (int i = 0; i < NWorkers; i++) {
+            if (workers[i].pid != pid) continue;
+
+            if (WIFSIGNALED(status)) {
+                log("Worker %d killed by signal %d", pid, WTERMSIG(status));
+            } else {
+                log("Worker %d exited with status %d", pid, WEXITSTATUS(status));
+            }
+            workers[i].pid = 0;
+
+            /* Throttle workers that die immediately after starting */
+            if (time(NULL) - workers[i].started < 1) {
+                sleep(1);
+            }
+            break;
+        }
+
+        /* Respawn missing workers */
+        for (int i = 0; Running && i < NWorkers; i++) {
+            if (workers[i].pid == 0) prefork_spawn(&workers[i], sfd);
+        }
+    }
+
+    /* Terminate workers */
+    log("Stopping %d workers", NWorkers);
+    for (int i = 0; i < NWorkers; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+    }
+    while (wait(NULL) > 0);
+
+    /* Close server socket and exit */
+    free(workers);
+    if (sfd >= 0) close(sfd);
+    exit(EXIT_SUCCESS);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
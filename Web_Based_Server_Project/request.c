@@ -4,61 +4,103 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
 int parse_request_method(struct request *r);
 int parse_request_headers(struct request *r);
+static void finish_response(struct request *r);
+
+_Static_assert(REQUEST_BUFSIZ <= UINT16_MAX, "header offsets must fit in struct header");
 
 /**
  * Accept request from server socket.
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Accepts a client connection from the server socket.
+ *  2. Creates a request struct for the client connection (see new_request).
  *
  * The returned request struct must be deallocated using free_request.
  **/
 struct request *
 accept_request(int sfd)
 {
-    struct request *r;
-    struct sockaddr raddr;
-    socklen_t rlen;
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    int fd;
 
-    /* Allocate request struct (zeroed) */
-    r = calloc(1, sizeof(struct request));
-    r->headers = NULL;
-    rlen = sizeof(struct sockaddr);
     /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
-    if (r->fd < 0) {
+    fd = accept(sfd, (struct sockaddr *) &raddr, &rlen);
+    if (fd < 0) {
         fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
 	return NULL;
     }
 
-    /* Lookup client information */
-  
+    return new_request(fd, (struct sockaddr *) &raddr, rlen);
+}
+
+/**
+ * Create request for accepted client socket.
+ *
+ * This function does the following:
+ *
+ *  1. Allocates a request struct initialized to 0.
+ *  2. Initializes the body file in the request struct.
+ *  3. Looks up the client address and port and stores them in the request
+ *     struct (and queues a lookup of its host name if enabled).
+ *  4. Returns the request struct.
+ *
+ * The response stream is opened by handle_request once the request has been
+ * read (see read_request).
+ *
+ * On failure, the client socket is closed and NULL is returned.
+ **/
+struct request *
+new_request(int fd, struct sockaddr *raddr, socklen_t rlen)
+{
+    struct request *r;
+
+    /* Allocate request struct (zeroed) */
+    r = calloc(1, sizeof(struct request));
+    if (r == NULL) {
+        fprintf(stderr, "Unable to allocate request: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->body_fd = -1;
+    r->cached  = -1;
+
+    /* Turn client away at once if it is over the connection limits */
+    if (!admit_connection(r, raddr)) {
+        reject_connection(fd);
+        free(r);
+        return NULL;
+    }
+    r->counted = true;
+    stats_connection(1);
+    TRACE_SAMPLE(r);
+    TRACE_BEGIN(r, TRACE_ACCEPT);
+
+    /* Lookup client information (numeric, since a DNS lookup here would
+     * delay every request; names are resolved in the background) */
     int clientinfo;
+    char name[NI_MAXHOST];
 
-    if ((clientinfo = getnameinfo((struct sockaddr *) &raddr, rlen, r->host, sizeof(r->host), NULL, 0, NI_NOFQDN)) != 0) {
+    if ((clientinfo = getnameinfo(raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
         fprintf(stderr, "Unable to look up client: %s\n", gai_strerror(clientinfo));
         goto fail;
     }    
+    resolver_request(raddr, rlen, r->host);
 
-    /* Open socket stream */
-    // TODO: save this to r->file
-    r->file = fdopen(r->fd, "w+");
-    if (r->file == NULL) {
-        fprintf(stderr, "Unable to fdopen: %s\n", strerror(errno));
-        close(r->fd);
+    if (resolver_lookup(r->host, name, sizeof(name))) {
+        debug("Accepted request from %s (%s):%s", name, r->host, r->port);
+    } else {
+        debug("Accepted request from %s:%s", r->host, r->port);
     }
-    log("Accepted request from %s:%s", r->host, r->port);
+    TRACE_END(r, TRACE_ACCEPT);
     return r;
 
 fail:
@@ -66,58 +108,291 @@ fail:
     return NULL;
 }
 
+/**
+ * Record response to the last request on the connection, once it has been
+ * sent (or given up on), in the access log and metrics.  Each response is
+ * recorded once (this does nothing until the next request is handled).
+ **/
+static void
+finish_response(struct request *r)
+{
+    if (r->started.tv_sec == 0) {
+        return;
+    }
+    TRACE_END(r, TRACE_SEND);
+    TRACE_END(r, TRACE_REQUEST);
+    access_log(r);
+    stats_response(r);
+    r->started.tv_sec = 0;
+}
+
 /**
  * Deallocate request struct.
  *
  * This function does the following:
  *
  *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  2. Frees the request buffer (which holds the parsed request and arena)
+ *     and any staged response.
+ *  3. Frees request struct.
  **/
 void
 free_request(struct request *r)
 {
-    struct header *header;
-    header = r->headers;
-
-
     if (r == NULL) {
     	return;
     }
+    finish_response(r);
+    if (r->counted) {
+        stats_connection(-1);
+        release_connection(r);
+    }
 
-    /* Close socket or fd */
-    close(r->fd);
-
-    /* Free allocated strings */
-    free(r->method);
-    free(r->uri);
-    free(r->path);
-    free(r->query);
-
-    /* Free headers */
-    header = r->headers;
-    while (header) {
-        free(header->name);
-        free(header->value);
-	free(header);
-        header = header->next;
+    /* Close socket stream or fd (memory streams do not own the socket) */
+    if (r->file) {
+        fclose(r->file);
+    }
+    if (r->file == NULL || r->nonblocking) {
+        close(r->fd);
     }
+    if (r->body_fd >= 0) {
+        close(r->body_fd);
+    }
+    cache_release(r);
+
+    /* Free buffers */
+    free(r->buffer);
+    free(r->output);
 
     /* Free request */
     free(r);
 }
 
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * This drops everything belonging to the previous request (emptying the
+ * arena in one step) and moves any bytes the client has already sent beyond
+ * it (pipelined requests) to the start of the buffer.  The socket, its
+ * response stream, and the client information are kept.
+ **/
+void
+reset_request(struct request *r)
+{
+    finish_response(r);
+
+    r->method = r->uri = r->path = r->query = NULL;
+    r->nheaders = 0;
+    r->narena   = 0;
+
+    /* Keep pipelined bytes */
+    memmove(r->buffer, r->buffer + r->nscanned, r->nbuffer - r->nscanned);
+    r->nbuffer -= r->nscanned;
+    r->nscanned = 0;
+    r->nparsed  = 0;
+
+    /* Rewind staged response stream for reuse, unless it grew large */
+    if (r->nonblocking && r->file && r->noutput <= RESPONSE_BUFSIZ) {
+        fseeko(r->file, 0, SEEK_SET);
+    } else if (r->nonblocking && r->file) {
+        fclose(r->file);
+        r->file = NULL;
+        free(r->output);
+        r->output = NULL;
+    }
+    r->noutput  = 0;
+    r->nwritten = 0;
+
+    if (r->body_fd >= 0) {
+        close(r->body_fd);
+    }
+    r->body_fd     = -1;
+    cache_release(r);
+    r->ranges      = NULL;
+    r->body_offset = 0;
+    r->body_length = 0;
+
+    r->nsent     = 0;
+    r->minor     = 0;
+    r->keepalive = false;
+    r->chunked   = false;
+    r->responded = false;
+    r->shed      = false;
+    r->state     = REQUEST_READING_LINE;
+    TRACE_SAMPLE(r);
+}
+
+/**
+ * Scan request buffer for the end of the headers.
+ *
+ * This function scans the bytes appended to the request buffer since the last
+ * call line by line, advancing the request state from REQUEST_READING_LINE
+ * through REQUEST_READING_HEADERS until the blank line that ends the headers.
+ * The eof flag indicates that the client will not send any more bytes.
+ *
+ * Returns 1 once the headers are complete, 0 if more bytes are needed, and -1
+ * if the request can never complete (EOF, or headers larger than
+ * REQUEST_BUFSIZ).
+ **/
+int
+scan_request(struct request *r, bool eof)
+{
+    char *line;
+    char *eol;
+
+    /* Scan complete lines already in buffer */
+    while ((eol = memchr(r->buffer + r->nscanned, '\n', r->nbuffer - r->nscanned))) {
+        line        = r->buffer + r->nscanned;
+        r->nscanned = eol - r->buffer + 1;
+
+        if (eol - line <= 1 && (eol == line || *line == '\r')) {
+            /* Blank line: skip before request line, end of headers after */
+            if (r->state == REQUEST_READING_LINE) {
+                r->nparsed = r->nscanned;
+                continue;
+            }
+            r->state = REQUEST_WRITING_RESPONSE;
+            return 1;
+        }
+        r->state = REQUEST_READING_HEADERS;
+    }
+
+    /* EOF terminates headers (as fgets did), but not an empty request */
+    if (eof) {
+        if (r->state == REQUEST_READING_HEADERS) {
+            r->state = REQUEST_WRITING_RESPONSE;
+            return 1;
+        }
+        return -1;
+    }
+
+    if (r->nbuffer == REQUEST_BUFSIZ) {
+        debug("Request headers too large");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read HTTP request line and headers from client socket.
+ *
+ * This function appends whatever the socket has available to the request
+ * buffer and scans it (see scan_request) until the headers are complete.
+ * Because all progress is recorded in the request struct, it can be called
+ * repeatedly on a non-blocking socket.
+ *
+ * Returns 1 once the headers are complete, 0 if the socket would block first,
+ * and -1 on error, EOF, or if the headers do not fit in REQUEST_BUFSIZ.
+ **/
+int
+read_request(struct request *r)
+{
+    ssize_t nread;
+    int status;
+
+    /* Allocate buffer (and arena) on first read so idle connections stay
+     * small; both are reused for every request on the connection */
+    if (r->buffer == NULL) {
+        if ((r->buffer = malloc(REQUEST_BUFSIZ + REQUEST_ARENASIZ)) == NULL) {
+            return -1;
+        }
+        r->arena = r->buffer + REQUEST_BUFSIZ;
+    }
+
+    while ((status = scan_request(r, false)) == 0) {
+        /* Read more from socket */
+        nread = recv(r->fd, r->buffer + r->nbuffer, REQUEST_BUFSIZ - r->nbuffer, 0);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            debug("Unable to recv: %s", strerror(errno));
+            return -1;
+        }
+        if (nread == 0) {
+            return scan_request(r, true);
+        }
+        r->nbuffer += nread;
+        TRACE_BEGIN(r, TRACE_READ);
+    }
+
+    return status;
+}
+
+/**
+ * Return next line of request headers, terminated in place in the request
+ * buffer (dropping the CRLF or LF), and store its length in *length.
+ *
+ * Returns the line, or NULL when there are no more lines.
+ **/
+static char *
+read_request_line(struct request *r, size_t *length)
+{
+    char *line = r->buffer + r->nparsed;
+    char *eol  = memchr(line, '\n', r->nscanned - r->nparsed);
+
+    if (eol == NULL) {
+        return NULL;
+    }
+
+    r->nparsed = eol - r->buffer + 1;
+    if (eol > line && eol[-1] == '\r') {
+        eol--;
+    }
+    *eol    = '\0';
+    *length = eol - line;
+    return line;
+}
+
+/**
+ * Allocate size bytes of request scratch memory, which stays valid until the
+ * request is reset or freed (and must not be free'd itself).
+ *
+ * Returns NULL if the request arena is exhausted.
+ **/
+void *
+request_alloc(struct request *r, size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t) 15;
+    if (r->arena == NULL || size > REQUEST_ARENASIZ - r->narena) {
+        return NULL;
+    }
+    p = r->arena + r->narena;
+    r->narena += size;
+    return p;
+}
+
+/**
+ * Copy string into request scratch memory (see request_alloc).
+ **/
+char *
+request_strdup(struct request *r, const char *s)
+{
+    size_t length = strlen(s) + 1;
+    char *copy = request_alloc(r, length);
+
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
 /**
  * Parse HTTP Request.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function first reads the request (if the caller has not already done
+ * so), then parses the request method, any query, and then the headers,
+ * returning 0 on success, and -1 on error.
  **/
 int
 parse_request(struct request *r)
 {
+    /* Read HTTP Request */
+    if (r->state < REQUEST_WRITING_RESPONSE && read_request(r) <= 0) {
+        return -1;
+    }
+
     /* Parse HTTP Request Method */
   //    debug("Parsing request method...");
     int pmethod = parse_request_method(r);          
@@ -126,8 +401,54 @@ parse_request(struct request *r)
     // debug("Parsing request headers...");
     int pheader = parse_request_headers(r);
 
-    if (pmethod == 0 && pheader == 0) return 0;
-    else return 1;
+    if (pmethod != 0 || pheader != 0) return -1;
+
+    /* Keep connection alive if both sides want to: by default in HTTP/1.1,
+     * only on request in HTTP/1.0, and never past KeepAliveMax requests */
+    const char *connection = find_header(r, "Connection");
+    if (r->minor > 0) {
+        r->keepalive = connection == NULL || strcasestr(connection, "close") == NULL;
+    } else {
+        r->keepalive = connection != NULL && strcasestr(connection, "keep-alive") != NULL;
+    }
+    if (++r->nrequests >= KeepAliveMax) {
+        r->keepalive = false;
+    }
+
+    /* A single connection server cannot let one idle client hold it */
+    if (ConcurrencyMode == SINGLE) {
+        r->keepalive = false;
+    }
+
+    /* Request bodies are not read, so close the connection after a request
+     * that has one rather than parse the body as the next request, and
+     * refuse bodies whose end could not even be found */
+    const char *length = find_header(r, "Content-Length");
+    if (find_header(r, "Transfer-Encoding")) {
+        r->keepalive = false;
+        return -1;
+    }
+    if (length && !streq(length, "0")) {
+        r->keepalive = false;
+    }
+    return 0;
+}
+
+/**
+ * Return value of first request header with given name (case-insensitive),
+ * or NULL if there is no such header.
+ **/
+const char *
+find_header(struct request *r, const char *name)
+{
+    size_t length = strlen(name);
+
+    for (size_t i = 0; i < r->nheaders; i++) {
+        if (r->headers[i].nname == length && strcasecmp(r->buffer + r->headers[i].name, name) == 0) {
+            return r->buffer + r->headers[i].value;
+        }
+    }
+    return NULL;
 }
 
 /**
@@ -142,45 +463,65 @@ parse_request(struct request *r)
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and HTTP
+ * minor version, which are left in the request buffer.  The method must be a
+ * token, and the uri and query may not contain control characters (see
+ * scan_token and scan_uri).
  **/
 int
 parse_request_method(struct request *r)
 {
-    char buf[BUFSIZ];
+    char *line;
+    char *end;
+    size_t length;
 
-    /* Read line from socket */
-    // TODO: Use r->file
-    /*FILE *fs = fdopen(r->fd, "r");*/
-    if (r->file == NULL) {
-        debug("Could not open file: %s", strerror(errno));
-        goto fail;
-    }
-    if(fgets(buf, BUFSIZ, r->file) == NULL) {
-        if (r->file) fclose(r->file);
+    /* Read line from request buffer */
+    if ((line = read_request_line(r, &length)) == NULL) {
         goto fail;
     }         
+    end = line + length;
 
-    /* Parse method and uri */
-    char *method = strtok(skip_whitespace(buf), WHITESPACE);
-    char *uri = strtok(NULL, WHITESPACE);
+    /* Parse method */
+    char *method = skip_whitespace(line);
+    char *p = method + scan_token(method, end - method);
 
-    if (method == NULL || uri == NULL) {
+    if (p == method || (*p != ' ' && *p != '\t')) {
         goto fail;
-    }    
+    }
+    *p = '\0';
+
+    /* Parse uri, and query from uri */
+    char *uri   = skip_whitespace(p + 1);
+    char *query = NULL;
+
+    p = uri + scan_uri(uri, end - uri);
+    if (*p == '?') {
+        *p++  = '\0';
+        query = p;
+        for (p += scan_uri(p, end - p); *p == '?'; p += scan_uri(p, end - p)) {
+            p++;
+        }
+    }
+    if (*uri == '\0' || (*p != ' ' && *p != '\t' && *p != '\0')) {
+        goto fail;
+    }
+
+    /* Parse HTTP version (HTTP/0.9 requests have none) */
+    char *version = end;
 
-    /* Parse query from uri */
-    char *query = strchr(uri, '?');
-    if (query != NULL) {
-        *query = '\0';
-        query++;
-        r->query = strdup(query);
+    if (p < end) {
+        *p = '\0';
+        version = skip_whitespace(p + 1);
     }
-    // TODO: Need to check if query is valid
+
+    if (sscanf(version, "HTTP/1.%d", &r->minor) != 1) {
+        r->minor = 0;
+    }
+    r->query = query;
 
     /* Record method, uri, and query in request struct */
-    r->method = strdup(method); 
-    r->uri = strdup(uri);
+    r->method = method; 
+    r->uri = uri;
 
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
@@ -208,42 +549,58 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
+ * This function parses the lines buffered by read_request using the following
  * pseudo-code:
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
- *      headers.append(header)
+ *  while (line = read_request_line() and line is not empty):
+ *      name, value = line.split(':')
+ *      headers.append(Header(name, value))
+ *
+ * Names and values are terminated in place and recorded as offsets into the
+ * request buffer, so nothing is allocated.  Requests with an invalid header
+ * name (see scan_token), or with more than REQUEST_HEADERS headers, are
+ * rejected.
  **/
 int
 parse_request_headers(struct request *r)
 {
-    char buffer[BUFSIZ];
-    //char *name;
+    struct header *header;
+    char *line;
     char *value;
+    char *end;
+    size_t length;
+    size_t nname;
     
-    while(fgets(buffer, BUFSIZ, r->file) && strlen(skip_whitespace(buffer))) {
-      // if (streq(buffer,"\r\n")) break;
-        chomp(buffer);
-        value = strchr(buffer, ':');
-        if (value == NULL) continue;
-
-	struct header *new = calloc(1, sizeof(struct header));
-
-        *value = '\0';
-        value++;
-        new->value = strdup(skip_whitespace(value));
-    
-        new->name = strdup(skip_whitespace(buffer));
-        new->next = r->headers;
-        r->headers = new;
-	//free(new);
-  }
+    while ((line = read_request_line(r, &length)) && length > 0) {
+        /* Name must be a token ending at the colon */
+        nname = scan_token(line, length);
+        if (nname == 0 || line[nname] != ':') {
+            debug("Invalid request header: %s", line);
+            return -1;
+        }
+        if (r->nheaders == REQUEST_HEADERS) {
+            debug("Too many request headers");
+            return -1;
+        }
+        line[nname] = '\0';
+
+        /* Value without surrounding whitespace */
+        end   = line + length;
+        value = skip_whitespace(line + nname + 1);
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+
+        header = &r->headers[r->nheaders++];
+        header->name   = line - r->buffer;
+        header->nname  = nname;
+        header->value  = value - r->buffer;
+        header->nvalue = end - value;
+    }
     
 #ifndef NDEBUG
-    for (struct header *header = r->headers; header != NULL; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->value);
+    for (size_t i = 0; i < r->nheaders; i++) {
+    	debug("HTTP HEADER %s = %s", r->buffer + r->headers[i].name, r->buffer + r->headers[i].value);
     }
 #endif
     return 0;
@@ -0,0 +1,236 @@
+/* resolver.c: Background Client Host Name Resolution */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Constants */
+
+#define RESOLVER_ENTRIES    1024    /* Cached addresses (direct mapped) */
+#define RESOLVER_QUEUE      64      /* Pending lookups (more are dropped) */
+#define RESOLVER_TTL        300     /* Seconds to keep a name */
+#define RESOLVER_NEGATIVE_TTL 60    /* Seconds to remember an address has none */
+#define RESOLVER_NAMESIZ    256     /* Longest host name (plus NUL) */
+#define RESOLVER_ADDRSIZ    64      /* Longest numeric address (plus NUL) */
+
+/* Internal Declarations */
+
+struct resolver_entry {
+    char    address[RESOLVER_ADDRSIZ];  /*< Numeric address (key) */
+    char    name[RESOLVER_NAMESIZ];     /*< Host name ("" if it has none) */
+    time_t  expires;                    /*< When to look it up again */
+    bool    pending;                    /*< Lookup queued or in progress */
+};
+
+struct resolver_job {
+    struct sockaddr_storage addr;
+    socklen_t               length;
+    char                    address[RESOLVER_ADDRSIZ];
+};
+
+/**
+ * Client address to host name cache.
+ *
+ * Lookups are queued by request handlers and done on one thread per process,
+ * started on first use (so each forked worker gets its own), so no request
+ * ever waits for the resolver.  Names are only used for logging and CGI.
+ **/
+static struct {
+    pthread_mutex_t       lock;
+    pthread_cond_t        ready;
+    pid_t                 pid;          /*< Process the thread runs in */
+    bool                  forkable;     /*< Fork handlers installed */
+    struct resolver_job   queue[RESOLVER_QUEUE];
+    size_t                head;
+    size_t                count;
+    struct resolver_entry entries[RESOLVER_ENTRIES];
+} Resolver = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+/**
+ * Hash address (FNV-1a).
+ **/
+static size_t
+resolver_hash(const char *address)
+{
+    size_t hash = 2166136261u;
+
+    while (*address) {
+        hash = (hash ^ (unsigned char) *address++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Look up queued addresses, one at a time, forever.
+ **/
+static void *
+resolver_thread(void *arg)
+{
+    struct resolver_job job;
+    struct resolver_entry *e;
+    char name[RESOLVER_NAMESIZ];
+    int status;
+
+    while (true) {
+        pthread_mutex_lock(&Resolver.lock);
+        while (Resolver.count == 0) {
+            pthread_cond_wait(&Resolver.ready, &Resolver.lock);
+        }
+        job = Resolver.queue[Resolver.head];
+        Resolver.head = (Resolver.head + 1) % RESOLVER_QUEUE;
+        Resolver.count--;
+        pthread_mutex_unlock(&Resolver.lock);
+
+        /* This may take as long as the resolver likes */
+        status = getnameinfo((struct sockaddr *) &job.addr, job.length, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+        if (status != 0) {
+            debug("Unable to resolve %s: %s", job.address, gai_strerror(status));
+            name[0] = '\0';
+        }
+
+        /* Store result unless the entry has been taken by another address */
+        pthread_mutex_lock(&Resolver.lock);
+        e = &Resolver.entries[resolver_hash(job.address) % RESOLVER_ENTRIES];
+        if (e->pending && streq(e->address, job.address)) {
+            strcpy(e->name, name);
+            e->expires = time(NULL) + (name[0] ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+            e->pending = false;
+        }
+        pthread_mutex_unlock(&Resolver.lock);
+    }
+    return NULL;
+}
+
+/* Hold the lock across fork, so the child gets a consistent cache */
+static void
+resolver_prepare(void)
+{
+    pthread_mutex_lock(&Resolver.lock);
+}
+
+static void
+resolver_parent(void)
+{
+    pthread_mutex_unlock(&Resolver.lock);
+}
+
+/* The child has no resolver thread: forget queued lookups, and start a
+ * thread of its own when it needs one */
+static void
+resolver_child(void)
+{
+    for (size_t i = 0; i < RESOLVER_ENTRIES; i++) {
+        if (Resolver.entries[i].pending) {
+            Resolver.entries[i].pending    = false;
+            Resolver.entries[i].address[0] = '\0';
+        }
+    }
+    Resolver.head  = 0;
+    Resolver.count = 0;
+    pthread_cond_init(&Resolver.ready, NULL);
+    pthread_mutex_unlock(&Resolver.lock);
+}
+
+/**
+ * Start resolver thread in this process if it is not running (with the lock
+ * held).
+ *
+ * Returns whether the thread is running.
+ **/
+static bool
+resolver_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int status;
+
+    if (Resolver.pid == getpid()) {
+        return true;
+    }
+    if (!Resolver.forkable) {
+        if (pthread_atfork(resolver_prepare, resolver_parent, resolver_child) != 0) {
+            return false;
+        }
+        Resolver.forkable = true;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    status = pthread_create(&thread, &attr, resolver_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        debug("Unable to start resolver: %s", strerror(status));
+        return false;
+    }
+    Resolver.pid = getpid();
+    return true;
+}
+
+/**
+ * Queue lookup of client address (numeric form in address) unless its name
+ * is already cached or being looked up.  This never blocks on the resolver:
+ * if too many lookups are queued, this one is dropped.
+ **/
+void
+resolver_request(const struct sockaddr *addr, socklen_t length, const char *address)
+{
+    struct resolver_entry *e;
+    struct resolver_job *job;
+
+    if (!ResolveHosts || length > sizeof(job->addr) || strlen(address) >= RESOLVER_ADDRSIZ) {
+        return;
+    }
+
+    pthread_mutex_lock(&Resolver.lock);
+    e = &Resolver.entries[resolver_hash(address) % RESOLVER_ENTRIES];
+    if (streq(e->address, address) && (e->pending || e->expires > time(NULL))) {
+        pthread_mutex_unlock(&Resolver.lock);
+        return;
+    }
+    if (Resolver.count == RESOLVER_QUEUE || !resolver_start()) {
+        pthread_mutex_unlock(&Resolver.lock);
+        return;
+    }
+
+    strcpy(e->address, address);
+    e->name[0] = '\0';
+    e->pending = true;
+
+    job = &Resolver.queue[(Resolver.head + Resolver.count) % RESOLVER_QUEUE];
+    memcpy(&job->addr, addr, length);
+    job->length = length;
+    strcpy(job->address, address);
+    Resolver.count++;
+    pthread_cond_signal(&Resolver.ready);
+    pthread_mutex_unlock(&Resolver.lock);
+}
+
+/**
+ * Copy cached host name of client address into name (of given size).
+ *
+ * Returns false if the name is not known (yet), in which case callers should
+ * fall back to the address.
+ **/
+bool
+resolver_lookup(const char *address, char *name, size_t size)
+{
+    struct resolver_entry *e;
+    bool found;
+
+    if (!ResolveHosts) {
+        return false;
+    }
+
+    pthread_mutex_lock(&Resolver.lock);
+    e = &Resolver.entries[resolver_hash(address) % RESOLVER_ENTRIES];
+    found = streq(e->address, address) && !e->pending && e->name[0] && e->expires > time(NULL) &&
+            strlen(e->name) < size;
+    if (found) {
+        strcpy(name, e->name);
+    }
+    pthread_mutex_unlock(&Resolver.lock);
+    return found;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,324 @@
+/* scan.c: Vectorized Request Scanning */
+
+#include "spidey.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Internal Declarations */
+
+static size_t scan_token_scalar(const char *s, size_t n);
+static size_t scan_uri_scalar(const char *s, size_t n);
+static size_t scan_token_resolve(const char *s, size_t n);
+static size_t scan_uri_resolve(const char *s, size_t n);
+#ifdef SCAN_X86
+static size_t scan_token_sse42(const char *s, size_t n);
+static size_t scan_uri_sse42(const char *s, size_t n);
+static size_t scan_token_avx2(const char *s, size_t n);
+static size_t scan_uri_avx2(const char *s, size_t n);
+#endif
+
+/* Implementations, picked by scan_init (or on first use) */
+static size_t (*ScanToken)(const char *, size_t) = scan_token_resolve;
+static size_t (*ScanUri)(const char *, size_t)   = scan_uri_resolve;
+static const char *ScanName = "scalar";
+
+/* Header name characters (RFC 7230 tchar) */
+static bool Token[256];
+
+#ifdef SCAN_X86
+/* SSE4.2: ranges of characters that are not tokens, except that '|' and '~'
+ * fall inside the last range (there are only eight range slots) and are
+ * checked separately */
+static const char NonTokenRanges[16] = "\x00 \"\"(),,//:@[]{\xff";
+static const char UriRanges[16]      = "\x00 ??\x7f\x7f";
+
+/* AVX2: a byte is a token if the bit for its high nibble is set in the entry
+ * for its low nibble (both tables repeated for each 128-bit lane) */
+static uint8_t TokenLow[32];
+static uint8_t TokenHigh[32];
+#endif
+
+/**
+ * Build character tables and choose the widest implementation the CPU
+ * supports (AVX2, then SSE4.2, then scalar).
+ *
+ * This must be called before any threads are started.
+ **/
+void
+scan_init(void)
+{
+    const char *extra = "!#$%&'*+-.^_`|~";
+
+    for (int c = 0; c < 256; c++) {
+        Token[c] = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                   (c != 0 && strchr(extra, c) != NULL);
+    }
+
+    ScanToken = scan_token_scalar;
+    ScanUri   = scan_uri_scalar;
+    ScanName  = "scalar";
+
+#ifdef SCAN_X86
+    memset(TokenLow, 0, sizeof(TokenLow));
+    for (int c = 0; c < 128; c++) {
+        if (Token[c]) {
+            TokenLow[c & 0x0f] |= 1 << (c >> 4);
+        }
+    }
+    memcpy(TokenLow + 16, TokenLow, 16);
+    for (int h = 0; h < 8; h++) {
+        TokenHigh[h] = TokenHigh[16 + h] = 1 << h;
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ScanToken = scan_token_avx2;
+        ScanUri   = scan_uri_avx2;
+        ScanName  = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        ScanToken = scan_token_sse42;
+        ScanUri   = scan_uri_sse42;
+        ScanName  = "sse4.2";
+    }
+#endif
+}
+
+static size_t
+scan_token_resolve(const char *s, size_t n)
+{
+    scan_init();
+    return ScanToken(s, n);
+}
+
+static size_t
+scan_uri_resolve(const char *s, size_t n)
+{
+    scan_init();
+    return ScanUri(s, n);
+}
+
+/* Scalar */
+
+static size_t
+scan_token_scalar(const char *s, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && Token[(unsigned char) s[i]]) {
+        i++;
+    }
+    return i;
+}
+
+static inline bool
+uri_delimiter(unsigned char c)
+{
+    return c <= ' ' || c == '?' || c == 0x7f;
+}
+
+static size_t
+scan_uri_scalar(const char *s, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && !uri_delimiter(s[i])) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/* SSE4.2: PCMPESTRI range matching, 16 bytes at a time */
+
+__attribute__((target("sse4.2"))) static size_t
+scan_token_sse42(const char *s, size_t n)
+{
+    const __m128i ranges = _mm_loadu_si128((const __m128i *) NonTokenRanges);
+    size_t i = 0;
+    int index;
+
+    while (i + 16 <= n) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + i));
+
+        index = _mm_cmpestri(ranges, 16, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        i += index;
+        if (index == 16) {
+            continue;
+        }
+        if (s[i] != '|' && s[i] != '~') {
+            return i;
+        }
+        i++;
+    }
+    return i + scan_token_scalar(s + i, n - i);
+}
+
+__attribute__((target("sse4.2"))) static size_t
+scan_uri_sse42(const char *s, size_t n)
+{
+    const __m128i ranges = _mm_loadu_si128((const __m128i *) UriRanges);
+    size_t i = 0;
+    int index;
+
+    while (i + 16 <= n) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + i));
+
+        index = _mm_cmpestri(ranges, 6, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16) {
+            return i + index;
+        }
+        i += 16;
+    }
+    return i + scan_uri_scalar(s + i, n - i);
+}
+
+/* AVX2: nibble lookup classification, 32 bytes at a time */
+
+__attribute__((target("avx2"))) static size_t
+scan_token_avx2(const char *s, size_t n)
+{
+    const __m256i low    = _mm256_loadu_si256((const __m256i *) TokenLow);
+    const __m256i high   = _mm256_loadu_si256((const __m256i *) TokenHigh);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero   = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 32 <= n) {
+        __m256i b  = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i lo = _mm256_shuffle_epi8(low, _mm256_and_si256(b, nibble));
+        __m256i hi = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    /* Same on one 128-bit lane, since most header lines are short */
+    if (i + 16 <= n) {
+        __m128i b  = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i lo = _mm_shuffle_epi8(_mm256_castsi256_si128(low), _mm_and_si128(b, _mm256_castsi256_si128(nibble)));
+        __m128i hi = _mm_shuffle_epi8(_mm256_castsi256_si128(high), _mm_and_si128(_mm_srli_epi16(b, 4), _mm256_castsi256_si128(nibble)));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm256_castsi256_si128(zero)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + scan_token_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_uri_avx2(const char *s, size_t n)
+{
+    const __m256i space    = _mm256_set1_epi8(' ');
+    const __m256i question = _mm256_set1_epi8('?');
+    const __m256i del      = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+
+    while (i + 32 <= n) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(b, space), b);   /* b <= ' ' */
+
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, question));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, del));
+        uint32_t mask = _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    if (i + 16 <= n) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(b, _mm256_castsi256_si128(space)), b);
+
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(b, _mm256_castsi256_si128(question)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(b, _mm256_castsi256_si128(del)));
+        uint32_t mask = _mm_movemask_epi8(m);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + scan_uri_scalar(s + i, n - i);
+}
+
+#endif
+
+/**
+ * Return length of the run of header name (token) characters at the start of
+ * s (at most n), so s[length] is the first character that cannot be part of
+ * a header name or method.
+ **/
+size_t
+scan_token(const char *s, size_t n)
+{
+    return ScanToken(s, n);
+}
+
+/**
+ * Return length of the run of URI characters at the start of s (at most n),
+ * stopping at whitespace, control characters, or '?'.
+ **/
+size_t
+scan_uri(const char *s, size_t n)
+{
+    return ScanUri(s, n);
+}
+
+/**
+ * Use named implementation instead of the one scan_init picked (for
+ * benchmarking).  Returns false if the CPU does not support it.
+ **/
+bool
+scan_select(const char *name)
+{
+    scan_init();
+    if (streq(name, "scalar")) {
+        ScanToken = scan_token_scalar;
+        ScanUri   = scan_uri_scalar;
+        ScanName  = "scalar";
+        return true;
+    }
+#ifdef SCAN_X86
+    if (streq(name, "sse4.2") && __builtin_cpu_supports("sse4.2")) {
+        ScanToken = scan_token_sse42;
+        ScanUri   = scan_uri_sse42;
+        ScanName  = "sse4.2";
+        return true;
+    }
+    if (streq(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        ScanToken = scan_token_avx2;
+        ScanUri   = scan_uri_avx2;
+        ScanName  = "avx2";
+        return true;
+    }
+#endif
+    return false;
+}
+
+/**
+ * Name of the implementation in use ("avx2", "sse4.2", or "scalar").
+ **/
+const char *
+scan_implementation(void)
+{
+    if (ScanToken == scan_token_resolve) {
+        scan_init();
+    }
+    return ScanName;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,239 @@
+/* scanbench: Request Scanning Microbenchmark */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Request header blocks as sent by browsers */
+static const char *Requests[] = {
+    /* Firefox (as in request.c) */
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8888\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0\r\n"
+    "Accept: text/html,application/xhtml+xml\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+
+    /* Current Firefox */
+    "GET /text/hackers.txt HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/png,image/svg+xml,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n",
+
+    /* Chrome, with a query and cookies */
+    "GET /scripts/cowsay.sh?message=hello+world&template=default&utm_source=newsletter&utm_medium=email HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://localhost:9898/scripts/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ; theme=dark; _ga_ABCDEF1234=GS1.1.1700000000.1.1.1700000100.0.0.0\r\n"
+    "If-None-Match: \"5f3c-1a2b3c4d\"\r\n"
+    "If-Modified-Since: Tue, 14 May 2024 10:00:00 GMT\r\n"
+    "\r\n",
+};
+
+#define NREQUESTS   (sizeof(Requests) / sizeof(Requests[0]))
+
+/**
+ * Scan request the way parse_request does: split lines, then the request
+ * line into method, uri, and query, and each header line into name and value.
+ *
+ * Returns a checksum of the offsets found (so implementations can be compared
+ * and the work is not optimized away), or 0 if the request is invalid.
+ **/
+static size_t
+scan(char *buffer, size_t length)
+{
+    char *line = buffer;
+    char *end  = buffer + length;
+    char *eol;
+    char *p;
+    size_t sum = 0;
+    size_t n;
+
+    /* Request line */
+    eol = memchr(line, '\n', end - line);
+    n   = scan_token(line, eol - line);
+    if (line[n] != ' ') return 0;
+    p = line + n + 1;
+    for (p += scan_uri(p, eol - p); *p == '?'; p += scan_uri(p, eol - p)) {
+        p++;
+    }
+    sum += n + (p - line);
+
+    /* Headers */
+    for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)) && eol - line > 1; line = eol + 1) {
+        n = scan_token(line, eol - line);
+        if (line[n] != ':') return 0;
+        sum += n + (eol - line);
+    }
+    return sum;
+}
+
+/**
+ * Scan request the way parse_request used to: copy each line into a stack
+ * buffer, then strtok on whitespace for the request line, and strchr for the
+ * colon in each header.
+ **/
+static size_t
+scan_strtok(char *buffer, size_t length)
+{
+    char *line = buffer;
+    char *end  = buffer + length;
+    char *eol;
+    char *state;
+    char copy[BUFSIZ];
+    size_t sum = 0;
+
+    eol = memchr(line, '\n', end - line);
+    memcpy(copy, line, eol - line + 1);
+    copy[eol - line + 1] = '\0';
+    char *method = strtok_r(copy, WHITESPACE, &state);
+    char *uri    = strtok_r(NULL, WHITESPACE, &state);
+    char *query  = strchr(uri, '?');
+    sum += strlen(method) + (query ? query - uri : 0) + strlen(uri);
+
+    for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)) && eol - line > 1; line = eol + 1) {
+        memcpy(copy, line, eol - line + 1);
+        copy[eol - line + 1] = '\0';
+        char *colon = strchr(copy, ':');
+        if (colon == NULL) return 0;
+        sum += colon - copy;
+    }
+    return sum;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time iterations of scanner over every request, and report nanoseconds and
+ * bytes per nanosecond.
+ **/
+static void
+bench(const char *name, size_t (*scanner)(char *, size_t), size_t iterations)
+{
+    char buffers[NREQUESTS][BUFSIZ];
+    size_t lengths[NREQUESTS];
+    size_t bytes = 0;
+    volatile size_t sum = 0;
+    double start;
+
+    for (size_t i = 0; i < NREQUESTS; i++) {
+        lengths[i] = strlen(Requests[i]);
+        memcpy(buffers[i], Requests[i], lengths[i] + 1);
+        bytes += lengths[i];
+    }
+
+    start = now();
+    for (size_t n = 0; n < iterations; n++) {
+        for (size_t i = 0; i < NREQUESTS; i++) {
+            sum += scanner(buffers[i], lengths[i]);
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-8s %8.1f ns/request %6.2f bytes/ns\n", name,
+           elapsed * 1e9 / (iterations * NREQUESTS), bytes * iterations / (elapsed * 1e9));
+}
+
+/**
+ * Check that implementation agrees with the scalar one on every request, and
+ * on every window of a buffer of long token runs broken up by every byte
+ * value.
+ **/
+static bool
+agrees(const char *name)
+{
+    const char *alphabet = "Accept-Encoding|x~y_z/some/path.html";
+    char bytes[512];
+    size_t expected[NREQUESTS];
+    char buffer[BUFSIZ];
+
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = i % 53 == 52 ? (char) (i * 5) : alphabet[i % strlen(alphabet)];
+    }
+
+    scan_select("scalar");
+    for (size_t i = 0; i < NREQUESTS; i++) {
+        strcpy(buffer, Requests[i]);
+        expected[i] = scan(buffer, strlen(buffer));
+    }
+    size_t token[64], uri[64];
+    for (size_t i = 0; i < 64; i++) {
+        token[i] = scan_token(bytes + i, sizeof(bytes) - i);
+        uri[i]   = scan_uri(bytes + i, sizeof(bytes) - i);
+    }
+
+    scan_select(name);
+    for (size_t i = 0; i < NREQUESTS; i++) {
+        strcpy(buffer, Requests[i]);
+        if (expected[i] == 0 || scan(buffer, strlen(buffer)) != expected[i]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < 64; i++) {
+        if (scan_token(bytes + i, sizeof(bytes) - i) != token[i] ||
+            scan_uri(bytes + i, sizeof(bytes) - i) != uri[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *names[] = { "scalar", "sse4.2", "avx2" };
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    scan_init();
+    printf("Default: %s\n", scan_implementation());
+
+    bench("strtok", scan_strtok, iterations);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!scan_select(names[i])) {
+            printf("%-8s unsupported\n", names[i]);
+            continue;
+        }
+        if (!agrees(names[i])) {
+            printf("%-8s MISMATCH\n", names[i]);
+            return EXIT_FAILURE;
+        }
+        bench(names[i], scan, iterations);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
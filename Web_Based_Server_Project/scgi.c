@@ -0,0 +1,300 @@
+/* scgi.c: Persistent SCGI Worker Pools */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SCGI_SUFFIX     ".scgi" /* Scripts that speak SCGI */
+#define SCGI_SCRIPTS    16      /* Scripts with worker pools (per process) */
+#define SCGI_WORKERS    4       /* Most worker processes per script */
+#define SCGI_BACKLOG    16      /* Requests queued for busy workers (more are refused) */
+#define SCGI_TIMEOUT    30      /* Seconds to wait on a worker */
+#define SCGI_DIRECTORY  "/tmp/spidey-scgi-XXXXXX"   /* Template of socket directory */
+
+/* Internal Declarations */
+
+struct scgi_pool {
+    char               *path;                   /*< Script */
+    int                 sfd;                    /*< Socket the workers accept on */
+    struct sockaddr_un  address;                /*< Address of sfd (in Scgi.directory) */
+    socklen_t           length;
+    pid_t               workers[SCGI_WORKERS];  /*< Worker processes (0 if none) */
+};
+
+/**
+ * SCGI worker pools, one per script.
+ *
+ * Each pool is a listening Unix socket shared by long-running copies of the
+ * script (see scgi_workers), which get it as their
+ * standard input (as with FastCGI) and accept one connection per request.
+ * The kernel hands each connection to an idle worker, so requests for busy
+ * workers wait in the socket's backlog, and once SCGI_BACKLOG are waiting
+ * further connections are refused.  Workers that exit are started again on
+ * the next request, and all of them are killed when the process that started
+ * them exits.  Pools belong to a process (workers that fork get their own)
+ * and are shared by its threads.
+ *
+ * The sockets live in a directory of the process's own that only its user
+ * can enter, since anyone who could connect to a worker could hand it any
+ * request variables they liked (and anyone who could bind its name first
+ * could keep it from starting).
+ **/
+static struct {
+    pthread_mutex_t  lock;
+    pid_t            pid;               /*< Process the pools belong to */
+    char             directory[64];     /*< Private directory of sockets ("" until made) */
+    struct scgi_pool pools[SCGI_SCRIPTS];
+    size_t           npools;
+} Scgi = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Determine whether script speaks SCGI (by its suffix) rather than CGI.
+ **/
+bool
+scgi_script(const char *path)
+{
+    size_t length = strlen(path);
+
+    return length > strlen(SCGI_SUFFIX) && streq(path + length - strlen(SCGI_SUFFIX), SCGI_SUFFIX);
+}
+
+/**
+ * Number of workers to run per script: one for each request this process can
+ * handle at once (up to SCGI_WORKERS), which is one except in threaded mode.
+ **/
+static size_t
+scgi_workers(void)
+{
+    if (ConcurrencyMode == THREADED) {
+        return NWorkers < SCGI_WORKERS ? NWorkers : SCGI_WORKERS;
+    }
+    return 1;
+}
+
+/**
+ * Determine whether worker process is still running (children may be reaped
+ * automatically, as in forking mode, so a missing child is checked with kill).
+ **/
+static bool
+scgi_alive(pid_t pid)
+{
+    pid_t status = waitpid(pid, NULL, WNOHANG);
+
+    return status == 0 || (status < 0 && errno == ECHILD && kill(pid, 0) == 0);
+}
+
+/**
+ * Start worker process for pool, with the pool's socket as standard input
+ * and no other descriptors besides standard output and error.
+ *
+ * Returns pid of worker, or -1 on failure.
+ **/
+static pid_t
+scgi_spawn(struct scgi_pool *p)
+{
+    char *argv[] = { p->path, NULL };
+    pid_t parent = getpid();
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        debug("Unable to fork: %s", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        /* Child: only async-signal-safe calls until exec */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent || dup2(p->sfd, STDIN_FILENO) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        signal(SIGPIPE, SIG_DFL);
+        execv(p->path, argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    debug("Started SCGI worker %d for %s", pid, p->path);
+    return pid;
+}
+
+/**
+ * Find pool for script, creating it if there is room (with the lock held).
+ *
+ * Returns pool, or NULL on failure.
+ **/
+static struct scgi_pool *
+scgi_pool(const char *path)
+{
+    struct scgi_pool *p;
+
+    /* Pools inherited across fork belong to the parent */
+    if (Scgi.pid != getpid()) {
+        for (size_t i = 0; i < Scgi.npools; i++) {
+            close(Scgi.pools[i].sfd);
+            free(Scgi.pools[i].path);
+        }
+        Scgi.npools = 0;
+        Scgi.pid    = getpid();
+        Scgi.directory[0] = '\0';
+    }
+
+    for (size_t i = 0; i < Scgi.npools; i++) {
+        if (streq(Scgi.pools[i].path, path)) {
+            return &Scgi.pools[i];
+        }
+    }
+    if (Scgi.npools == SCGI_SCRIPTS) {
+        log("Unable to start SCGI workers for %s: too many scripts", path);
+        return NULL;
+    }
+
+    /* Make private directory (mode 0700) for the sockets */
+    if (Scgi.directory[0] == '\0') {
+        snprintf(Scgi.directory, sizeof(Scgi.directory), "%s", SCGI_DIRECTORY);
+        if (mkdtemp(Scgi.directory) == NULL) {
+            log("Unable to make SCGI socket directory: %s", strerror(errno));
+            Scgi.directory[0] = '\0';
+            return NULL;
+        }
+    }
+
+    p = &Scgi.pools[Scgi.npools];
+    memset(p, 0, sizeof(*p));
+    p->address.sun_family = AF_UNIX;
+    snprintf(p->address.sun_path, sizeof(p->address.sun_path), "%s/%zu", Scgi.directory, Scgi.npools);
+    p->length = sizeof(p->address);
+
+    if ((p->sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        debug("Unable to socket: %s", strerror(errno));
+        return NULL;
+    }
+    if (bind(p->sfd, (struct sockaddr *) &p->address, p->length) < 0 ||
+        listen(p->sfd, SCGI_BACKLOG) < 0 || (p->path = strdup(path)) == NULL) {
+        debug("Unable to listen for SCGI workers: %s", strerror(errno));
+        close(p->sfd);
+        return NULL;
+    }
+
+    Scgi.npools++;
+    return p;
+}
+
+/**
+ * Write all of buffer to socket.
+ **/
+static int
+scgi_send(int fd, const char *buffer, size_t length)
+{
+    ssize_t nsent;
+
+    while (length > 0) {
+        nsent = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += nsent;
+        length -= nsent;
+    }
+    return 0;
+}
+
+/**
+ * Send request to a worker of SCGI script: env (NULL-terminated "NAME=value"
+ * strings, starting with CONTENT_LENGTH) as a netstring of NUL-separated
+ * names and values, with no body.  Worker processes are started (or started
+ * again) as needed.
+ *
+ * Returns socket to read the worker's CGI response from, or -1 on failure
+ * (with errno EAGAIN if too many requests are already waiting for workers).
+ **/
+int
+scgi_request(const char *path, char *const env[])
+{
+    struct timeval timeout = { .tv_sec = SCGI_TIMEOUT };
+    struct scgi_pool *p;
+    struct sockaddr_un address;
+    socklen_t length;
+    char prefix[32];
+    char *block;
+    char *b;
+    size_t nblock = strlen("SCGI") + strlen("1") + 2;
+    int fd;
+
+    /* Find pool and replace workers that have exited */
+    pthread_mutex_lock(&Scgi.lock);
+    if ((p = scgi_pool(path)) == NULL) {
+        pthread_mutex_unlock(&Scgi.lock);
+        return -1;
+    }
+    for (size_t i = 0; i < scgi_workers(); i++) {
+        if (p->workers[i] <= 0 || !scgi_alive(p->workers[i])) {
+            p->workers[i] = scgi_spawn(p);
+        }
+    }
+    address = p->address;
+    length  = p->length;
+    pthread_mutex_unlock(&Scgi.lock);
+
+    /* Connect without waiting, so a full backlog fails at once */
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, length) < 0) {
+        int error = errno;
+
+        debug("Unable to connect to SCGI worker: %s", strerror(error));
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Headers netstring: CONTENT_LENGTH, SCGI, then everything else */
+    for (size_t i = 0; env[i]; i++) {
+        nblock += strlen(env[i]) + 1;
+    }
+    if ((block = malloc(nblock)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    b = block;
+    for (size_t i = 0; env[i]; i++) {
+        char *name = b;
+        char *equals;
+
+        b = stpcpy(b, env[i]) + 1;
+        if ((equals = strchr(name, '=')) != NULL) {
+            *equals = '\0';
+        }
+        if (i == 0) {
+            b = stpcpy(b, "SCGI") + 1;
+            b = stpcpy(b, "1") + 1;
+        }
+    }
+
+    snprintf(prefix, sizeof(prefix), "%zu:", nblock);
+    if (scgi_send(fd, prefix, strlen(prefix)) < 0 || scgi_send(fd, block, nblock) < 0 || scgi_send(fd, ",", 1) < 0) {
+        debug("Unable to send SCGI request: %s", strerror(errno));
+        free(block);
+        close(fd);
+        return -1;
+    }
+    free(block);
+    return fd;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -23,7 +23,7 @@ single_server(int sfd)
             continue;
         }        
 	/* Handle request */
-        handle_request(request);        
+        handle_connection(request);
 
 	/* Free request */
         free_request(request);
@@ -14,6 +14,10 @@
 
 /**
  * Allocate socket, bind it, and listen to specified port.
+ *
+ * If ReusePort is set, the socket joins the port's SO_REUSEPORT group, so each
+ * worker can call this to get its own listener and accept queue, with the
+ * kernel balancing new connections across them.
  **/
 int
 socket_listen(const char *port)
@@ -39,6 +43,16 @@ socket_listen(const char *port)
             fprintf(stderr, "socket failed: %s\n", strerror(errno));
             continue;
         }
+
+        /* Allow quick restarts and (optionally) per-worker listeners */
+        int on = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (ReusePort && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
 	/* Bind socket */
         if (bind(server_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "bind failed: %s\n", strerror(errno));
@@ -3,8 +3,10 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
@@ -14,6 +16,37 @@ char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
 mode  ConcurrencyMode = SINGLE;
+int   NWorkers        = 0;
+int   QueueDepth      = 0;
+bool  ReusePort       = false;
+int   KeepAliveTimeout = 5;
+int   KeepAliveMax    = 100;
+size_t CacheBudget    = 64 << 20;
+bool  ResolveHosts    = false;
+char *AccessLogPath   = NULL;
+bool  AccessLogBlock  = false;
+int   MaxConnections  = 0;
+int   MaxClientConnections = 0;
+int   ShedDelay       = 0;
+bool  ShedLoad        = false;
+char *TracePath       = NULL;
+int   TraceEvery      = 1;
+struct cache_policy CachePolicies[MAX_CACHE_POLICIES];
+int   NCachePolicies  = 0;
+int   CgiCacheTTL     = 0;
+int   CgiCacheStale   = 0;
+const char *CgiCacheVary[MAX_CGI_CACHE_VARY];
+int   NCgiCacheVary   = 0;
+
+/* Concurrency mode names (indexed by mode) */
+static const char *ModeNames[] = {
+    [SINGLE]   = "single",
+    [FORKING]  = "forking",
+    [PREFORK]  = "prefork",
+    [THREADED] = "threaded",
+    [EVENT]    = "event",
+    [URING]    = "uring",
+};
 
 /**
  * Display usage message.
@@ -21,17 +54,90 @@ mode  ConcurrencyMode = SINGLE;
 void
 usage(const char *progname, int status)
 {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [haBbcCdDklLmMnpqrRStTVxX]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a path       Access log file (Combined Log Format; reopened on SIGUSR1)\n");
+    fprintf(stderr, "    -B            Wait for room in a full access log buffer (default: drop lines)\n");
+    fprintf(stderr, "    -b bytes      Content cache budget, with optional K, M, or G suffix (default: 64M, 0 disables)\n");
+    fprintf(stderr, "    -k requests   Maximum requests per connection (default: 100, 0 disables keep-alive)\n");
+    fprintf(stderr, "    -l conns      Maximum concurrent connections, answering 503 past it (default: 0, no limit)\n");
+    fprintf(stderr, "    -L conns      Maximum concurrent connections per client address (default: 0, no limit)\n");
+    fprintf(stderr, "    -c mode       Concurrency mode (single, forking, prefork, threaded, event, uring)\n");
+    fprintf(stderr, "    -C path=value Cache-Control for files under path (e.g. /static=max-age=86400; repeatable)\n");
+    fprintf(stderr, "    -d            Resolve client host names in the background (for logs and REMOTE_HOST)\n");
+    fprintf(stderr, "    -D msecs      Shed requests (503) while queueing delay stays above this (CoDel; default: 0, disabled)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n workers    Number of workers in pooled modes (default: online CPUs)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -q depth      Connection queue depth in threaded mode (default: 4 x workers; 503 when full with -l, -L, or -D)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -R            Per-worker SO_REUSEPORT listeners pinned to CPUs\n");
+    fprintf(stderr, "    -S requests   Trace one in this many requests (default: 1)\n");
+    fprintf(stderr, "    -t seconds    Keep-alive idle timeout (default: 5; at most 1 between requests in blocking modes)\n");
+    fprintf(stderr, "    -T path       Trace request phases, written to path as Chrome trace JSON on SIGUSR2\n");
+    fprintf(stderr, "    -V header     Request header CGI output varies by, for the CGI cache (repeatable)\n");
+    fprintf(stderr, "    -x seconds    Cache CGI output of GET requests (default: 0, disabled; needs the content cache)\n");
+    fprintf(stderr, "    -X seconds    Serve expired CGI output while one request refreshes it (default: 0)\n");
     exit(status);
 }
 
+/**
+ * Convert concurrency mode name into mode (UNKNOWN if not recognized).
+ **/
+mode
+parse_mode(const char *name)
+{
+    for (mode m = SINGLE; m < UNKNOWN; m++) {
+        if (strcasecmp(name, ModeNames[m]) == 0) {
+            return m;
+        }
+    }
+    return UNKNOWN;
+}
+
+/**
+ * Convert size with optional K, M, or G suffix into bytes (-1 if invalid).
+ **/
+long long
+parse_size(const char *s)
+{
+    char *end;
+    long long size = strtoll(s, &end, 10);
+
+    switch (*end) {
+        case 'g': case 'G': size <<= 10;    /* Fall through */
+        case 'm': case 'M': size <<= 10;    /* Fall through */
+        case 'k': case 'K': size <<= 10; end++;
+        default: break;
+    }
+    return end == s || *end != '\0' || size < 0 ? -1 : size;
+}
+
+/**
+ * Add Cache-Control policy given as "prefix=directives" (false if invalid).
+ **/
+bool
+parse_cache_policy(char *s)
+{
+    char *directives = strchr(s, '=');
+
+    if (s[0] != '/' || directives == NULL || directives[1] == '\0') {
+        return false;
+    }
+    *directives++ = '\0';
+
+    /* Compare without the trailing slash, so "/static/" covers "/static" */
+    for (char *end = s + strlen(s) - 1; end > s && *end == '/'; end--) {
+        *end = '\0';
+    }
+    CachePolicies[NCachePolicies].prefix     = s;
+    CachePolicies[NCachePolicies].directives = directives;
+    NCachePolicies++;
+    return true;
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
@@ -49,8 +155,45 @@ main(int argc, char *argv[])
             case 'h':
                 usage(progname, 0);
                 break;
+            case 'a':
+                if (place >= argc) usage(progname, 1);
+                AccessLogPath = argv[place++];
+                break;
+            case 'B':
+                AccessLogBlock = true;
+                break;
+            case 'b':
+                if (place >= argc || parse_size(argv[place]) < 0) usage(progname, 1);
+                CacheBudget = parse_size(argv[place++]);
+                break;
             case 'c':
-                ConcurrencyMode = (mode) argv[place++];
+                if (place >= argc) usage(progname, 1);
+                ConcurrencyMode = parse_mode(argv[place++]);
+                if (ConcurrencyMode == UNKNOWN) usage(progname, 1);
+                break;
+            case 'C':
+                if (place >= argc || NCachePolicies == MAX_CACHE_POLICIES || !parse_cache_policy(argv[place++])) {
+                    usage(progname, 1);
+                }
+                break;
+            case 'd':
+                ResolveHosts = true;
+                break;
+            case 'D':
+                if (place >= argc) usage(progname, 1);
+                ShedDelay = atoi(argv[place++]);
+                break;
+            case 'k':
+                if (place >= argc) usage(progname, 1);
+                KeepAliveMax = atoi(argv[place++]);
+                break;
+            case 'l':
+                if (place >= argc) usage(progname, 1);
+                MaxConnections = atoi(argv[place++]);
+                break;
+            case 'L':
+                if (place >= argc) usage(progname, 1);
+                MaxClientConnections = atoi(argv[place++]);
                 break;
             case 'm':
                 MimeTypesPath = argv[place++];
@@ -58,12 +201,47 @@ main(int argc, char *argv[])
             case 'M':
                 DefaultMimeType = argv[place++];
                 break;
+            case 'n':
+                if (place >= argc) usage(progname, 1);
+                NWorkers = atoi(argv[place++]);
+                break;
             case 'p':
                 Port = argv[place++];
                 break;
+            case 'q':
+                if (place >= argc) usage(progname, 1);
+                QueueDepth = atoi(argv[place++]);
+                break;
             case 'r':
                 RootPath = argv[place++];
                 break;
+            case 'R':
+                ReusePort = true;
+                break;
+            case 'S':
+                if (place >= argc || atoi(argv[place]) <= 0) usage(progname, 1);
+                TraceEvery = atoi(argv[place++]);
+                break;
+            case 't':
+                if (place >= argc) usage(progname, 1);
+                KeepAliveTimeout = atoi(argv[place++]);
+                break;
+            case 'T':
+                if (place >= argc) usage(progname, 1);
+                TracePath = argv[place++];
+                break;
+            case 'V':
+                if (place >= argc || NCgiCacheVary == MAX_CGI_CACHE_VARY) usage(progname, 1);
+                CgiCacheVary[NCgiCacheVary++] = argv[place++];
+                break;
+            case 'x':
+                if (place >= argc) usage(progname, 1);
+                CgiCacheTTL = atoi(argv[place++]);
+                break;
+            case 'X':
+                if (place >= argc) usage(progname, 1);
+                CgiCacheStale = atoi(argv[place++]);
+                break;
             default:
                 usage(progname, 1);
         }
@@ -77,18 +255,84 @@ main(int argc, char *argv[])
     /* Determine real RootPath */
     RootPath = realpath(RootPath, NULL);
 
+    /* Default to one worker per online CPU */
+    if (NWorkers <= 0) {
+        NWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (NWorkers <= 0) NWorkers = 1;
+    }
+    if (QueueDepth <= 0) {
+        QueueDepth = 4 * NWorkers;
+    }
+    ShedLoad = MaxConnections > 0 || MaxClientConnections > 0 || ShedDelay > 0;
+
+    /* Report writes to disconnected clients as EPIPE instead of dying */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Pick request scanner for this CPU */
+    scan_init();
+
+    /* Load mime types once (and again on SIGHUP) */
+    mime_load();
+    signal(SIGHUP, mime_hangup);
+
+    /* Map content cache, metrics, connection counts, access log, and trace
+     * before any workers are forked so they share them */
+    cache_init(CacheBudget);
+    stats_init();
+    admission_init();
+    access_log_init();
+    trace_init();
+
     log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE ? "Single" : "Forking");
-
-    /* Start either forking or single HTTP server */
-    if (ConcurrencyMode == SINGLE) {
-        single_server(sfd);    
-    }   
-    else {
-        forking_server(sfd);
+    debug("ConcurrencyMode = %s", ModeNames[ConcurrencyMode]);
+    debug("NWorkers        = %d", NWorkers);
+    debug("QueueDepth      = %d", QueueDepth);
+    debug("ReusePort       = %s", ReusePort ? "true" : "false");
+    debug("KeepAlive       = %d requests, %d seconds", KeepAliveMax, KeepAliveTimeout);
+    debug("CacheBudget     = %zu bytes", CacheBudget);
+    debug("Scanner         = %s", scan_implementation());
+    debug("ResolveHosts    = %s", ResolveHosts ? "true" : "false");
+    debug("AccessLog       = %s (%s when full)", AccessLogPath ? AccessLogPath : "none", AccessLogBlock ? "block" : "drop");
+    debug("Admission       = %d connections, %d per client, %d ms delay", MaxConnections, MaxClientConnections, ShedDelay);
+    debug("Trace           = %s (one in %d requests)", TracePath ? TracePath : "none", TraceEvery);
+    for (int i = 0; i < NCachePolicies; i++) {
+        debug("CachePolicy     = %s: %s", CachePolicies[i].prefix, CachePolicies[i].directives);
+    }
+    debug("CgiCache        = %d seconds, %d stale", CgiCacheTTL, CgiCacheStale);
+    for (int i = 0; i < NCgiCacheVary; i++) {
+        debug("CgiCacheVary    = %s", CgiCacheVary[i]);
+    }
+
+    /* Start HTTP server for concurrency mode */
+    switch (ConcurrencyMode) {
+        case SINGLE:
+            single_server(sfd);
+            break;
+        case FORKING:
+            forking_server(sfd);
+            break;
+        case PREFORK:
+            prefork_server(sfd);
+            break;
+        case THREADED:
+            threaded_server(sfd);
+            break;
+        case EVENT:
+        case URING:
+            /* Per-worker listeners: supervise one event loop per worker */
+            if (ReusePort) {
+                prefork_server(sfd);
+            } else if (ConcurrencyMode == EVENT) {
+                event_server(sfd);
+            } else {
+                uring_server(sfd);
+            }
+            break;
+        default:
+            usage(progname, 1);
     }
     return EXIT_SUCCESS;
 }
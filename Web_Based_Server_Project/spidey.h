@@ -2,15 +2,25 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define REQUEST_BUFSIZ	BUFSIZ		/* Maximum size of request line and headers */
+#define REQUEST_HEADERS	64		/* Maximum number of request headers */
+#define REQUEST_ARENASIZ	8192		/* Per-request scratch memory (see request_alloc) */
+#define RESPONSE_BUFSIZ	(64 << 10)	/* Largest staged response kept for reuse */
+#define RETRY_AFTER	1		/* Seconds clients turned away with 503 are asked to wait */
 
 /**
  * Concurrency modes
@@ -18,77 +28,369 @@
 typedef enum {
     SINGLE,     /**< Single connection */
     FORKING,    /**< Process per connection */
+    PREFORK,    /**< Pool of long-lived worker processes */
+    THREADED,   /**< Pool of worker threads fed by a connection queue */
+    EVENT,      /**< Non-blocking epoll event loop */
+    URING,      /**< io_uring completion loop (falls back to EVENT) */
     UNKNOWN
 } mode;
 
-/* Global Variables */
+/* Global Variables
+ *
+ * These are only written while parsing the command line, before any workers
+ * are started, so they can be read from any thread without locking.
+ */
 
 extern char *Port;                  /**< Port number */
 extern char *MimeTypesPath;         /**< Path to mime.types file */
 extern char *DefaultMimeType;       /**< Default file mimetype */
 extern char *RootPath;              /**< Path to root directory */
+extern mode  ConcurrencyMode;       /**< Concurrency mode */
+extern int   NWorkers;              /**< Number of workers in pooled modes */
+extern int   QueueDepth;            /**< Capacity of threaded connection queue */
+extern bool  ReusePort;             /**< Per-worker SO_REUSEPORT listeners pinned to CPUs */
+extern int   KeepAliveTimeout;      /**< Seconds to wait for next request on connection */
+extern int   KeepAliveMax;          /**< Maximum requests per connection (0 disables keep-alive) */
+extern size_t CacheBudget;          /**< Bytes of file content cached in shared memory (0 disables) */
+extern bool  ResolveHosts;          /**< Resolve client host names in the background */
+extern char *AccessLogPath;         /**< Access log file (NULL disables) */
+extern bool  AccessLogBlock;        /**< Wait for room in a full access log instead of dropping lines */
+extern int   MaxConnections;        /**< Concurrent connections before answering 503 (0 for no limit) */
+extern int   MaxClientConnections;  /**< Concurrent connections per client address (0 for no limit) */
+extern int   ShedDelay;             /**< Milliseconds of queueing delay to shed load above (0 disables) */
+extern bool  ShedLoad;              /**< Answer 503 rather than queue past limits (any of the above set) */
+extern char *TracePath;             /**< Chrome trace file (NULL disables tracing) */
+extern int   TraceEvery;            /**< Trace one in this many requests (0 if tracing is disabled) */
+
+#define MAX_CACHE_POLICIES  16          /* Cache-Control policies (-C) */
+
+struct cache_policy {
+    const char *prefix;     /*< Path under RootPath the policy covers */
+    const char *directives; /*< Cache-Control value */
+};
+
+extern struct cache_policy CachePolicies[MAX_CACHE_POLICIES]; /**< Cache-Control per path prefix */
+extern int   NCachePolicies;        /**< Number of Cache-Control policies */
+
+#define MAX_CGI_CACHE_VARY  8           /* Request headers CGI output varies by (-V) */
 
-/* Logging Macros */
+extern int   CgiCacheTTL;           /**< Seconds to cache CGI output (0 disables) */
+extern int   CgiCacheStale;         /**< Seconds to serve expired CGI output while refreshing it */
+extern const char *CgiCacheVary[MAX_CGI_CACHE_VARY]; /**< Request headers in CGI cache keys */
+extern int   NCgiCacheVary;         /**< Number of CGI cache key headers */
 
+/* Logging Macros
+ *
+ * Messages below LOG_LEVEL are compiled out (make LOG_LEVEL=1 for a build
+ * without debug messages; NDEBUG implies it): their arguments are still
+ * type checked, but never evaluated.
+ */
+
+#define LOG_LEVEL_DEBUG	0
+#define LOG_LEVEL_LOG	1
+#define LOG_LEVEL_FATAL	2
+
+#ifndef LOG_LEVEL
 #ifdef NDEBUG
-#define debug(M, ...)
+#define LOG_LEVEL	LOG_LEVEL_LOG
 #else
+#define LOG_LEVEL	LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
 #define debug(M, ...)   fprintf(stderr, "[%5d] DEBUG %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define debug(M, ...)   do { if (0) fprintf(stderr, M, ##__VA_ARGS__); } while (0)
 #endif
 
-#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
+#if LOG_LEVEL <= LOG_LEVEL_LOG
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define log(M, ...)     do { if (0) fprintf(stderr, M, ##__VA_ARGS__); } while (0)
+#endif
+
+#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 
 /* HTTP Request */
 
+/* Header name and value, as offsets into the request buffer of strings
+ * terminated in place */
 struct header {
-    char *name;
-    char *value;
-
-    struct header *next;
+    uint16_t name;
+    uint16_t nname;
+    uint16_t value;
+    uint16_t nvalue;
 };
 
+typedef enum {
+    REQUEST_BROWSE,
+    REQUEST_FILE,
+    REQUEST_CGI,
+    REQUEST_BAD,
+} request_type;
+
+/* Phases of a request (see TRACE_BEGIN) */
+typedef enum {
+    TRACE_REQUEST,      /* First byte read to response sent */
+    TRACE_ACCEPT,       /* Setting up connection (client address lookup) */
+    TRACE_READ,         /* Reading request line and headers */
+    TRACE_PARSE,        /* parse_request */
+    TRACE_RESOLVE,      /* path_resolve */
+    TRACE_HANDLE,       /* Handler (whole response in blocking modes) */
+    TRACE_MIMETYPE,     /* determine_mimetype */
+    TRACE_BODY,         /* Copying file body (blocking modes) */
+    TRACE_SEND,         /* Writing staged response and body (nonblocking modes) */
+    TRACE_PHASES,
+} trace_phase;
+
+typedef enum {
+    REQUEST_READING_LINE,       /* Reading request line */
+    REQUEST_READING_HEADERS,    /* Reading headers */
+    REQUEST_WRITING_RESPONSE,   /* Writing staged status line, headers, and body */
+    REQUEST_STREAMING_BODY,     /* Streaming file body */
+} request_state;
+
 struct request {
     int   fd;               /*< Client socket file descripter */
-    FILE *file;             /*< Client socket file stream */
-    char *method;           /*< HTTP method */
-    char *uri;              /*< HTTP uniform resource identifier */
-    char *path;             /*< Real path corrsponding to URI and RootPath */
-    char *query;            /*< HTTP query string */
+    FILE *file;             /*< Response stream (socket, or memory if nonblocking; kept per connection) */
+    char *method;           /*< HTTP method (in buffer) */
+    char *uri;              /*< HTTP uniform resource identifier (in buffer) */
+    char *path;             /*< Real path corrsponding to URI and RootPath (in arena) */
+    char *query;            /*< HTTP query string (in buffer) */
 
     char host[NI_MAXHOST];
     char port[NI_MAXSERV];
 
-    struct header *headers; /*< List of name, value pairs */
+    struct header headers[REQUEST_HEADERS]; /*< Name, value pairs in buffer */
+    size_t  nheaders;       /*< Number of headers */
+
+    int     minor;          /*< HTTP minor version (HTTP/1.x) */
+    int     nrequests;      /*< Requests handled on this connection */
+    bool    keepalive;      /*< Keep connection open after response */
+    bool    chunked;        /*< Response body uses chunked encoding */
+    bool    responded;      /*< Response status line has been written */
+
+    request_state state;    /*< Progress through request and response */
+    bool    nonblocking;    /*< Stage response in memory instead of writing to socket */
+
+    char   *buffer;         /*< Raw request line and headers (REQUEST_BUFSIZ) */
+    size_t  nbuffer;        /*< Bytes read into buffer */
+    size_t  nscanned;       /*< Bytes of buffer scanned for end of headers */
+    size_t  nparsed;        /*< Bytes of buffer consumed by parser */
+
+    char   *arena;          /*< Scratch memory following buffer (REQUEST_ARENASIZ) */
+    size_t  narena;         /*< Bytes of arena allocated */
+
+    char   *output;         /*< Staged response (nonblocking) */
+    size_t  noutput;        /*< Length of staged response */
+    size_t  nwritten;       /*< Bytes of staged response written */
+
+    int     body_fd;        /*< File to stream after staged response (-1 if none) */
+    off_t   body_offset;    /*< Offset of next body byte to stream */
+    off_t   body_length;    /*< Body bytes left to stream */
+    int     cached;         /*< Content cache entry to send instead of body_fd (-1 if none) */
+    struct byteranges *ranges; /*< Parts of multipart/byteranges body (in arena; NULL if none) */
+
+    off_t           size;   /*< Size of path (from path_resolve) */
+    struct timespec mtime;  /*< Modification time of path (from path_resolve) */
+    ino_t           ino;    /*< Inode of path (from path_resolve) */
+
+    request_type    type;   /*< Handler of request (REQUEST_BAD if none) */
+    int             code;   /*< Status code of response (from its status line) */
+    struct timespec started;/*< When request was read (see stats_response) */
+    size_t          nsent;  /*< Bytes of response sent */
+
+    bool    counted;        /*< Counted in connection limits and metrics (until freed) */
+    int     client;         /*< Per-client connection counter (-1 if none) */
+    bool    shed;           /*< Answer 503 instead of handling request (overload) */
+
+    bool     traced;                /*< Phases of request are traced */
+    uint64_t phases[TRACE_PHASES];  /*< Start of each phase under way (ns; 0 if none) */
+
+    time_t  active;         /*< Time of last activity (event modes) */
+    struct request *prev;   /*< Idle list links (event modes) */
+    struct request *next;
 };
 
 struct request *    accept_request(int sfd);
+struct request *    new_request(int fd, struct sockaddr *raddr, socklen_t rlen);
 void		    free_request(struct request *request);
+void		    reset_request(struct request *request);
+const char *	    find_header(struct request *request, const char *name);
+void *		    request_alloc(struct request *request, size_t size);
+char *		    request_strdup(struct request *request, const char *s);
+int		    read_request(struct request *request);
+int		    scan_request(struct request *request, bool eof);
 int		    parse_request(struct request *request);
 
 /* HTTP Request Handlers */
 
-typedef enum {
-    REQUEST_BROWSE,
-    REQUEST_FILE,
-    REQUEST_CGI,
-    REQUEST_BAD,
-} request_type;
-
 typedef enum {
     HTTP_STATUS_OK,			/* 200 OK */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } http_status;
 
 http_status	    handle_request(struct request *request);
+void		    handle_connection(struct request *request);
+void		    write_headers(struct request *request, const char *status, const char *mimetype, off_t length);
+void		    end_headers(struct request *request);
+void		    write_chunk(struct request *request, const char *data, size_t length);
+bool		    next_part(struct request *request);
 
 /* HTTP Server */
 
 void		    single_server(int sfd);
 void		    forking_server(int sfd);
+void		    prefork_server(int sfd);
 void		    threaded_server(int sfd);
+void		    event_server(int sfd);
+void		    idle_touch(struct request *request);
+void		    idle_remove(struct request *request);
+struct request *    idle_expired(time_t now);
+void		    uring_server(int sfd);
+
+/* Request Paths */
+
+struct path_info {
+    char           *path;   /*< Real path under RootPath (PATH_MAX bytes) */
+    request_type    type;
+    off_t           size;
+    struct timespec mtime;
+    ino_t           ino;
+};
+
+int		    path_resolve(const char *uri, struct path_info *info);
+
+/* Content Cache */
+
+void		    cache_init(size_t budget);
+bool		    cache_lookup(struct request *request, const struct path_info *info, const struct path_info *original,
+				 const char *encoding);
+bool		    cache_insert(struct request *request, const struct path_info *info, const struct path_info *original,
+				 const char *encoding, const char *header, size_t nheader, int fd, const char *data, size_t length);
+void		    cache_release(struct request *request);
+int		    cache_iovec(struct request *request, struct iovec *iov);
+ssize_t		    cache_write(struct request *request);
+void		    cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions);
+
+typedef enum {
+    CACHE_HIT,          /* Cached response pinned for request */
+    CACHE_MISS,         /* Request must generate and publish the response */
+    CACHE_BYPASS,       /* Request must generate the response without caching it */
+} cache_result;
+
+cache_result	    cache_claim(struct request *request, const char *key);
+bool		    cache_publish(struct request *request, const char *key, int ttl, int stale,
+				  const char *header, size_t nheader, const char *data, size_t length);
+void		    cache_abandon(const char *key);
+
+/* Metrics */
+
+#define STATS_URI	"/__stats"	/* Metrics endpoint (Prometheus text format) */
+
+typedef enum {
+    STATS_PATH_HITS,    /* Path cache hits */
+    STATS_PATH_MISSES,  /* Path cache misses */
+    STATS_LOG_DROPS,    /* Access log lines dropped */
+    STATS_REJECT_CONNECTIONS,   /* Turned away: MaxConnections reached */
+    STATS_REJECT_CLIENT,        /* Turned away: MaxClientConnections reached */
+    STATS_REJECT_QUEUE,         /* Turned away: connection queue full */
+    STATS_REJECT_FORK,          /* Turned away: unable to fork */
+    STATS_REJECT_DELAY,         /* Shed: queueing delay above ShedDelay */
+    STATS_COUNTERS,
+} stats_counter;
+
+void		    stats_init(void);
+void		    stats_connection(int delta);
+void		    stats_count(stats_counter counter);
+void		    stats_response(struct request *request);
+void		    stats_phase(trace_phase phase, uint64_t elapsed);
+void		    stats_write(FILE *stream);
+
+/* Admission Control */
+
+/* CoDel state of one queue (see codel_shed) */
+struct codel {
+    uint64_t first_above;   /*< When delay will have been above target for an interval (0 if below) */
+    uint64_t next;          /*< When to shed next while shedding */
+    uint32_t count;         /*< Shed since shedding started */
+    bool     shedding;
+};
+
+void		    admission_init(void);
+bool		    admit_connection(struct request *request, const struct sockaddr *addr);
+void		    release_connection(struct request *request);
+void		    reject_connection(int fd);
+bool		    codel_shed(struct codel *c, uint64_t since);
+
+/* Access Log */
+
+void		    access_log_init(void);
+void		    access_log(struct request *request);
+void		    access_log_flush(void);
+
+/* Request Tracing
+ *
+ * Phases are only timed for requests picked by trace_sample, so while
+ * tracing is disabled each mark costs one branch.
+ */
+
+#define TRACE_SAMPLE(r)         do { if (__builtin_expect(TraceEvery != 0, 0)) trace_sample(r); } while (0)
+#define TRACE_BEGIN(r, phase)   do { if (__builtin_expect((r)->traced, 0)) trace_begin((r), (phase)); } while (0)
+#define TRACE_END(r, phase)     do { if (__builtin_expect((r)->traced, 0)) trace_end((r), (phase)); } while (0)
+
+void		    trace_init(void);
+void		    trace_sample(struct request *request);
+void		    trace_begin(struct request *request, trace_phase phase);
+void		    trace_end(struct request *request, trace_phase phase);
+void		    trace_dump(void);
+const char *	    trace_phase_name(trace_phase phase);
+
+/* Content Encodings */
+
+#define MAX_ENCODINGS	2		/* Content codings supported */
+
+struct encoding {
+    const char *name;       /*< Content-Encoding token */
+    const char *extension;  /*< Extension of precompressed siblings */
+    int       (*compress)(const char *data, size_t length, char **output, size_t *noutput);
+};
+
+size_t		    negotiate_encodings(struct request *request, const struct encoding **choices);
+bool		    encoding_compressible(const char *mimetype);
+
+/* Request Scanning */
+
+void		    scan_init(void);
+size_t		    scan_token(const char *s, size_t n);
+size_t		    scan_uri(const char *s, size_t n);
+bool		    scan_select(const char *name);
+const char *	    scan_implementation(void);
+
+/* Client Host Names */
+
+void		    resolver_request(const struct sockaddr *addr, socklen_t length, const char *address);
+bool		    resolver_lookup(const char *address, char *name, size_t size);
+
+/* SCGI Workers */
+
+bool		    scgi_script(const char *path);
+int		    scgi_request(const char *path, char *const env[]);
+
+/* Mime Types */
+
+void		    mime_load(void);
+void		    mime_hangup(int signum);
+bool		    mime_reload(void);
+const char *	    determine_mimetype(const char *path);
 
 /* Socket */
 
@@ -99,10 +401,12 @@ int		    socket_listen(const char *port);
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *		    determine_mimetype(const char *path);
-char *		    determine_request_path(const char *uri);
+int		    pin_worker(int index);
+char *		    determine_request_path(const char *uri, char *real);
 request_type	    determine_request_type(const char *path);
+const char *	    determine_cache_control(const char *path);
 const char *        http_status_string(http_status status);
+uint64_t	    monotonic_ns(void);
 char *		    skip_nonwhitespace(char *s);
 char *		    skip_whitespace(char *s);
 
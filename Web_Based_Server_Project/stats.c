@@ -0,0 +1,273 @@
+/* stats.c: Live Server Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define STATS_SLOTS     64                  /* Worker slots (more workers share them) */
+#define STATS_BUCKETS   23                  /* Latency buckets: 1us to 4s by powers of two (then +Inf) */
+#define STATS_TYPES     (REQUEST_BAD + 1)
+#define STATS_CODES     500                 /* Status codes 100 to 599 */
+
+/* Internal Declarations */
+
+/**
+ * Counters of one worker (process or thread), on cache lines of its own.
+ *
+ * Every update is a relaxed atomic add, so a worker never waits for another,
+ * and workers that have to share a slot (more than STATS_SLOTS of them, or
+ * forked children, which keep the slot of the process that forked them) still
+ * count correctly.  Readers sum all slots.
+ **/
+struct stats_slot {
+    uint64_t requests[STATS_TYPES][STATS_CODES];
+    uint64_t bytes[STATS_TYPES];
+    uint64_t latency[STATS_TYPES][STATS_BUCKETS + 1];
+    uint64_t latency_sum[STATS_TYPES];      /*< Nanoseconds */
+    int64_t  connections;                   /*< Opened minus closed here */
+    uint64_t counters[STATS_COUNTERS];
+    uint64_t phases[TRACE_PHASES];          /*< Nanoseconds in traced phases */
+    uint64_t nphases[TRACE_PHASES];         /*< Traced phases */
+} __attribute__ ((aligned(64)));
+
+/**
+ * Metrics in anonymous shared memory, mapped before any workers are forked
+ * so that every process counts into the same table.
+ **/
+struct stats {
+    uint32_t          nslots;               /*< Slots handed out (wraps around) */
+    struct stats_slot slots[STATS_SLOTS];
+};
+
+static struct stats *Stats = NULL;
+static __thread struct stats_slot *Slot = NULL;
+
+/* Label values */
+static const char *StatsTypes[] = { "browse", "file", "cgi", "other" };
+
+/**
+ * Map metrics table (once, before any workers are started).
+ **/
+void
+stats_init(void)
+{
+    struct stats *s;
+
+    s = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        log("Unable to mmap stats: %s", strerror(errno));
+        return;
+    }
+    Stats = s;
+}
+
+/**
+ * Return slot of calling worker, claiming one on first use (NULL if there are
+ * no stats).
+ **/
+static struct stats_slot *
+stats_slot(void)
+{
+    if (Slot == NULL && Stats) {
+        Slot = &Stats->slots[__atomic_fetch_add(&Stats->nslots, 1, __ATOMIC_RELAXED) % STATS_SLOTS];
+    }
+    return Slot;
+}
+
+#define STATS_ADD(field, n)     __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(field)       __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * Count client connection opened (delta 1) or closed (delta -1).
+ **/
+void
+stats_connection(int delta)
+{
+    struct stats_slot *s = stats_slot();
+
+    if (s) {
+        STATS_ADD(s->connections, delta);
+    }
+}
+
+void
+stats_count(stats_counter counter)
+{
+    struct stats_slot *s = stats_slot();
+
+    if (s) {
+        STATS_ADD(s->counters[counter], 1);
+    }
+}
+
+/**
+ * Count response to request once it has been sent (or given up on): its
+ * handler type and status code (any code a script sends outside 100 to 599
+ * counts as 500), bytes sent, and time since the request was read.
+ **/
+void
+stats_response(struct request *r)
+{
+    struct stats_slot *s = stats_slot();
+    struct timespec now;
+    uint64_t elapsed;
+    uint64_t us;
+    int bucket;
+    int code = r->code >= 100 && r->code < 600 ? r->code : 500;
+
+    if (s == NULL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - r->started.tv_sec) * 1000000000ULL + now.tv_nsec - r->started.tv_nsec;
+
+    /* Smallest power of two microseconds at least elapsed */
+    us = elapsed / 1000;
+    bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > STATS_BUCKETS) {
+        bucket = STATS_BUCKETS;
+    }
+
+    STATS_ADD(s->requests[r->type][code - 100], 1);
+    STATS_ADD(s->bytes[r->type], r->nsent);
+    STATS_ADD(s->latency[r->type][bucket], 1);
+    STATS_ADD(s->latency_sum[r->type], elapsed);
+}
+
+/**
+ * Count traced phase of a request that took elapsed nanoseconds.
+ **/
+void
+stats_phase(trace_phase phase, uint64_t elapsed)
+{
+    struct stats_slot *s = stats_slot();
+
+    if (s) {
+        STATS_ADD(s->phases[phase], elapsed);
+        STATS_ADD(s->nphases[phase], 1);
+    }
+}
+
+/**
+ * Write metrics of all workers to stream in Prometheus text format.
+ **/
+void
+stats_write(FILE *stream)
+{
+    struct stats_slot total;
+    uint64_t hits, misses, evictions;
+
+    if (Stats == NULL) {
+        return;
+    }
+    memset(&total, 0, sizeof(total));
+
+    /* Sum slots (each counter is read atomically; the sums are not a
+     * snapshot of one instant, which counters do not need) */
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        struct stats_slot *s = &Stats->slots[i];
+
+        for (int t = 0; t < STATS_TYPES; t++) {
+            for (int c = 0; c < STATS_CODES; c++) {
+                total.requests[t][c] += STATS_LOAD(s->requests[t][c]);
+            }
+            for (int b = 0; b <= STATS_BUCKETS; b++) {
+                total.latency[t][b] += STATS_LOAD(s->latency[t][b]);
+            }
+            total.bytes[t]       += STATS_LOAD(s->bytes[t]);
+            total.latency_sum[t] += STATS_LOAD(s->latency_sum[t]);
+        }
+        for (int c = 0; c < STATS_COUNTERS; c++) {
+            total.counters[c] += STATS_LOAD(s->counters[c]);
+        }
+        for (int p = 0; p < TRACE_PHASES; p++) {
+            total.phases[p]  += STATS_LOAD(s->phases[p]);
+            total.nphases[p] += STATS_LOAD(s->nphases[p]);
+        }
+        total.connections += STATS_LOAD(s->connections);
+    }
+
+    fputs("# HELP spidey_requests_total Requests answered, by handler and status.\n"
+          "# TYPE spidey_requests_total counter\n", stream);
+    for (int t = 0; t < STATS_TYPES; t++) {
+        for (int c = 0; c < STATS_CODES; c++) {
+            if (total.requests[t][c]) {
+                fprintf(stream, "spidey_requests_total{handler=\"%s\",status=\"%d\"} %lu\n",
+                        StatsTypes[t], c + 100, total.requests[t][c]);
+            }
+        }
+    }
+
+    fputs("# HELP spidey_response_bytes_total Bytes of responses sent, by handler.\n"
+          "# TYPE spidey_response_bytes_total counter\n", stream);
+    for (int t = 0; t < STATS_TYPES; t++) {
+        fprintf(stream, "spidey_response_bytes_total{handler=\"%s\"} %lu\n", StatsTypes[t], total.bytes[t]);
+    }
+
+    fputs("# HELP spidey_request_duration_seconds Time from reading a request to sending its response, by handler.\n"
+          "# TYPE spidey_request_duration_seconds histogram\n", stream);
+    for (int t = 0; t < STATS_TYPES; t++) {
+        uint64_t count = 0;
+
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            count += total.latency[t][b];
+            fprintf(stream, "spidey_request_duration_seconds_bucket{handler=\"%s\",le=\"%g\"} %lu\n",
+                    StatsTypes[t], (1 << b) / 1e6, count);
+        }
+        count += total.latency[t][STATS_BUCKETS];
+        fprintf(stream, "spidey_request_duration_seconds_bucket{handler=\"%s\",le=\"+Inf\"} %lu\n", StatsTypes[t], count);
+        fprintf(stream, "spidey_request_duration_seconds_sum{handler=\"%s\"} %.9f\n", StatsTypes[t], total.latency_sum[t] / 1e9);
+        fprintf(stream, "spidey_request_duration_seconds_count{handler=\"%s\"} %lu\n", StatsTypes[t], count);
+    }
+
+    fprintf(stream, "# HELP spidey_connections Client connections open.\n"
+                    "# TYPE spidey_connections gauge\n"
+                    "spidey_connections %ld\n", total.connections);
+
+    cache_stats(&hits, &misses, &evictions);
+    fprintf(stream, "# HELP spidey_content_cache_lookups_total Content cache lookups, by result.\n"
+                    "# TYPE spidey_content_cache_lookups_total counter\n"
+                    "spidey_content_cache_lookups_total{result=\"hit\"} %lu\n"
+                    "spidey_content_cache_lookups_total{result=\"miss\"} %lu\n"
+                    "# HELP spidey_content_cache_evictions_total Content cache entries evicted.\n"
+                    "# TYPE spidey_content_cache_evictions_total counter\n"
+                    "spidey_content_cache_evictions_total %lu\n", hits, misses, evictions);
+
+    fprintf(stream, "# HELP spidey_path_cache_lookups_total Path cache lookups, by result.\n"
+                    "# TYPE spidey_path_cache_lookups_total counter\n"
+                    "spidey_path_cache_lookups_total{result=\"hit\"} %lu\n"
+                    "spidey_path_cache_lookups_total{result=\"miss\"} %lu\n",
+                    total.counters[STATS_PATH_HITS], total.counters[STATS_PATH_MISSES]);
+
+    fprintf(stream, "# HELP spidey_access_log_dropped_total Access log lines dropped because the log buffer was full.\n"
+                    "# TYPE spidey_access_log_dropped_total counter\n"
+                    "spidey_access_log_dropped_total %lu\n", total.counters[STATS_LOG_DROPS]);
+
+    fprintf(stream, "# HELP spidey_rejected_total Connections turned away and requests shed with 503, by reason.\n"
+                    "# TYPE spidey_rejected_total counter\n"
+                    "spidey_rejected_total{reason=\"connections\"} %lu\n"
+                    "spidey_rejected_total{reason=\"client\"} %lu\n"
+                    "spidey_rejected_total{reason=\"queue\"} %lu\n"
+                    "spidey_rejected_total{reason=\"fork\"} %lu\n"
+                    "spidey_rejected_total{reason=\"delay\"} %lu\n",
+                    total.counters[STATS_REJECT_CONNECTIONS], total.counters[STATS_REJECT_CLIENT],
+                    total.counters[STATS_REJECT_QUEUE], total.counters[STATS_REJECT_FORK], total.counters[STATS_REJECT_DELAY]);
+
+    if (TraceEvery == 0) {
+        return;
+    }
+    fputs("# HELP spidey_request_phase_seconds Time spent in each phase of traced requests.\n"
+          "# TYPE spidey_request_phase_seconds summary\n", stream);
+    for (int p = 0; p < TRACE_PHASES; p++) {
+        fprintf(stream, "spidey_request_phase_seconds_sum{phase=\"%s\"} %.9f\n", trace_phase_name(p), total.phases[p] / 1e9);
+        fprintf(stream, "spidey_request_phase_seconds_count{phase=\"%s\"} %lu\n", trace_phase_name(p), total.nphases[p]);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,889 @@
+/* thor: HTTP Load Generator */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define THOR_BUFSIZ         (64 << 10)  /* Bytes read from a socket at once */
+#define THOR_HEADER_MAX     8192        /* Largest response header block */
+#define THOR_EVENTS         64          /* Events handled per epoll_wait */
+#define THOR_MAX_HEADERS    16          /* Extra request headers (-H) */
+
+#define NSEC_PER_SEC        1000000000ULL
+
+/* Latency histogram: values (in nanoseconds) below 2^HISTOGRAM_SUB_BITS are
+ * counted exactly, and above that every power of two is split into
+ * 2^(HISTOGRAM_SUB_BITS - 1) buckets, so a bucket is never wider than 1/64th
+ * of its values (HdrHistogram with two significant digits).  Values from
+ * 2^HISTOGRAM_MAX_BITS (about 18 minutes) up are counted as the largest. */
+#define HISTOGRAM_SUB_BITS  7
+#define HISTOGRAM_HALF      (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_MAX_BITS  40
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 3) * HISTOGRAM_HALF)
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;     /*< Values recorded */
+    uint64_t sum;       /*< Sum of values (for the mean) */
+    uint64_t max;       /*< Largest value (exact) */
+};
+
+typedef enum {
+    BODY_NONE,          /*< No body (304, 204, or Content-Length: 0) */
+    BODY_LENGTH,        /*< Content-Length bytes */
+    BODY_CHUNKED,       /*< Transfer-Encoding: chunked */
+    BODY_CLOSE,         /*< Everything until the server closes */
+} body_type;
+
+typedef enum {
+    CHUNK_SIZE,         /*< Reading chunk size line */
+    CHUNK_DATA,         /*< Skipping chunk data */
+    CHUNK_END,          /*< Skipping CRLF after chunk data */
+    CHUNK_TRAILER,      /*< Skipping trailer lines, until an empty one */
+} chunk_state;
+
+struct connection {
+    int         fd;             /*< Socket (-1 if not connected) */
+    bool        connected;      /*< Non-blocking connect has completed */
+    bool        writable;       /*< Watched for EPOLLOUT */
+    bool        busy;           /*< Request is in flight */
+    size_t      sent;           /*< Bytes of request written */
+    uint64_t    start;          /*< When request was sent (or due, in open loop) */
+    uint64_t    due;            /*< When next request is due (open loop) */
+    uint64_t    left;           /*< Requests still to send */
+
+    char        header[THOR_HEADER_MAX];
+    size_t      nheader;        /*< Bytes of response header block so far */
+    bool        in_body;        /*< Header block is complete */
+    int         status;         /*< Response status code */
+    body_type   body;           /*< How response body is delimited */
+    bool        close;          /*< Server closes connection after response */
+    uint64_t    remaining;      /*< Bytes left in body or current chunk */
+    chunk_state chunk;          /*< Position in chunked body */
+    bool        extension;      /*< Rest of chunk size line is ignored */
+    size_t      line;           /*< Length of current trailer line */
+};
+
+struct worker {
+    pthread_t           thread;
+    struct connection  *connections;
+    size_t              nconnections;
+    size_t              first;          /*< Index of first connection overall */
+    size_t              active;         /*< Connections with requests left */
+    size_t              retry;          /*< Connections to reconnect (closed loop) */
+    int                 efd;            /*< epoll instance */
+    char               *buffer;         /*< THOR_BUFSIZ bytes to read into */
+    struct histogram    latency;        /*< Request latencies (nanoseconds) */
+    uint64_t            requests;       /*< Responses received */
+    uint64_t            errors;         /*< Requests that failed */
+    uint64_t            non2xx;         /*< Responses that were not 2xx */
+    uint64_t            bytes;          /*< Bytes received */
+    uint64_t            finished;       /*< When last connection finished */
+};
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+} format;
+
+/* Internal Declarations */
+
+static struct addrinfo *Address     = NULL;     /*< Server address */
+static char            *Request     = NULL;     /*< Request sent on every connection */
+static size_t           RequestLength = 0;
+static size_t           Connections = 1;        /*< Concurrent connections */
+static size_t           Threads     = 1;        /*< Worker threads */
+static uint64_t         Requests    = 1000;     /*< Total requests (unless Duration) */
+static double           Duration    = 0;        /*< Seconds to run for (0: until Requests) */
+static double           Rate        = 0;        /*< Requests/second for open loop (0: closed loop) */
+static bool             KeepAlive   = true;     /*< Reuse connections */
+static format           Format      = FORMAT_TEXT;
+static uint64_t         Start       = 0;        /*< When load started */
+static uint64_t         Deadline    = 0;        /*< When load stops (0: after Requests) */
+static uint64_t         Interval    = 0;        /*< Nanoseconds between requests on one connection (open loop) */
+
+static void
+usage(const char *progname, int status)
+{
+    fprintf(stderr, "Usage: %s [hcCdHnoRt] URL\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c conns      Concurrent connections (default: 1)\n");
+    fprintf(stderr, "    -C            Close connection after every request (no keep-alive)\n");
+    fprintf(stderr, "    -d seconds    Run for seconds instead of a number of requests\n");
+    fprintf(stderr, "    -H header     Extra request header (e.g. 'Accept-Encoding: gzip'; repeatable)\n");
+    fprintf(stderr, "    -n requests   Total requests (default: 1000)\n");
+    fprintf(stderr, "    -o format     Output format: text, csv, or json (default: text)\n");
+    fprintf(stderr, "    -R rate       Open loop: send rate requests/second in all, measuring latency\n");
+    fprintf(stderr, "                  from when each was due (default: closed loop)\n");
+    fprintf(stderr, "    -t threads    Threads to spread connections over (default: 1)\n");
+    exit(status);
+}
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Histogram */
+
+static size_t
+histogram_index(uint64_t value)
+{
+    int shift;
+
+    if (value >= 1ULL << HISTOGRAM_MAX_BITS) {
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < 2 * HISTOGRAM_HALF) {
+        return value;
+    }
+    shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+    return shift * HISTOGRAM_HALF + (value >> shift);
+}
+
+/**
+ * Return largest value counted in bucket at index.
+ **/
+static uint64_t
+histogram_value(size_t index)
+{
+    uint64_t shift;
+
+    if (index < 2 * HISTOGRAM_HALF) {
+        return index;
+    }
+    shift = index / HISTOGRAM_HALF - 1;
+    return ((index - shift * HISTOGRAM_HALF + 1) << shift) - 1;
+}
+
+static void
+histogram_record(struct histogram *h, uint64_t value)
+{
+    h->counts[histogram_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void
+histogram_merge(struct histogram *h, const struct histogram *other)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        h->counts[i] += other->counts[i];
+    }
+    h->total += other->total;
+    h->sum   += other->sum;
+    if (other->max > h->max) {
+        h->max = other->max;
+    }
+}
+
+/**
+ * Return value at or below which fraction of the recorded values lie (at most
+ * the largest value recorded).
+ **/
+static uint64_t
+histogram_percentile(const struct histogram *h, double fraction)
+{
+    uint64_t target = fraction * h->total + 0.5;
+    uint64_t count = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->counts[i];
+        if (count >= target) {
+            uint64_t value = histogram_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Response Parsing */
+
+/**
+ * Parse complete response header block of connection, and decide how the
+ * body is delimited.
+ *
+ * Returns false if it is not an HTTP response.
+ **/
+static bool
+response_header(struct connection *c)
+{
+    char *line = c->header;
+    char *end  = c->header + c->nheader;
+    char *eol;
+    bool chunked = false;
+    long long length = -1;
+
+    if (c->nheader < 12 || strncmp(line, "HTTP/1.", 7) != 0) {
+        return false;
+    }
+    c->status = atoi(line + 9);
+    c->close  = line[7] == '0';
+
+    for (line = memchr(line, '\n', end - line) + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        *eol = '\0';
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = strcasestr(line + 18, "chunked") != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (strcasestr(line + 11, "close")) {
+                c->close = true;
+            } else if (strcasestr(line + 11, "keep-alive")) {
+                c->close = false;
+            }
+        }
+    }
+
+    if (c->status / 100 == 1 || c->status == 204 || c->status == 304 || length == 0) {
+        c->body = BODY_NONE;
+    } else if (chunked) {
+        c->body  = BODY_CHUNKED;
+        c->chunk = CHUNK_SIZE;
+        c->remaining = 0;
+        c->extension = false;
+    } else if (length > 0) {
+        c->body = BODY_LENGTH;
+        c->remaining = length;
+    } else {
+        c->body  = BODY_CLOSE;
+        c->close = true;
+    }
+    return true;
+}
+
+/**
+ * Consume bytes of response body.
+ *
+ * Returns true once the body is complete.
+ **/
+static bool
+response_body(struct connection *c, const char *data, size_t n)
+{
+    const char *end = data + n;
+
+    switch (c->body) {
+        case BODY_NONE:
+            return true;
+        case BODY_LENGTH:
+            if (n >= c->remaining) {
+                c->remaining = 0;
+                return true;
+            }
+            c->remaining -= n;
+            return false;
+        case BODY_CLOSE:
+            return false;
+        case BODY_CHUNKED:
+            break;
+    }
+
+    while (data < end) {
+        switch (c->chunk) {
+            case CHUNK_SIZE:
+                if (*data == '\n') {
+                    c->chunk = c->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                    c->line  = 0;
+                } else if (!c->extension && isxdigit((unsigned char) *data)) {
+                    c->remaining = c->remaining * 16 + (isdigit((unsigned char) *data) ? *data - '0' : (*data | 0x20) - 'a' + 10);
+                } else {
+                    c->extension = true;
+                }
+                data++;
+                break;
+            case CHUNK_DATA: {
+                size_t skip = (size_t) (end - data) < c->remaining ? (size_t) (end - data) : c->remaining;
+                data += skip;
+                c->remaining -= skip;
+                if (c->remaining == 0) {
+                    c->chunk = CHUNK_END;
+                }
+                break;
+            }
+            case CHUNK_END:
+                if (*data++ == '\n') {
+                    c->chunk = CHUNK_SIZE;
+                    c->extension = false;
+                }
+                break;
+            case CHUNK_TRAILER:
+                if (*data == '\n') {
+                    if (c->line == 0) {
+                        return true;
+                    }
+                    c->line = 0;
+                } else if (*data != '\r') {
+                    c->line++;
+                }
+                data++;
+                break;
+        }
+    }
+    return false;
+}
+
+/* Connections */
+
+/**
+ * Watch connection for responses, and for being writable while connecting or
+ * with request left to write (changing what is watched only when needed).
+ **/
+static void
+connection_watch(struct worker *w, struct connection *c, int op)
+{
+    bool writable = !c->connected || c->sent < RequestLength;
+    struct epoll_event event = {
+        .events   = EPOLLIN | (writable ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+
+    if (op == EPOLL_CTL_MOD && writable == c->writable) {
+        return;
+    }
+    c->writable = writable;
+    epoll_ctl(w->efd, op, c->fd, &event);
+}
+
+static void
+connection_close(struct worker *w, struct connection *c)
+{
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->connected = false;
+}
+
+static bool connection_send(struct worker *w, struct connection *c, uint64_t t);
+
+/**
+ * Finish request on connection (recording its latency unless it failed), and
+ * send the next one now (closed loop, or open loop running late), or leave
+ * it for when it is due.  After a failure the next request is always left
+ * for worker_run, so a server that refuses connections does not recurse.
+ **/
+static void
+connection_done(struct worker *w, struct connection *c, bool failed)
+{
+    uint64_t t = now();
+
+    c->busy = false;
+    if (failed) {
+        w->errors++;
+        connection_close(w, c);
+    } else {
+        histogram_record(&w->latency, t - c->start);
+        w->requests++;
+        if (c->status / 100 != 2) {
+            w->non2xx++;
+        }
+        if (c->close || !KeepAlive) {
+            connection_close(w, c);
+        }
+    }
+
+    if (--c->left == 0 || (Deadline && t >= Deadline)) {
+        c->left = 0;
+        connection_close(w, c);
+        w->active--;
+        w->finished = t;
+        return;
+    }
+    if (Rate) {
+        c->due += Interval;
+        if (failed || c->due > t) {
+            return;
+        }
+    } else if (failed) {
+        w->retry++;
+        return;
+    }
+    connection_send(w, c, t);
+}
+
+static void
+connection_write(struct worker *w, struct connection *c)
+{
+    ssize_t nwritten;
+
+    while (c->sent < RequestLength) {
+        nwritten = write(c->fd, Request + c->sent, RequestLength - c->sent);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            connection_done(w, c, true);
+            return;
+        }
+        c->sent += nwritten;
+    }
+    connection_watch(w, c, EPOLL_CTL_MOD);
+}
+
+/**
+ * Send request on connection (connecting first if need be), timed from t
+ * (or from when it was due, in open loop).
+ *
+ * Returns false if it could not be sent.
+ **/
+static bool
+connection_send(struct worker *w, struct connection *c, uint64_t t)
+{
+    c->start   = Rate ? c->due : t;
+    c->busy    = true;
+    c->sent    = 0;
+    c->nheader = 0;
+    c->in_body = false;
+
+    if (c->fd < 0) {
+        int one = 1;
+
+        c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+        if (c->fd < 0) {
+            connection_done(w, c, true);
+            return false;
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            connection_done(w, c, true);
+            return false;
+        }
+        connection_watch(w, c, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    connection_write(w, c);
+    return true;
+}
+
+/**
+ * Complete non-blocking connect once socket is writable.
+ **/
+static void
+connection_connected(struct worker *w, struct connection *c)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+        connection_done(w, c, true);
+        return;
+    }
+    c->connected = true;
+    connection_write(w, c);
+}
+
+/**
+ * Read whatever the server has sent on connection, finishing the request
+ * once its response is complete.
+ **/
+static void
+connection_read(struct worker *w, struct connection *c)
+{
+    ssize_t nread;
+
+    for (;;) {
+        nread = read(c->fd, w->buffer, THOR_BUFSIZ);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+        }
+        if (nread <= 0) {
+            if (!c->busy) {
+                /* Idle connection closed by server (keep-alive timeout) */
+                connection_close(w, c);
+            } else {
+                connection_done(w, c, !(c->in_body && c->body == BODY_CLOSE));
+            }
+            return;
+        }
+        if (!c->busy) {
+            continue;   /* Nothing was asked for */
+        }
+        w->bytes += nread;
+
+        char *data = w->buffer;
+        size_t n = nread;
+        if (!c->in_body) {
+            size_t copy = n < sizeof(c->header) - c->nheader ? n : sizeof(c->header) - c->nheader;
+            size_t from = c->nheader > 3 ? c->nheader - 3 : 0;
+            char *eoh;
+
+            memcpy(c->header + c->nheader, data, copy);
+            c->nheader += copy;
+            if ((eoh = memmem(c->header + from, c->nheader - from, "\r\n\r\n", 4)) == NULL) {
+                if (c->nheader == sizeof(c->header)) {
+                    connection_done(w, c, true);
+                    return;
+                }
+                continue;
+            }
+
+            size_t used = eoh + 4 - c->header;
+            data += copy - (c->nheader - used);
+            n    -= copy - (c->nheader - used);
+            c->nheader = used;
+            c->in_body = true;
+            if (!response_header(c)) {
+                connection_done(w, c, true);
+                return;
+            }
+        }
+        if (response_body(c, data, n)) {
+            /* Next request may be on a new socket: let epoll report it */
+            connection_done(w, c, false);
+            return;
+        }
+    }
+}
+
+/**
+ * Drive worker's connections until each has sent its share of requests (or
+ * the deadline passes).
+ **/
+static void *
+worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[THOR_EVENTS];
+    bool pwait2 = true;
+
+    for (size_t i = 0; i < w->nconnections; i++) {
+        struct connection *c = &w->connections[i];
+
+        if (c->left == 0) {
+            continue;
+        }
+        w->active++;
+        if (Rate) {
+            /* Stagger connections evenly over the first interval */
+            c->due = Start + (w->first + i) * Interval / Connections;
+        } else {
+            connection_send(w, c, now());
+        }
+    }
+
+    while (w->active > 0) {
+        uint64_t t = now();
+        uint64_t wait = UINT64_MAX;
+        int n;
+
+        if (Deadline && t >= Deadline) {
+            w->finished = t;
+            break;
+        }
+
+        /* Send requests that are due (open loop) or failed (closed loop),
+         * and wait for the next */
+        if (Rate || w->retry) {
+            for (size_t i = 0; i < w->nconnections; i++) {
+                struct connection *c = &w->connections[i];
+
+                if (c->busy || c->left == 0) {
+                    continue;
+                }
+                if (!Rate) {
+                    w->retry--;
+                    connection_send(w, c, t);
+                } else if (c->due <= t) {
+                    connection_send(w, c, t);
+                } else if (c->due - t < wait) {
+                    wait = c->due - t;
+                }
+            }
+        }
+        if (Deadline && Deadline - t < wait) {
+            wait = Deadline - t;
+        }
+
+        if (wait == UINT64_MAX) {
+            n = epoll_wait(w->efd, events, THOR_EVENTS, -1);
+        } else if (pwait2) {
+            struct timespec timeout = { wait / NSEC_PER_SEC, wait % NSEC_PER_SEC };
+
+            n = epoll_pwait2(w->efd, events, THOR_EVENTS, &timeout, NULL);
+            if (n < 0 && errno == ENOSYS) {
+                pwait2 = false;
+                continue;
+            }
+        } else {
+            /* Millisecond timeouts: spin when less than one is left */
+            n = epoll_wait(w->efd, events, THOR_EVENTS, wait / 1000000);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct connection *c = events[i].data.ptr;
+
+            if (c->fd < 0) {
+                continue;
+            }
+            if (!c->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                connection_connected(w, c);
+            } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                connection_read(w, c);
+            } else if (events[i].events & EPOLLOUT) {
+                connection_write(w, c);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < w->nconnections; i++) {
+        connection_close(w, &w->connections[i]);
+    }
+    return NULL;
+}
+
+/* Setup */
+
+/**
+ * Split http://host[:port][/path] into its parts (host and port point into
+ * url, which is modified).
+ *
+ * Returns false if url is not an http URL.
+ **/
+static bool
+parse_url(char *url, char **host, char **port, char **path)
+{
+    char *p;
+
+    if (strncmp(url, "http://", 7) != 0) {
+        return false;
+    }
+    *host = url + 7;
+    if ((p = strchr(*host, '/')) != NULL) {
+        *path = strdup(p);
+        *p = '\0';
+    } else {
+        *path = strdup("/");
+    }
+    if ((p = strrchr(*host, ':')) != NULL && strchr(p, ']') == NULL) {
+        *p = '\0';
+        *port = p + 1;
+    } else {
+        *port = "80";
+    }
+    if (**host == '[') {
+        (*host)++;
+        (*host)[strlen(*host) - 1] = '\0';
+    }
+    return **host != '\0';
+}
+
+static void
+report(struct worker *workers, double elapsed)
+{
+    struct histogram *latency = calloc(1, sizeof(struct histogram));
+    uint64_t requests = 0, errors = 0, non2xx = 0, bytes = 0;
+    double mean, p50, p90, p99, p999, max;
+
+    for (size_t i = 0; i < Threads; i++) {
+        histogram_merge(latency, &workers[i].latency);
+        requests += workers[i].requests;
+        errors   += workers[i].errors;
+        non2xx   += workers[i].non2xx;
+        bytes    += workers[i].bytes;
+    }
+
+    /* Microseconds */
+    mean = latency->total ? latency->sum / 1e3 / latency->total : 0;
+    p50  = histogram_percentile(latency, 0.50)  / 1e3;
+    p90  = histogram_percentile(latency, 0.90)  / 1e3;
+    p99  = histogram_percentile(latency, 0.99)  / 1e3;
+    p999 = histogram_percentile(latency, 0.999) / 1e3;
+    max  = latency->max / 1e3;
+
+    switch (Format) {
+        case FORMAT_TEXT:
+            printf("Requests:   %lu (%lu errors, %lu not 2xx) over %zu connections, %zu threads, %s\n",
+                   requests, errors, non2xx, Connections, Threads, Rate ? "open loop" : "closed loop");
+            printf("Elapsed:    %.3f s\n", elapsed);
+            printf("Throughput: %.1f requests/s, %.2f MB/s\n", requests / elapsed, bytes / elapsed / (1 << 20));
+            printf("Latency:    mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+                   mean, p50, p90, p99, p999, max);
+            break;
+        case FORMAT_CSV:
+            printf("connections,threads,rate,requests,errors,non2xx,seconds,requests_per_sec,bytes_per_sec,"
+                   "mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+            printf("%zu,%zu,%.0f,%lu,%lu,%lu,%.3f,%.1f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                   Connections, Threads, Rate, requests, errors, non2xx, elapsed, requests / elapsed, bytes / elapsed,
+                   mean, p50, p90, p99, p999, max);
+            break;
+        case FORMAT_JSON:
+            printf("{\"connections\": %zu, \"threads\": %zu, \"rate\": %.0f, \"requests\": %lu, \"errors\": %lu, "
+                   "\"non2xx\": %lu, \"seconds\": %.3f, \"requests_per_sec\": %.1f, \"bytes_per_sec\": %.0f, "
+                   "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+                   Connections, Threads, Rate, requests, errors, non2xx, elapsed, requests / elapsed, bytes / elapsed,
+                   mean, p50, p90, p99, p999, max);
+            break;
+    }
+    free(latency);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *progname = argv[0];
+    const char *headers[THOR_MAX_HEADERS];
+    size_t nheaders = 0;
+    char *host, *port, *path;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct worker *workers;
+    struct connection *connections;
+    uint64_t finished;
+    int status;
+
+    /* Parse command line options */
+    int place = 1;
+    while (place < argc && strlen(argv[place]) > 1 && argv[place][0] == '-') {
+        char *arg = argv[place++];
+        switch (arg[1]) {
+            case 'h':
+                usage(progname, 0);
+                break;
+            case 'c':
+                if (place >= argc) usage(progname, 1);
+                Connections = strtoul(argv[place++], NULL, 10);
+                break;
+            case 'C':
+                KeepAlive = false;
+                break;
+            case 'd':
+                if (place >= argc) usage(progname, 1);
+                Duration = strtod(argv[place++], NULL);
+                break;
+            case 'H':
+                if (place >= argc || nheaders == THOR_MAX_HEADERS) usage(progname, 1);
+                headers[nheaders++] = argv[place++];
+                break;
+            case 'n':
+                if (place >= argc) usage(progname, 1);
+                Requests = strtoull(argv[place++], NULL, 10);
+                break;
+            case 'o':
+                if (place >= argc) usage(progname, 1);
+                arg = argv[place++];
+                if (strcmp(arg, "text") == 0)       Format = FORMAT_TEXT;
+                else if (strcmp(arg, "csv") == 0)   Format = FORMAT_CSV;
+                else if (strcmp(arg, "json") == 0)  Format = FORMAT_JSON;
+                else usage(progname, 1);
+                break;
+            case 'R':
+                if (place >= argc) usage(progname, 1);
+                Rate = strtod(argv[place++], NULL);
+                break;
+            case 't':
+                if (place >= argc) usage(progname, 1);
+                Threads = strtoul(argv[place++], NULL, 10);
+                break;
+            default:
+                usage(progname, 1);
+        }
+    }
+    if (place + 1 != argc || Connections == 0 || Threads == 0 || Rate < 0 || Duration < 0 ||
+        !parse_url(argv[place], &host, &port, &path)) {
+        usage(progname, 1);
+    }
+    if (Threads > Connections) {
+        Threads = Connections;
+    }
+
+    if ((status = getaddrinfo(host, port, &hints, &Address)) != 0) {
+        fprintf(stderr, "Unable to look up %s:%s: %s\n", host, port, gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    /* Request (the same every time) */
+    FILE *rs = open_memstream(&Request, &RequestLength);
+    fprintf(rs, "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: thor\r\n", path, host, port);
+    for (size_t i = 0; i < nheaders; i++) {
+        fprintf(rs, "%s\r\n", headers[i]);
+    }
+    if (!KeepAlive) {
+        fprintf(rs, "Connection: close\r\n");
+    }
+    fprintf(rs, "\r\n");
+    fclose(rs);
+
+    /* Report failed writes as errors instead of dying */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Spread connections (and requests) evenly over threads */
+    workers     = calloc(Threads, sizeof(struct worker));
+    connections = calloc(Connections, sizeof(struct connection));
+    if (workers == NULL || connections == NULL) {
+        fprintf(stderr, "Unable to allocate %zu connections: %s\n", Connections, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < Connections; i++) {
+        connections[i].fd   = -1;
+        connections[i].left = Duration ? UINT64_MAX : Requests / Connections + (i < Requests % Connections);
+    }
+    for (size_t i = 0, first = 0; i < Threads; i++) {
+        workers[i].first        = first;
+        workers[i].connections  = connections + first;
+        workers[i].nconnections = Connections / Threads + (i < Connections % Threads);
+        workers[i].buffer       = malloc(THOR_BUFSIZ);
+        workers[i].efd          = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].buffer == NULL || workers[i].efd < 0) {
+            fprintf(stderr, "Unable to set up thread: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        first += workers[i].nconnections;
+    }
+
+    if (Rate) {
+        Interval = Connections * NSEC_PER_SEC / Rate;
+    }
+    Start    = now();
+    Deadline = Duration ? Start + Duration * NSEC_PER_SEC : 0;
+
+    for (size_t i = 0; i < Threads; i++) {
+        workers[i].finished = Start;
+        if ((status = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) != 0) {
+            fprintf(stderr, "Unable to create thread: %s\n", strerror(status));
+            return EXIT_FAILURE;
+        }
+    }
+    finished = Start;
+    for (size_t i = 0; i < Threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].finished > finished) {
+            finished = workers[i].finished;
+        }
+    }
+
+    /* At least a nanosecond, so rates stay finite */
+    report(workers, (finished > Start ? finished - Start : 1) / 1e9);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -11,6 +11,8 @@ import urllib
 
 PROCESSES = 1
 REQUESTS  = 1
+SEGMENTS  = 0
+OUTPUT    = None
 VERBOSE   = False
 URL       = None
 
@@ -23,6 +25,10 @@ def usage(status=0):
 
     -p  PROCESSES   Number of processes to utilize (1)
     -r  REQUESTS    Number of requests per process (1)
+
+    -s  SEGMENTS    Download URL as SEGMENTS concurrent byte ranges (REQUESTS
+                    times) and report throughput
+    -o  OUTPUT      Reassemble segmented download in OUTPUT
     '''.format(os.path.basename(sys.argv[0]))
     sys.exit(status)
 
@@ -42,6 +48,54 @@ def do_request(pid):
     print("Process: {}, AVERAGE   , Elapsed Time: {:.2f}".format(pid, avtime))
     return avtime
 
+def do_segment(segment):
+    start, end = segment
+    r = requests.get(URL, headers={'Range': 'bytes={}-{}'.format(start, end)}, stream=True)
+    if r.status_code != 206:
+        raise ValueError('Segment {}-{}: {}'.format(start, end, r.status_code))
+
+    if OUTPUT:
+        stream = open(OUTPUT, 'r+b')
+        stream.seek(start)
+    offset = start
+    for chunk in r.iter_content(1 << 16):
+        if OUTPUT:
+            stream.write(chunk)
+        offset = offset + len(chunk)
+    if OUTPUT:
+        stream.close()
+
+    if offset != end + 1:
+        raise ValueError('Segment {}-{}: got {} bytes'.format(start, end, offset - start))
+    return offset - start
+
+def do_download():
+    # Size from the Content-Range of a one byte range
+    r = requests.get(URL, headers={'Range': 'bytes=0-0'})
+    if r.status_code != 206:
+        print("Server does not support ranges: {}".format(r.status_code))
+        sys.exit(1)
+    size = int(r.headers['Content-Range'].split('/')[1])
+    step = max((size + SEGMENTS - 1) // SEGMENTS, 1)
+    segments = [(start, min(start + step, size) - 1) for start in range(0, size, step)]
+
+    if OUTPUT:
+        stream = open(OUTPUT, 'wb')
+        stream.truncate(size)
+        stream.close()
+
+    pool = multiprocessing.Pool(len(segments))
+    tsum = 0
+    for num in range(0, REQUESTS):
+        start = time.time()
+        nbytes = sum(pool.map(do_segment, segments))
+        timetaken = time.time() - start
+        tsum = tsum + timetaken
+        print("Download: {}, Segments: {}, Elapsed Time: {:.2f}, Throughput: {:.2f} MB/s".format(
+            num, len(segments), timetaken, nbytes / timetaken / (1 << 20)))
+
+    print("TOTAL AVERAGE THROUGHPUT: {:.2f}".format(size * REQUESTS / tsum / (1 << 20)))
+
 # Main execution
 
 if __name__ == '__main__':
@@ -57,10 +111,18 @@ if __name__ == '__main__':
             PROCESSES = int(args.pop(0))
         elif arg == '-r':
             REQUESTS = int(args.pop(0))
+        elif arg == '-s':
+            SEGMENTS = int(args.pop(0))
+        elif arg == '-o':
+            OUTPUT = args.pop(0)
         else:
             usage(1)
 
     URL = args.pop(0)
+
+    if SEGMENTS > 0:
+        do_download()
+        sys.exit(0)
     
     # Create pool of workers and perform requests
     if VERBOSE:
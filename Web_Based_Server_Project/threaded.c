@@ -0,0 +1,221 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Internal Declarations */
+
+struct connection {
+    int                     fd;     /*< Accepted client socket */
+    struct sockaddr_storage raddr;  /*< Client address */
+    socklen_t               rlen;   /*< Client address length */
+    uint64_t                queued; /*< When it was queued (monotonic_ns; 0 unless shedding by delay) */
+};
+
+/**
+ * Bounded queue of accepted connections (ring buffer).
+ **/
+struct queue {
+    struct connection *entries;
+    size_t             capacity;
+    size_t             head;        /*< Next entry to pop */
+    size_t             size;        /*< Number of queued entries */
+
+    struct codel       codel;       /*< Shedding by queueing delay */
+
+    pthread_mutex_t    lock;
+    pthread_cond_t     not_empty;
+    pthread_cond_t     not_full;
+};
+
+static pthread_barrier_t Listening;    /*< Workers have opened their listeners */
+
+static struct queue Queue = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full  = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Push connection onto queue, blocking while the queue is full, unless
+ * shedding load, in which case return false at once.
+ **/
+static bool
+queue_push(struct queue *q, struct connection *c)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->size == q->capacity) {
+        if (ShedLoad) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->entries[(q->head + q->size) % q->capacity] = *c;
+    q->size++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/**
+ * Pop connection from queue, blocking while the queue is empty.  Returns
+ * false if the connection waited so long it should be shed (see codel_shed).
+ **/
+static bool
+queue_pop(struct queue *q, struct connection *c)
+{
+    bool shed;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->size == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    *c = q->entries[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->size--;
+    shed = codel_shed(&q->codel, c->queued);
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return !shed;
+}
+
+/**
+ * Worker thread: handle connections handed off by the acceptor.
+ **/
+static void *
+threaded_worker(void *arg)
+{
+    struct queue *q = arg;
+    struct connection c;
+    struct request *request;
+
+    while (true) {
+        if (!queue_pop(q, &c)) {
+            reject_connection(c.fd);
+            continue;
+        }
+
+        /* Handle request */
+        request = new_request(c.fd, (struct sockaddr *) &c.raddr, c.rlen);
+        if (request == NULL) {
+            continue;
+        }
+        handle_connection(request);
+
+        /* Free request */
+        free_request(request);
+    }
+
+    return NULL;
+}
+
+/**
+ * Worker thread with its own listener (ReusePort): pin to a CPU, then accept
+ * and handle connections directly without going through the queue.
+ **/
+static void *
+threaded_listener(void *arg)
+{
+    struct request *request;
+    int index = (intptr_t) arg;
+    int sfd;
+
+    int cpu = pin_worker(index);
+    if ((sfd = socket_listen(Port)) < 0) {
+        fatal("Unable to open listener for worker %d", index);
+    }
+    debug("Worker %d listening on CPU %d", index, cpu);
+    pthread_barrier_wait(&Listening);
+
+    while (true) {
+        request = accept_request(sfd);
+        if (request == NULL) {
+            continue;
+        }
+        handle_connection(request);
+        free_request(request);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with a fixed pool of NWorkers threads.
+ *
+ * The calling thread accepts connections and hands the client sockets to the
+ * workers through a bounded queue of QueueDepth entries.  When the queue is
+ * full the acceptor blocks, leaving new connections in the kernel backlog,
+ * unless shedding load (ShedLoad), in which case it answers them 503 at once.
+ * Connections that waited in the queue too long are shed too (ShedDelay).
+ *
+ * With ReusePort, each worker instead opens its own listener and accepts for
+ * itself, and the calling thread closes sfd once they are all listening.
+ **/
+void
+threaded_server(int sfd)
+{
+    struct connection c;
+    pthread_t thread;
+    int status;
+
+    if (ReusePort) {
+        pthread_barrier_init(&Listening, NULL, NWorkers + 1);
+        for (intptr_t i = 0; i < NWorkers; i++) {
+            if ((status = pthread_create(&thread, NULL, threaded_listener, (void *) i)) != 0) {
+                fatal("Unable to create thread: %s", strerror(status));
+            }
+        }
+        pthread_barrier_wait(&Listening);
+        log("Started %d worker threads with their own listeners", NWorkers);
+
+        close(sfd);
+        pthread_exit(NULL);
+    }
+
+    /* Allocate connection queue */
+    Queue.capacity = QueueDepth;
+    Queue.entries  = calloc(Queue.capacity, sizeof(struct connection));
+    if (Queue.entries == NULL) {
+        fatal("Unable to allocate connection queue: %s", strerror(errno));
+    }
+
+    /* Start worker threads */
+    for (int i = 0; i < NWorkers; i++) {
+        if ((status = pthread_create(&thread, NULL, threaded_worker, &Queue)) != 0) {
+            fatal("Unable to create thread: %s", strerror(status));
+        }
+        pthread_detach(thread);
+    }
+    log("Started %d worker threads", NWorkers);
+
+    /* Accept connections and hand them off to workers */
+    while (true) {
+        c.rlen = sizeof(c.raddr);
+        c.fd   = accept(sfd, (struct sockaddr *) &c.raddr, &c.rlen);
+        if (c.fd < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        c.queued = ShedDelay ? monotonic_ns() : 0;
+        if (!queue_push(&Queue, &c)) {
+            stats_count(STATS_REJECT_QUEUE);
+            reject_connection(c.fd);
+        }
+    }
+
+    /* Close server socket and exit */
+    close(sfd);
+    exit(EXIT_SUCCESS);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,14 +1,50 @@
 #!/bin/sh                                                                                                                                                           
 
+# Compare throughput across concurrency modes.
+#
+# Set SPIDEY to a spidey binary to start a local server in each of MODES (for
+# example: SPIDEY=./spidey MODES="single prefork event uring");
+# otherwise MODES just labels the rows for a server started by hand.  ROOT is
+# generated by fixtures.sh if missing.
+#
+# Throughput is in MB/s, as measured by thor (see thor.c).
+
+HOST=${HOST:-localhost}
+PORT=${PORT:-9890}
+ROOT=${ROOT:-www}
+MODES=${MODES:-single}
+
+# Throughput in MB/s (bytes_per_sec column of thor's CSV) of 10 requests per
+# connection
+mbps() {
+        ./thor -o csv -c "$1" -n $((10 * $1)) "$2" | tail -1 | awk -F , '{ printf "%.2f", $9 / 1048576 }'
+}
+
+[ -d "$ROOT" ] || ./fixtures.sh "$ROOT" || exit 1
+
 echo "| METHOD | PROCESSES |     1KB   |   1MB  |     1GB     |"
 echo "|--------|-----------|-----------|--------|-------------|"
 
-for num in 1 2 4
+for mode in $MODES
 do
-        DIRS=$(./thor.py -r 10 -p "$num"  http://student02.cse.nd.edu:9890/test.txt | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
-        STATS=$(./thor.py -r 10 -p "$num" http://student02.cse.nd.edu:9890/officer.txt | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
-        CGIS=$(./thor.py -r 10 -p "$num" http://student02.cse.nd.edu:9890/sample.txt | tail -1 | cut -d : -f 2 | sed -e "s/ //g")
+        if [ -n "$SPIDEY" ]; then
+                $SPIDEY -c "$mode" -p "$PORT" -r "$ROOT" 2> /dev/null &
+                SERVER=$!
+                sleep 1
+        fi
+
+        for num in 1 2 4
+        do
+                DIRS=$(mbps "$num" http://$HOST:$PORT/test.txt)
+                STATS=$(mbps "$num" http://$HOST:$PORT/officer.txt)
+                CGIS=$(mbps "$num" http://$HOST:$PORT/sample.txt)
+
+                printf "| %6s | %9d | %9s | %6s | %11s |\n" "$(echo $mode | tr a-z A-Z)" "$num" "$DIRS" "$STATS" "$CGIS"
+        done
 
-        printf "| SINGLE | %9d | %9s | %6s | %11s |\n" "$num" "$DIRS" "$STATS" "$CGIS"
+        if [ -n "$SPIDEY" ]; then
+                kill "$SERVER"
+                wait "$SERVER" 2> /dev/null
+        fi
 done
 
@@ -0,0 +1,350 @@
+/* trace.c: Request Phase Tracing */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Constants */
+
+#define TRACE_RINGS     16                  /* Worker rings (more workers share them) */
+#define TRACE_SPANS     2048                /* Most recent spans kept per ring */
+#define TRACE_URISIZ    48                  /* URI recorded with request spans (truncated) */
+#define TRACE_INTERVAL  100000000           /* Nanoseconds between checks for a dump */
+
+/* Internal Declarations */
+
+/**
+ * One timed phase of a request.
+ *
+ * sequence is the position of the span in its ring plus one once the span
+ * is written, and 0 while a worker writes it, so the dump can tell a span it
+ * copied was not overwritten under it.
+ **/
+struct trace_span {
+    uint64_t sequence;
+    uint64_t start;                         /*< Nanoseconds (CLOCK_MONOTONIC) */
+    uint64_t duration;                      /*< Nanoseconds */
+    int32_t  pid;
+    int32_t  tid;
+    uint16_t phase;
+    uint16_t code;                          /*< Status code (request spans) */
+    char     uri[TRACE_URISIZ];             /*< URI (request spans) */
+};
+
+/**
+ * Spans of one worker (thread or process), overwritten oldest first.  Workers
+ * that share a ring claim positions with an atomic add, so nobody locks.
+ **/
+struct trace_ring {
+    uint64_t nspans __attribute__ ((aligned(64)));  /*< Positions claimed */
+    uint64_t nrequests;                             /*< Requests seen (for sampling) */
+    uint64_t dumped __attribute__ ((aligned(64)));  /*< Spans up to here are dumped (dump only) */
+    struct trace_span spans[TRACE_SPANS];
+};
+
+/**
+ * Rings in anonymous shared memory, mapped before any workers are forked.
+ **/
+struct trace {
+    uint32_t          nrings;               /*< Rings handed out (wraps around) */
+    int               dump;                 /*< Dump requested (set on SIGUSR2) */
+    struct trace_ring rings[TRACE_RINGS];
+};
+
+static struct trace *Trace = NULL;
+static __thread struct trace_ring *Ring = NULL;
+static __thread int32_t SpanPid = 0;        /*< Process and thread of spans recorded here */
+static __thread int32_t SpanTid = 0;
+static pid_t           TracePid  = 0;       /*< Process that dumps */
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;   /*< Held while dumping */
+
+/* Phase names (indexed by trace_phase) */
+static const char *TracePhases[] = {
+    [TRACE_REQUEST]  = "request",
+    [TRACE_ACCEPT]   = "accept",
+    [TRACE_READ]     = "read",
+    [TRACE_PARSE]    = "parse",
+    [TRACE_RESOLVE]  = "resolve",
+    [TRACE_HANDLE]   = "handle",
+    [TRACE_MIMETYPE] = "mimetype",
+    [TRACE_BODY]     = "body",
+    [TRACE_SEND]     = "send",
+};
+
+static void *trace_dumper(void *arg);
+
+/**
+ * Return name of phase (for metrics).
+ **/
+const char *
+trace_phase_name(trace_phase phase)
+{
+    return TracePhases[phase];
+}
+
+static uint64_t
+trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Let a forked child claim a ring of its own (and record its own pid).
+ **/
+static void
+trace_forked(void)
+{
+    Ring = NULL;
+}
+
+/**
+ * Ask for a dump on SIGUSR2.
+ *
+ * Any worker may receive the signal, so the request is left in shared memory
+ * for the dumper.
+ **/
+static void
+trace_hangup(int signum)
+{
+    if (Trace) {
+        __atomic_store_n(&Trace->dump, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Map rings and start dumper thread (once, before any workers are started).
+ **/
+void
+trace_init(void)
+{
+    struct trace *t;
+    struct sigaction action = { .sa_handler = trace_hangup, .sa_flags = SA_RESTART };
+    pthread_t thread;
+
+    if (TracePath == NULL) {
+        TraceEvery = 0;
+        return;
+    }
+
+    t = mmap(NULL, sizeof(struct trace), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED) {
+        log("Unable to mmap trace: %s", strerror(errno));
+        TraceEvery = 0;
+        return;
+    }
+    Trace    = t;
+    TracePid = getpid();
+
+    sigaction(SIGUSR2, &action, NULL);
+    pthread_atfork(NULL, NULL, trace_forked);
+    atexit(trace_dump);
+
+    if ((errno = pthread_create(&thread, NULL, trace_dumper, NULL)) != 0) {
+        fatal("Unable to create trace dumper: %s", strerror(errno));
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Return ring of calling worker, claiming one on first use.
+ **/
+static struct trace_ring *
+trace_ring(void)
+{
+    if (Ring == NULL) {
+        Ring    = &Trace->rings[__atomic_fetch_add(&Trace->nrings, 1, __ATOMIC_RELAXED) % TRACE_RINGS];
+        SpanPid = getpid();
+        SpanTid = syscall(SYS_gettid);
+    }
+    return Ring;
+}
+
+/**
+ * Decide whether to trace the next request on connection (one in every
+ * TraceEvery a worker handles).  If it was pipelined, it is already being
+ * read.
+ **/
+void
+trace_sample(struct request *r)
+{
+    struct trace_ring *ring = trace_ring();
+
+    r->traced = __atomic_fetch_add(&ring->nrequests, 1, __ATOMIC_RELAXED) % TraceEvery == 0;
+    memset(r->phases, 0, sizeof(r->phases));
+    if (r->traced && r->nbuffer > 0) {
+        trace_begin(r, TRACE_READ);
+    }
+}
+
+/**
+ * Start timing phase of request, unless it is already under way.  A request
+ * starts when it starts being read.
+ **/
+void
+trace_begin(struct request *r, trace_phase phase)
+{
+    if (r->phases[phase] == 0) {
+        r->phases[phase] = trace_now();
+        if (phase == TRACE_READ) {
+            r->phases[TRACE_REQUEST] = r->phases[phase];
+        }
+    }
+}
+
+/**
+ * Finish timing phase of request (if it was started): record it as a span
+ * and add it to the metrics.
+ **/
+void
+trace_end(struct request *r, trace_phase phase)
+{
+    struct trace_ring *ring = trace_ring();
+    struct trace_span *s;
+    uint64_t start = r->phases[phase];
+    uint64_t end = trace_now();
+    uint64_t pos;
+
+    if (start == 0) {
+        return;
+    }
+    r->phases[phase] = 0;
+    stats_phase(phase, end - start);
+
+    pos = __atomic_fetch_add(&ring->nspans, 1, __ATOMIC_RELAXED);
+    s   = &ring->spans[pos % TRACE_SPANS];
+
+    __atomic_store_n(&s->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->start    = start;
+    s->duration = end - start;
+    s->pid      = SpanPid;
+    s->tid      = SpanTid;
+    s->phase    = phase;
+    s->code     = r->code;
+    s->uri[0]   = '\0';
+    if (phase == TRACE_REQUEST && r->uri) {
+        strncat(s->uri, r->uri, sizeof(s->uri) - 1);
+    }
+    __atomic_store_n(&s->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write string to stream as the body of a JSON string (bytes outside ASCII
+ * escaped one by one, since a truncated URI need not be valid UTF-8).
+ **/
+static void
+trace_quote(FILE *stream, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', stream);
+            fputc(*s, stream);
+        } else if ((unsigned char) *s < 0x20 || (unsigned char) *s >= 0x7f) {
+            fprintf(stream, "\\u%04x", (unsigned char) *s);
+        } else {
+            fputc(*s, stream);
+        }
+    }
+}
+
+/**
+ * Write spans recorded since the last dump to TracePath as Chrome trace
+ * event JSON (for chrome://tracing or Perfetto), replacing the last dump.
+ * Spans a worker was overwriting while they were copied are left out.
+ **/
+void
+trace_dump(void)
+{
+    char path[PATH_MAX];
+    FILE *stream;
+    bool first = true;
+    size_t ndumped = 0;
+
+    if (Trace == NULL || getpid() != TracePid) {
+        return;
+    }
+
+    pthread_mutex_lock(&TraceLock);
+
+    /* Write next to the trace and rename, so readers never see half a dump */
+    snprintf(path, sizeof(path), "%s.tmp", TracePath);
+    if ((stream = fopen(path, "w")) == NULL) {
+        log("Unable to open trace %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&TraceLock);
+        return;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", stream);
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        struct trace_ring *ring = &Trace->rings[i];
+        uint64_t end = __atomic_load_n(&ring->nspans, __ATOMIC_ACQUIRE);
+        uint64_t pos = ring->dumped;
+
+        if (end - pos > TRACE_SPANS) {
+            pos = end - TRACE_SPANS;
+        }
+
+        for (; pos < end; pos++) {
+            struct trace_span *shared = &ring->spans[pos % TRACE_SPANS];
+            struct trace_span s;
+
+            if (__atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+                continue;
+            }
+            memcpy(&s, shared, sizeof(s));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) != pos + 1) {
+                continue;
+            }
+            s.uri[sizeof(s.uri) - 1] = '\0';
+
+            fprintf(stream, "%s\n{\"name\":\"%s\",\"cat\":\"spidey\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                    first ? "" : ",", TracePhases[s.phase], s.start / 1e3, s.duration / 1e3, s.pid, s.tid);
+            if (s.phase == TRACE_REQUEST) {
+                fputs(",\"args\":{\"uri\":\"", stream);
+                trace_quote(stream, s.uri);
+                fprintf(stream, "\",\"status\":%d}", s.code);
+            }
+            fputc('}', stream);
+            first = false;
+            ndumped++;
+        }
+        ring->dumped = end;
+    }
+    fputs("\n]}\n", stream);
+
+    if (fclose(stream) != 0 || rename(path, TracePath) < 0) {
+        log("Unable to write trace %s: %s", TracePath, strerror(errno));
+        unlink(path);
+    } else {
+        log("Wrote %zu spans to %s", ndumped, TracePath);
+    }
+    pthread_mutex_unlock(&TraceLock);
+}
+
+/**
+ * Dump trace whenever asked to, until the process exits.
+ **/
+static void *
+trace_dumper(void *arg)
+{
+    while (true) {
+        nanosleep(&(struct timespec){ .tv_nsec = TRACE_INTERVAL }, NULL);
+        if (__atomic_exchange_n(&Trace->dump, 0, __ATOMIC_RELAXED)) {
+            trace_dump();
+        }
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
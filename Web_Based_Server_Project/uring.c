@@ -0,0 +1,581 @@
+/* uring.c: io_uring HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define URING_ENTRIES   1024    /* Submission queue entries */
+#define URING_SPLICE    65536   /* Bytes spliced through pipe at a time (default pipe size) */
+
+/* Internal Declarations */
+
+/**
+ * Minimal io_uring instance (submission and completion rings mapped from the
+ * kernel).  liburing is not required: the rings are driven directly through
+ * io_uring_setup(2) and io_uring_enter(2).
+ **/
+struct ring {
+    int                  fd;
+    unsigned             pending;   /*< SQEs queued but not yet submitted */
+
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+typedef enum {
+    URING_RECV,         /* Receiving request line and headers */
+    URING_SEND,         /* Sending staged response */
+    URING_READ,         /* Reading next chunk of file body */
+    URING_SEND_BODY,    /* Sending chunk of file body */
+    URING_SPLICE_IN,    /* Splicing next part of file body into pipe */
+    URING_SPLICE_OUT,   /* Splicing file body from pipe to socket */
+    URING_WRITEV,       /* Sending response from content cache */
+} uring_op;
+
+/**
+ * Client connection: a request plus the operation it has in flight (each
+ * connection has at most one at a time).
+ **/
+struct uring_connection {
+    struct request *request;
+    uring_op        op;
+    char           *chunk;      /*< File body chunk (BUFSIZ) */
+    size_t          nchunk;     /*< Bytes in chunk */
+    size_t          nsent;      /*< Bytes of chunk sent */
+    int             pipe[2];    /*< Pipe file body is spliced through */
+    size_t          npiped;     /*< Bytes of file body in pipe */
+    struct iovec    iov[3];     /*< Rest of cached response */
+};
+
+/* Pending accept (user_data 0) */
+static struct sockaddr_storage AcceptAddress;
+static socklen_t               AcceptLength;
+
+/* File bodies are spliced rather than copied if the kernel supports it */
+static bool Splice = false;
+
+/* Shedding by queueing delay: when io_uring_enter returned (only if shedding) */
+static struct codel Codel;
+static uint64_t     Woken = 0;
+
+/* Idle sweep timer (user_data &Tick), fires once a second */
+static struct __kernel_timespec Tick = { .tv_sec = 1 };
+
+/**
+ * Set up ring with the given number of entries and map its queues.
+ *
+ * Returns 0 on success, or -1 if the kernel does not support io_uring.
+ **/
+static int
+ring_init(struct ring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t sq_size;
+    size_t cq_size;
+    char *sq;
+    char *cq;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    /* Map rings (a single mapping covers both on newer kernels) */
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            goto fail;
+        }
+    }
+
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_head  = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head  = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->pending  = 0;
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+/**
+ * Check that the kernel supports every operation in ops.
+ **/
+static bool
+ring_supported(struct ring *ring, const int *ops, size_t nops)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = probe != NULL;
+
+    if (supported && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        supported = false;
+    }
+    for (size_t i = 0; supported && i < nops; i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+/**
+ * Submit queued SQEs and wait for at least wait_nr completions.
+ **/
+static int
+ring_enter(struct ring *ring, unsigned wait_nr)
+{
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (submitted < 0) {
+        return -1;
+    }
+    ring->pending -= submitted;
+    return submitted;
+}
+
+/**
+ * Queue SQE (submitting early if the submission queue is full).
+ **/
+static struct io_uring_sqe *
+ring_sqe(struct ring *ring, int opcode, int fd, void *addr, unsigned len, uint64_t offset, void *data)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    while (tail - head > *ring->sq_mask) {
+        if (ring_enter(ring, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fatal("Unable to io_uring_enter: %s", strerror(errno));
+        }
+        if (ShedDelay) {
+            Woken = monotonic_ns();
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t) (uintptr_t) addr;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->user_data = (uint64_t) (uintptr_t) data;
+
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+/**
+ * Queue accept on server socket.
+ **/
+static void
+uring_accept(struct ring *ring, int sfd)
+{
+    struct io_uring_sqe *sqe;
+
+    AcceptLength = sizeof(AcceptAddress);
+    sqe = ring_sqe(ring, IORING_OP_ACCEPT, sfd, &AcceptAddress, 0, (uint64_t) (uintptr_t) &AcceptLength, NULL);
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * Queue idle sweep timer.
+ **/
+static void
+uring_tick(struct ring *ring)
+{
+    ring_sqe(ring, IORING_OP_TIMEOUT, -1, &Tick, 1, 0, &Tick);
+}
+
+/**
+ * Shut down clients that have been idle for longer than KeepAliveTimeout.
+ *
+ * The connection cannot be freed while its receive is still in flight, so the
+ * socket is shut down instead, which completes the receive and closes the
+ * connection through the usual path.
+ **/
+static void
+uring_sweep(void)
+{
+    for (struct request *r; (r = idle_expired(time(NULL))); ) {
+        debug("Closing idle connection from %s", r->host);
+        shutdown(r->fd, SHUT_RDWR);
+        idle_remove(r);
+    }
+}
+
+/**
+ * Queue next operation for connection based on its request state.
+ **/
+static void
+uring_queue(struct ring *ring, struct uring_connection *c)
+{
+    struct request *r = c->request;
+    struct io_uring_sqe *sqe;
+
+    switch (c->op) {
+        case URING_RECV:
+            ring_sqe(ring, IORING_OP_RECV, r->fd, r->buffer + r->nbuffer, REQUEST_BUFSIZ - r->nbuffer, 0, c);
+            break;
+        case URING_SEND:
+            sqe = ring_sqe(ring, IORING_OP_SEND, r->fd, r->output + r->nwritten, r->noutput - r->nwritten, 0, c);
+            sqe->msg_flags = r->body_length > 0 ? MSG_MORE : 0;
+            break;
+        case URING_READ:
+            ring_sqe(ring, IORING_OP_READ, r->body_fd, c->chunk, r->body_length < BUFSIZ ? r->body_length : BUFSIZ, r->body_offset, c);
+            break;
+        case URING_SEND_BODY:
+            ring_sqe(ring, IORING_OP_SEND, r->fd, c->chunk + c->nsent, c->nchunk - c->nsent, 0, c);
+            break;
+        case URING_SPLICE_IN:
+            sqe = ring_sqe(ring, IORING_OP_SPLICE, c->pipe[1], NULL, r->body_length < URING_SPLICE ? r->body_length : URING_SPLICE, (uint64_t) -1, c);
+            sqe->splice_fd_in  = r->body_fd;
+            sqe->splice_off_in = r->body_offset;
+            sqe->splice_flags  = SPLICE_F_MOVE;
+            break;
+        case URING_WRITEV:
+            ring_sqe(ring, IORING_OP_WRITEV, r->fd, c->iov, cache_iovec(r, c->iov), 0, c);
+            break;
+        case URING_SPLICE_OUT:
+            sqe = ring_sqe(ring, IORING_OP_SPLICE, r->fd, NULL, c->npiped, (uint64_t) -1, c);
+            sqe->splice_fd_in  = c->pipe[0];
+            sqe->splice_off_in = (uint64_t) -1;
+            sqe->splice_flags  = SPLICE_F_MOVE | (r->body_length > 0 ? SPLICE_F_MORE : 0);
+            break;
+    }
+}
+
+/**
+ * Release connection and its request (closing the client socket).
+ **/
+static void
+uring_close(struct uring_connection *c)
+{
+    idle_remove(c->request);
+    free_request(c->request);
+    if (c->pipe[0] >= 0) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    free(c->chunk);
+    free(c);
+}
+
+/**
+ * Handle buffered request (or shed it, if the loop is falling behind) and
+ * start sending the staged response.
+ **/
+static void
+uring_respond(struct ring *ring, struct uring_connection *c)
+{
+    struct request *r = c->request;
+
+    r->shed = codel_shed(&Codel, Woken);
+    handle_request(r);
+    fflush(r->file);
+    r->state = REQUEST_WRITING_RESPONSE;
+    TRACE_BEGIN(r, TRACE_SEND);
+
+    c->op = URING_SEND;
+    uring_queue(ring, c);
+}
+
+/**
+ * Start receiving the next request on a kept-alive connection (or handle it
+ * right away if it was pipelined behind the previous one).
+ **/
+static void
+uring_next(struct ring *ring, struct uring_connection *c)
+{
+    struct request *r = c->request;
+
+    reset_request(r);
+    c->nchunk = c->nsent = 0;
+
+    if (scan_request(r, false) != 0) {
+        uring_respond(ring, c);
+    } else {
+        c->op = URING_RECV;
+        uring_queue(ring, c);
+    }
+}
+
+/**
+ * Start the next step of the response once the previous one is complete:
+ * the rest of the staged response, then the cached response or the file body
+ * (spliced through a pipe, or else read and sent chunk by chunk), then the
+ * next part of a multipart range response, and then the next request if the
+ * connection is kept alive.
+ **/
+static void
+uring_continue(struct ring *ring, struct uring_connection *c)
+{
+    struct request *r = c->request;
+
+    if (r->nwritten < r->noutput) {
+        c->op = URING_SEND;
+    } else if (r->body_length > 0 && r->cached >= 0) {
+        c->op = URING_WRITEV;
+    } else if (c->npiped > 0) {
+        c->op = URING_SPLICE_OUT;
+    } else if (c->nsent < c->nchunk) {
+        c->op = URING_SEND_BODY;
+    } else if (r->body_length > 0 && Splice) {
+        r->state = REQUEST_STREAMING_BODY;
+        if (c->pipe[0] < 0 && pipe2(c->pipe, O_CLOEXEC) < 0) {
+            uring_close(c);
+            return;
+        }
+        c->op = URING_SPLICE_IN;
+    } else if (r->body_length > 0) {
+        r->state = REQUEST_STREAMING_BODY;
+        if (c->chunk == NULL && (c->chunk = malloc(BUFSIZ)) == NULL) {
+            uring_close(c);
+            return;
+        }
+        c->op = URING_READ;
+    } else if (next_part(r)) {
+        c->op = URING_SEND;
+    } else if (r->keepalive) {
+        uring_next(ring, c);
+        return;
+    } else {
+        uring_close(c);
+        return;
+    }
+
+    uring_queue(ring, c);
+}
+
+/**
+ * Process completion for connection operation.
+ **/
+static void
+uring_complete(struct ring *ring, struct uring_connection *c, int res)
+{
+    struct request *r = c->request;
+    int status;
+
+    idle_touch(r);
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        debug("Operation %d failed: %s", c->op, strerror(-res));
+        uring_close(c);
+        return;
+    }
+    if (res < 0) {
+        uring_queue(ring, c);
+        return;
+    }
+
+    switch (c->op) {
+        case URING_RECV:
+            r->nbuffer += res;
+            TRACE_BEGIN(r, TRACE_READ);
+            status = scan_request(r, res == 0);
+            if (status == 0) {
+                uring_queue(ring, c);
+            } else if (status < 0 && r->nbuffer == 0) {
+                uring_close(c);
+            } else {
+                uring_respond(ring, c);
+            }
+            return;
+        case URING_SEND:
+            r->nwritten += res;
+            r->nsent    += res;
+            break;
+        case URING_READ:
+            if (res == 0) {
+                debug("Unable to read body: truncated");
+                uring_close(c);
+                return;
+            }
+            c->nchunk = res;
+            c->nsent  = 0;
+            r->body_offset += res;
+            r->body_length -= res;
+            break;
+        case URING_SEND_BODY:
+            c->nsent += res;
+            r->nsent += res;
+            break;
+        case URING_SPLICE_IN:
+            if (res == 0) {
+                debug("Unable to splice body: truncated");
+                uring_close(c);
+                return;
+            }
+            c->npiped = res;
+            r->body_offset += res;
+            r->body_length -= res;
+            break;
+        case URING_SPLICE_OUT:
+            c->npiped -= res;
+            r->nsent  += res;
+            break;
+        case URING_WRITEV:
+            r->body_offset += res;
+            r->body_length -= res;
+            r->nsent       += res;
+            break;
+    }
+
+    uring_continue(ring, c);
+}
+
+/**
+ * Create connection for accepted client and queue its first receive.
+ **/
+static void
+uring_connect(struct ring *ring, int fd)
+{
+    struct uring_connection *c;
+    struct request *r;
+
+    r = new_request(fd, (struct sockaddr *) &AcceptAddress, AcceptLength);
+    if (r == NULL) {
+        return;
+    }
+    r->nonblocking = true;
+
+    c = calloc(1, sizeof(struct uring_connection));
+    r->buffer = malloc(REQUEST_BUFSIZ + REQUEST_ARENASIZ);
+    if (c == NULL || r->buffer == NULL) {
+        free(c);
+        free_request(r);
+        return;
+    }
+    r->arena = r->buffer + REQUEST_BUFSIZ;
+
+    c->request = r;
+    c->op      = URING_RECV;
+    c->pipe[0] = c->pipe[1] = -1;
+    idle_touch(r);
+    uring_queue(ring, c);
+}
+
+/**
+ * Handle HTTP requests from a single thread driven by io_uring.
+ *
+ * Accepts, socket reads and writes, and file reads are all queued as
+ * submission queue entries, and every completion that is ready is processed
+ * before the next io_uring_enter, so a busy server submits and reaps many
+ * operations per system call.  File bodies are spliced from the file to the
+ * socket through a per-connection pipe when the kernel supports it.
+ * Requests are staged in memory exactly as in EVENT mode, and a one second
+ * timer expires idle clients.
+ *
+ * If the kernel does not support io_uring (or the operations used), this
+ * falls back to event_server.
+ **/
+void
+uring_server(int sfd)
+{
+    static const int required[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_TIMEOUT };
+    static const int splice[]   = { IORING_OP_SPLICE };
+    struct ring ring;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    if (ring_init(&ring, URING_ENTRIES) < 0) {
+        log("io_uring unavailable (%s), falling back to event mode", strerror(errno));
+        event_server(sfd);
+        return;
+    }
+    if (!ring_supported(&ring, required, sizeof(required) / sizeof(required[0]))) {
+        log("io_uring operations unsupported, falling back to event mode");
+        close(ring.fd);
+        event_server(sfd);
+        return;
+    }
+    Splice = ring_supported(&ring, splice, 1);
+    debug("io_uring splice %s", Splice ? "supported" : "unsupported");
+
+    uring_accept(&ring, sfd);
+    uring_tick(&ring);
+    while (true) {
+        /* Submit queued operations and wait for completions */
+        if (ring_enter(&ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fatal("Unable to io_uring_enter: %s", strerror(errno));
+        }
+        if (ShedDelay) {
+            Woken = monotonic_ns();
+        }
+
+        /* Process every available completion */
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+
+            if (cqe->user_data == 0) {
+                if (cqe->res >= 0) {
+                    uring_connect(&ring, cqe->res);
+                } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+                    fprintf(stderr, "Unable to accept: %s\n", strerror(-cqe->res));
+                }
+                uring_accept(&ring, sfd);
+            } else if (cqe->user_data == (uintptr_t) &Tick) {
+                uring_sweep();
+                uring_tick(&ring);
+            } else {
+                uring_complete(&ring, (struct uring_connection *) (uintptr_t) cqe->user_data, cqe->res);
+            }
+
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    /* Close server socket and exit */
+    close(ring.fd);
+    close(sfd);
+    exit(EXIT_SUCCESS);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,71 +4,47 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <string.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
 /**
- * Determine mime-type from file extension
+ * Pin calling process or thread to a CPU chosen by worker index.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
- *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
- *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
- *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
- *
- * This function returns an allocated string that must be free'd.
+ * Workers are spread round-robin over the CPUs the server is allowed to run
+ * on.  Returns the CPU, or -1 on error.
  **/
-char *
-determine_mimetype(const char *path)
+int
+pin_worker(int index)
 {
-    char *ext;
-    char *mimetype = DefaultMimeType;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-    bool flag = false;   
- 
-    /* Find file extension */
-    ext = strrchr(path,'.'); 
-    if (ext == NULL) goto done;
-    ext++;       
-
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath,"r");
-    if (fs == NULL){
-        debug("Error opening file: %s", strerror(errno));
+    cpu_set_t allowed;
+    cpu_set_t pinned;
+    int ncpus;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || (ncpus = CPU_COUNT(&allowed)) == 0) {
+        return -1;
     }
-    // check if opens
-   
-     while(!flag && fgets(buffer, BUFSIZ, fs)) {
-         if (buffer[0] == '#') continue;
-         mimetype = strtok(buffer, WHITESPACE);
-        /* Scan file for matching file extensions */
-        token = strtok(NULL, WHITESPACE);
-        while (token) {
-            if (streq(token, ext)) {
-                flag = true;
-                break;
-            }
-            token = strtok(NULL, WHITESPACE);
+
+    /* Find the (index mod ncpus)th allowed CPU */
+    index %= ncpus;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            break;
         }
-    } 
- 
-done:
-    if (fs) {
-        fclose(fs);
     }
-    return strdup(mimetype);
+
+    /* With pid 0 this applies only to the calling thread */
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    if (sched_setaffinity(0, sizeof(pinned), &pinned) < 0) {
+        debug("Unable to set affinity: %s", strerror(errno));
+        return -1;
+    }
+    return cpu;
 }
 
 /**
@@ -80,22 +56,22 @@ done:
  * As a security check, if the real path does not begin with the RootPath, then
  * return NULL.
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Otherwise, store the real path in real (which must hold PATH_MAX bytes) and
+ * return it.
  **/
 char *
-determine_request_path(const char *uri)
+determine_request_path(const char *uri, char *real)
 {
-    char path[BUFSIZ];
-    char real[BUFSIZ];    
+    char path[PATH_MAX];
 
-    if ((snprintf(path, BUFSIZ, "%s%s", RootPath, uri)) < 0) return NULL;
+    if (snprintf(path, PATH_MAX, "%s%s", RootPath, uri) >= PATH_MAX) return NULL;
     
-    realpath(path, real);
-    
-    if ((strncmp(real, RootPath, strlen(RootPath))) != 0) return NULL;
+    if (realpath(path, real) == NULL) return NULL;
+
+    size_t root = strlen(RootPath);
+    if (strncmp(real, RootPath, root) != 0 || (real[root] != '\0' && real[root] != '/')) return NULL;
     
-    return strdup(real);
+    return real;
 }
 
 /**
@@ -138,6 +114,37 @@ determine_request_type(const char *path)
     return REQUEST_BAD;
 }
 
+/**
+ * Determine Cache-Control value for path (under RootPath) from the policy
+ * with the longest prefix covering it.
+ *
+ * Returns NULL if no policy covers path.
+ **/
+const char *
+determine_cache_control(const char *path)
+{
+    const char *relative = path + strlen(RootPath);
+    const char *directives = NULL;
+    size_t longest = 0;
+
+    if (*relative == '\0') {
+        relative = "/";
+    }
+
+    for (int i = 0; i < NCachePolicies; i++) {
+        const char *prefix = CachePolicies[i].prefix;
+        size_t length = strlen(prefix);
+
+        if (strncmp(relative, prefix, length) == 0 &&
+            (relative[length] == '\0' || relative[length] == '/' || streq(prefix, "/")) &&
+            (directives == NULL || length > longest)) {
+            directives = CachePolicies[i].directives;
+            longest    = length;
+        }
+    }
+    return directives;
+}
+
 /**
  * Return static string corresponding to HTTP Status code
  *
@@ -149,13 +156,30 @@ http_status_string(http_status status)
     const char *status_string;
     
     if (status == HTTP_STATUS_OK) status_string = "200 OK";
+    else if (status == HTTP_STATUS_PARTIAL_CONTENT) status_string = "206 Partial Content";
+    else if (status == HTTP_STATUS_NOT_MODIFIED) status_string = "304 Not Modified";
     else if (status == HTTP_STATUS_BAD_REQUEST) status_string = "400 Bad Request";
     else if (status == HTTP_STATUS_NOT_FOUND) status_string = "404 Not Found";
+    else if (status == HTTP_STATUS_RANGE_NOT_SATISFIABLE) status_string = "416 Range Not Satisfiable";
     else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR) status_string = "500 Internal Server Error";
+    else if (status == HTTP_STATUS_BAD_GATEWAY) status_string = "502 Bad Gateway";
+    else if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) status_string = "503 Service Unavailable";
 
     return status_string;
 }
 
+/**
+ * Return monotonic clock in nanoseconds.
+ **/
+uint64_t
+monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  **/